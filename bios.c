@@ -2,7 +2,10 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <string.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <time.h>
 #include <sys/select.h>
@@ -25,7 +28,8 @@
 	Basic idea:
 	- Each core is simulated by a pthread
 	- One POSIX timer per core thread
-	- Core threads mask all signals except for USR1.
+	- Core threads mask all signals except for USR1. Interrupts are
+	masked by a per-thread flag, when possible.
 	- The PIC thread receives all signals and dispatches them to
 	the right core thread by raising SIGUSR1.
 
@@ -36,6 +40,11 @@
 #define CORE_STATISTICS
 #endif
 
+/* Mask interrupts without system calls, see cpu_disable_interrupts() */
+#if defined(__x86_64__)
+#define SOFT_INTERRUPT_MASK
+#endif
+
 
 /*
 	Per-core data.
@@ -123,7 +132,12 @@ static void initialize()
 	physical_cores = get_nprocs();
 
 	USR1_sigaction.sa_sigaction = sigusr1_handler;
+#if defined(SOFT_INTERRUPT_MASK)
+	/* SIGUSR1 is not blocked in the handler; the interrupt flag is set instead */
+	USR1_sigaction.sa_flags = SA_SIGINFO | SA_NODEFER;
+#else
 	USR1_sigaction.sa_flags = SA_SIGINFO;
+#endif
 	sigemptyset(& USR1_sigaction.sa_mask);
 
 	/* Create the sigmask to block all signals, except USR1 */
@@ -157,6 +171,46 @@ static inline Core* curr_core() {
 }
 
 
+/*
+	Interrupt masking.
+
+	On x86-64, interrupts are masked in software. Each core thread has a
+	flag, and the signal handler leaves the interrupts pending when it 
+	finds the flag set; cpu_enable_interrupts() dispatches them later.
+	Thus, disabling and enabling interrupts makes no system call. SIGUSR1
+	stays unblocked, except while the core halts.
+
+	The flag is only accessed by single instructions relative to %fs. 
+	A signal handler may switch contexts, and the interrupted code may 
+	resume on another core thread, so its address cannot be kept in a 
+	register.
+ */
+#if defined(SOFT_INTERRUPT_MASK)
+
+static _Thread_local int intr_disabled __attribute__((used));
+
+/* Set the flag, and return its old value */
+static inline int intr_disabled_swap(int value)
+{
+	__asm__ __volatile__("xchgl %0, %%fs:intr_disabled@tpoff" : "+r"(value) : : "memory");
+	return value;
+}
+
+static inline int intr_disabled_get()
+{
+	int value;
+	__asm__ __volatile__("movl %%fs:intr_disabled@tpoff, %0" : "=r"(value) : : "memory");
+	return value;
+}
+
+static inline void intr_disabled_clear()
+{
+	__asm__ __volatile__("movl $0, %%fs:intr_disabled@tpoff" : : : "memory");
+}
+
+#endif
+
+
 /*
 	Cause PIC daemon to loop. This needs to happen when we wish 
 	the PIC daemon to refresh the list of fds it is polling.
@@ -189,6 +243,11 @@ static void* core_thread(void* _core)
 
 	/* Set core signal mask */
 	CHECKRC(pthread_sigmask(SIG_BLOCK, &core_signal_set, NULL));
+#if defined(SOFT_INTERRUPT_MASK)
+	/* The core starts with interrupts disabled */
+	intr_disabled_swap(1);
+	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+#endif
 
 	/* create a thread-specific timer */
 	core->timer_sigevent.sigev_notify = SIGEV_SIGNAL;
@@ -353,7 +412,14 @@ static void sigusr1_handler(int signo, siginfo_t* si, void* ctx)
 	core->irq_count++;
 #endif
 
+#if defined(SOFT_INTERRUPT_MASK)
+	/* If interrupts are disabled, they stay pending */
+	if(intr_disabled_swap(1)) return;
 	dispatch_interrupts(core);
+	cpu_enable_interrupts();
+#else
+	dispatch_interrupts(core);
+#endif
 }
 
 
@@ -992,11 +1058,25 @@ uint cpu_cores()
 	return ncores;
 }
 
+uint cpu_physical_cores()
+{
+	return physical_cores;
+}
+
+void cpu_spin_yield()
+{
+	if(ncores > physical_cores)
+		sched_yield();
+}
+
 
 
 void cpu_core_halt()
 {
 	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, NULL));
+#if defined(SOFT_INTERRUPT_MASK)
+	intr_disabled_swap(1);
+#endif
 
 	Core* core = curr_core();
 	uint32_t cmask = 1 << cpu_core_id;
@@ -1017,6 +1097,14 @@ void cpu_core_halt()
 	/* Sleep for 10 msec */
 	//struct timespec halt_time = {.tv_sec=0l, .tv_nsec=10000000l};
 	//int rc = sigtimedwait(&sigusr1_set, &info, &halt_time);
+#if defined(SOFT_INTERRUPT_MASK)
+	/* 
+		The signal of an interrupt raised while interrupts were disabled
+		has been taken by the handler. Interrupts are dispatched below.
+	*/
+	int rc = (core->intr_pending == 0) ? sigwaitinfo(&sigusr1_set, &info) : 0;
+	assert(rc>=0 || errno == EINTR || errno == EAGAIN);
+#else
 	int rc = sigwaitinfo(&sigusr1_set, &info);
 
 	if(rc>0) {
@@ -1026,6 +1114,7 @@ void cpu_core_halt()
 	else {
 		assert(rc==-1 &&  (errno == EINTR || errno == EAGAIN));
 	}
+#endif
 
 #if defined(CORE_STATISTICS)
 	/* Unset halt bit */
@@ -1035,6 +1124,9 @@ void cpu_core_halt()
 	__atomic_fetch_and(& halt_vector, ~cmask, __ATOMIC_RELAXED);
 
 	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+#if defined(SOFT_INTERRUPT_MASK)
+	cpu_enable_interrupts();
+#endif
 }
 
 static int __core_restart(uint c)
@@ -1092,12 +1184,38 @@ void cpu_ici(uint core)
 
 void cpu_interrupt_handler(Interrupt interrupt, interrupt_handler handler)
 {
-	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, &curss));
+	int enabled = cpu_disable_interrupts();
 	curr_core()->intvec[interrupt] = handler;
-	CHECKRC(pthread_sigmask(SIG_SETMASK, &curss, NULL));
+	if(enabled) cpu_enable_interrupts();
 }
 
+#if defined(SOFT_INTERRUPT_MASK)
+
+int cpu_interrupts_enabled()
+{
+	return intr_disabled_get()==0;
+}
+
+int cpu_disable_interrupts()
+{
+	return intr_disabled_swap(1)==0;
+}
+
+void cpu_enable_interrupts()
+{
+	while(1) {
+		intr_disabled_clear();
+
+		/* An interrupt that came while we were disabled is still pending */
+		if(curr_core()->intr_pending == 0) return;
+
+		intr_disabled_swap(1);
+		dispatch_interrupts(curr_core());
+	}
+}
+
+#else
+
 int cpu_interrupts_enabled()
 {
 	sigset_t curss;
@@ -1117,6 +1235,91 @@ void cpu_enable_interrupts()
 	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
 }
 
+#endif
+
+
+#if defined(__x86_64__)
+
+/*
+	The hand-written context switch.
+
+	cpu_swap_context pushes the callee-saved registers and the SSE/x87
+	control words on the current stack, stores the stack pointer in oldctx,
+	loads the one of newctx, and pops the same things from there. Unlike
+	swapcontext, it makes no system call; the signal mask stays as it is.
+
+	A new context starts at cpu_context_start, with the thread function in
+	%r12 and a frame laid out as if it had been switched out.
+*/
+void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx);
+void cpu_context_start();
+
+__asm__(
+	".text\n"
+	".globl cpu_swap_context\n"
+	".type cpu_swap_context, @function\n"
+	"cpu_swap_context:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq (%rsi), %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size cpu_swap_context, .-cpu_swap_context\n"
+
+	".globl cpu_context_start\n"
+	".type cpu_context_start, @function\n"
+	"cpu_context_start:\n"
+	"	callq *%r12\n"
+	"	ud2\n"
+	".size cpu_context_start, .-cpu_context_start\n"
+);
+
+/* The initial frame of a context, in the order cpu_swap_context pops it */
+struct context_frame {
+	uint32_t mxcsr;
+	uint16_t fpucw, pad;
+	void* r15; void* r14; void* r13; void* r12;
+	void* rbx; void* rbp;
+	void (*ret)();
+	void* align;
+};
+
+void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
+{
+	/* 
+		Past the 'ret', the stack must be 16-byte aligned, for the call 
+		to ctx_func to follow the ABI.
+	*/
+	uintptr_t top = ((uintptr_t)ss_sp + ss_size) & ~(uintptr_t)15;
+	struct context_frame* frame = 
+		(struct context_frame*) (top - 16 - offsetof(struct context_frame, align));
+
+	memset(frame, 0, sizeof(*frame));
+	frame->mxcsr = 0x1F80;	/* All SSE exceptions masked */
+	frame->fpucw = 0x037F;	/* All x87 exceptions masked, extended precision */
+	frame->r12 = (void*) ctx_func;
+	frame->ret = cpu_context_start;
+
+	ctx->sp = frame;
+}
+
+#else
 
 void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
 {
@@ -1140,6 +1343,8 @@ void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
 	swapcontext(oldctx, newctx);
 }
 
+#endif
+
 
 
 /*
@@ -302,6 +302,24 @@ extern _Thread_local uint cpu_core_id;
  */
 uint cpu_cores();
 
+/**
+	@brief Returns the number of processors of the host.
+
+	Simulated cores beyond this number do not run in parallel, which
+	matters to some heuristics.
+ */
+uint cpu_physical_cores();
+
+/**
+	@brief Let the host run other cores, from a long spin-wait.
+
+	This models the pause-loop exiting of virtualized processors: when
+	there are more simulated cores than host processors, a core that spins
+	waiting for another core gives its host processor away. Otherwise,
+	it does nothing.
+ */
+void cpu_spin_yield();
+
 
 /**
 	@brief Barrier synchronization for all cores.
@@ -407,8 +425,16 @@ void cpu_core_restart_all();
 
 /**
 	@brief A type for saving CPU context into.
+
+	On x86-64, the context is switched by hand: the callee-saved registers
+	are pushed on the stack of the thread, and only the stack pointer is 
+	kept here. Elsewhere, the ucontext functions of glibc are used.
 */
+#if defined(__x86_64__)
+typedef struct { void* sp; } cpu_context_t;
+#else
 typedef ucontext_t cpu_context_t;
+#endif
 
 
 /**
@@ -430,6 +456,11 @@ void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, voi
 	Save the current context into @c oldctx and load the contents of @c newctx
 	into the CPU.
 
+	The signal mask is not part of the context on x86-64. This must be 
+	called with interrupts disabled, and the new context resumes with
+	interrupts disabled as well. A new context starts with the signal mask
+	of the caller.
+
 	@param oldctx pointer to the storage for the old context
 	@param newctx pointer to the new context to be loaded
 */
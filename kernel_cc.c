@@ -29,35 +29,208 @@
  	Therefore, we can call the same function from both the preemptive and
  	the non-preemptive domain of the kernel.
 
+ 	With preemption on, a waiter spins only while the owner is the current 
+ 	thread of some core, and for no longer than about twice the recent 
+ 	waits on the mutex; then it yields. When the VM has more cores than the 
+ 	host, the owner may have lost its host cpu anyway, so waiters yield at once.
+
  	The implementation is based on GCC atomics, as the standard C11 primitives
  	are not supported by all recent compilers. Eventually, this will change.
  */
-void Mutex_Lock(Mutex* lock)
-{
-#define MUTEX_SPINS (cpu_cores()>1 ?  1000 : 10000)
 
-  while(__atomic_test_and_set(lock,__ATOMIC_ACQUIRE)) {
-    int spin=MUTEX_SPINS;
-    while(__atomic_load_n(lock, __ATOMIC_RELAXED)) {
+#define MUTEX_SPIN_MAX 10000
+#define MUTEX_SPIN_SLOTS 64
+
+/* The recent spins to acquire, for mutexes hashed by address */
+static int mutex_spins[MUTEX_SPIN_SLOTS];
+
+static inline void cpu_relax()
+{
 #if defined(__x86__) || defined(__x86_64__)
-      __builtin_ia32_pause();
+  __builtin_ia32_pause();
 #endif
-      if(spin>0) 
-      	spin--; 
-      else { 
-      	spin=MUTEX_SPINS; 
-      	if(cpu_interrupts_enabled())
-      		yield(SCHED_MUTEX); 
+}
+
+void Mutex_Lock(Mutex* lock)
+{
+  TCB* self = cur_thread_fast();
+  Mutex me = (self != NULL) ? (Mutex)self : MUTEX_ANON;
+  Mutex unlocked = MUTEX_INIT;
+
+  if(__atomic_compare_exchange_n(lock, &unlocked, me, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    return;
+
+  int* estimate = &mutex_spins[((uintptr_t)lock / sizeof(Mutex)) % MUTEX_SPIN_SLOTS];
+  int oversubscribed = cpu_cores() > cpu_physical_cores();
+
+  do {
+    unlocked = MUTEX_INIT;
+    int budget = oversubscribed ? 0 : 2 * __atomic_load_n(estimate, __ATOMIC_RELAXED) + 16;
+    if(budget > MUTEX_SPIN_MAX) budget = MUTEX_SPIN_MAX;
+
+    int spin = 0;
+    Mutex owner;
+    while((owner = __atomic_load_n(lock, __ATOMIC_RELAXED)) != MUTEX_INIT) {
+      if(! cpu_interrupts_enabled()) {
+        /* Spinlock mode */
       }
+      else if(spin % 64 == 0 && owner != MUTEX_ANON && ! thread_is_running((TCB*) owner)) {
+        /* A waiter that lent its priority to the owner is not demoted */
+        yield(mutex_lend_priority(lock) ? SCHED_USER : SCHED_MUTEX);
+        spin = 0;
+        continue;
+      }
+      else if(spin >= budget) {
+        /* The owner is running; over-subscribed waiters just let it have the host */
+        int lent = mutex_lend_priority(lock);
+        yield((oversubscribed || lent) ? SCHED_USER : SCHED_MUTEX);
+        spin = 0;
+        continue;
+      }
+      cpu_relax();
+      spin++;
     }
-  }
-#undef MUTEX_SPINS
+
+    /* Adapt to the waits on this mutex, as in glibc's adaptive mutexes */
+    int old = __atomic_load_n(estimate, __ATOMIC_RELAXED);
+    __atomic_store_n(estimate, old + (spin - old) / 8, __ATOMIC_RELAXED);
+
+  } while(! __atomic_compare_exchange_n(lock, &unlocked, me, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
 }
 
 
 void Mutex_Unlock(Mutex* lock)
 {
-  __atomic_clear(lock, __ATOMIC_RELEASE);
+  Mutex owner = __atomic_load_n(lock, __ATOMIC_RELAXED);
+  __atomic_store_n(lock, MUTEX_INIT, __ATOMIC_RELEASE);
+
+  /* Give back a priority lent to us for this mutex */
+  if(owner > MUTEX_ANON && __atomic_load_n(&((TCB*)owner)->lent_for, __ATOMIC_RELAXED) == lock)
+    mutex_restore_priority((TCB*)owner, lock);
+}
+
+/*
+	Queued (MCS) spinlocks.
+	-----------------------
+
+	A waiter appends a node to the queue of the lock and spins on that 
+	node, until the previous holder passes the lock to it. Since the lock
+	is held with preemption off, a core nests only a few locks at a time,
+	so every core has a small array of nodes for its locks.
+
+	When the VM has more cores than the host has processors, passing the 
+	lock in FIFO order means a host context switch for every handoff, to 
+	a waiter that is not running. Then, the lock is a test-and-set lock, 
+	whose tail is a shared dummy node while it is held, unless 
+	spinlock_force_mcs() was called.
+ */
+
+#define SPINLOCK_NESTING 8
+#define SPINLOCK_SPINS 128
+
+/** \cond HELPER A queue node of a Spinlock */
+typedef struct spinlock_node {
+	struct spinlock_node* next;	/* the next waiter */
+	int locked;					/* set until the lock is passed to us */
+	int busy;					/* the node is in use by this core */
+} __attribute__((aligned(64))) spinlock_node;
+/** \endcond */
+
+static spinlock_node spinlock_nodes[MAX_CORES][SPINLOCK_NESTING];
+static spinlock_node spinlock_tas;
+static int spinlock_mcs_forced = 0;
+
+void spinlock_force_mcs(int force)
+{
+	spinlock_mcs_forced = force;
+}
+
+/* Use the test-and-set lock */
+static inline int spinlock_use_tas()
+{
+	return ! spinlock_mcs_forced && cpu_cores() > cpu_physical_cores();
+}
+
+static inline spinlock_node* spinlock_node_get()
+{
+	spinlock_node* nodes = spinlock_nodes[cpu_core_id];
+	for(int i=0; i<SPINLOCK_NESTING; i++)
+		if(! nodes[i].busy) {
+			nodes[i].busy = 1;
+			nodes[i].next = NULL;
+			nodes[i].locked = 1;
+			return &nodes[i];
+		}
+	assert(0 && "Too many nested spinlocks");
+	return NULL;
+}
+
+void Spinlock_Lock(Spinlock* lock)
+{
+	if(spinlock_use_tas()) {
+		spinlock_node* unlocked = NULL;
+		while(! __atomic_compare_exchange_n(&lock->tail, &unlocked, &spinlock_tas, 0, 
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			for(int spin=1; __atomic_load_n(&lock->tail, __ATOMIC_RELAXED) != NULL; spin++) {
+				cpu_relax();
+				if(spin % SPINLOCK_SPINS == 0)
+					cpu_spin_yield();
+			}
+			unlocked = NULL;
+		}
+		lock->holder = &spinlock_tas;
+		return;
+	}
+
+	spinlock_node* node = spinlock_node_get();
+	spinlock_node* prev = __atomic_exchange_n(&lock->tail, node, __ATOMIC_ACQ_REL);
+	if(prev != NULL) {
+		__atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+		while(__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE))
+			cpu_relax();
+	}
+	lock->holder = node;
+}
+
+int Spinlock_TryLock(Spinlock* lock)
+{
+	if(__atomic_load_n(&lock->tail, __ATOMIC_RELAXED) != NULL)
+		return 0;
+	spinlock_node* node = spinlock_use_tas() ? &spinlock_tas : spinlock_node_get();
+	spinlock_node* unlocked = NULL;
+	if(__atomic_compare_exchange_n(&lock->tail, &unlocked, node, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		lock->holder = node;
+		return 1;
+	}
+	if(node != &spinlock_tas)
+		node->busy = 0;
+	return 0;
+}
+
+void Spinlock_Unlock(Spinlock* lock)
+{
+	spinlock_node* node = lock->holder;
+	if(node == &spinlock_tas) {
+		__atomic_store_n(&lock->tail, NULL, __ATOMIC_RELEASE);
+		return;
+	}
+
+	spinlock_node* next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+
+	if(next == NULL) {
+		/* No known waiter: try to leave the lock free */
+		spinlock_node* tail = node;
+		if(__atomic_compare_exchange_n(&lock->tail, &tail, NULL, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+			node->busy = 0;
+			return;
+		}
+		/* A waiter is linking itself behind us */
+		while((next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) == NULL)
+			cpu_relax();
+	}
+
+	__atomic_store_n(&next->locked, 0, __ATOMIC_RELEASE);
+	node->busy = 0;
 }
 
 
@@ -194,10 +367,38 @@ void Cond_Signal(CondVar* cv)
 }
 
 
+/* Cond_Broadcast wakes up the waiters in batches of this size */
+#define BROADCAST_BATCH 64
+
 void Cond_Broadcast(CondVar* cv)
 {
+  __cv_waiter* batch[BROADCAST_BATCH];
+  TCB* tcbs[BROADCAST_BATCH];
+  int woken[BROADCAST_BATCH];
+
   Mutex_Lock(&(cv->waitset_lock));
-  while(cv->waitset) cv_signal(cv);
+
+  /* Detach the whole ring */
+  __cv_waiter* ring = cv->waitset;
+  cv->waitset = NULL;
+
+  while(ring) {
+    int n = 0;
+    while(ring && n < BROADCAST_BATCH) {
+      __cv_waiter* waiter = ring;
+      ring = (waiter->node.next == &waiter->node) ? NULL : waiter->node.next->obj;
+      rlist_remove(& waiter->node);
+      waiter->removed = 1;
+      batch[n] = waiter;
+      tcbs[n] = waiter->thread;
+      n++;
+    }
+
+    wakeup_batch(tcbs, n, woken);
+    for(int i = 0; i < n; i++)
+      batch[i]->signalled = woken[i];
+  }
+
   Mutex_Unlock(&(cv->waitset_lock));
 }
 
@@ -214,60 +415,134 @@ void Cond_Broadcast(CondVar* cv)
 /**
  * @brief The kernel lock.
  *
- * Kernel locking is provided by a semaphore, implemented as a monitor.
- * A semaphre for kernel locking has advantages over a simple mutex. 
- * The main advantage is that @c kernel_mutex is held for a very short time
- * regardless of contention. Thus, in multicore machines, it allows for cores
- * to be passed to other threads. 
- * 
+ * The kernel lock is a queued handoff lock, implemented as a monitor.
+ * As with a semaphore, @c kernel_mutex is held for a very short time
+ * regardless of contention, so waiting threads sleep and their cores
+ * are passed to other threads.
+ *
+ * Waiters sleep in FIFO order, and @c kernel_unlock() passes the lock
+ * directly to the oldest waiter, which owns it when it wakes up. Thus,
+ * a woken thread never loses a race to new arrivals and has to wait
+ * again, which is what builds convoys behind a contended semaphore.
+ *
+ * With @c kernel_lock_barging(max), a thread arriving while the lock is
+ * free takes it ahead of the waiters, at most @c max times in a row. The
+ * oldest waiter is woken to compete, and after @c max barges it is 
+ * handed the lock.
  */
 
-/* This mutex is used to implement the kernel semaphore as a monitor. */
+/* This mutex is used to implement the kernel lock as a monitor. */
 static Mutex kernel_mutex = MUTEX_INIT;
 
-/* Semaphore counter */
-static int kernel_sem = 1;
+/** \cond HELPER A thread waiting for the kernel lock */
+typedef struct kernel_waiter {
+	rlnode node;		/* in kernel_queue */
+	TCB* thread;		/* the waiting thread */
+	int granted;		/* the lock was handed to us */
+} kernel_waiter;
+/** \endcond */
+
+/* The lock is owned by some thread */
+static int kernel_held = 0;
+
+/* The waiters, oldest first */
+static rlnode kernel_queue = { .obj = NULL, .prev = &kernel_queue, .next = &kernel_queue };
+
+/* Barges allowed ahead of the oldest waiter, and barges so far */
+static int kernel_barge_max = 0;
+static int kernel_barges = 0;
+
+void kernel_lock_barging(int max)
+{
+	kernel_barge_max = (max > 0) ? max : 0;
+}
+
+/* Acquire the kernel lock. Called and returns with kernel_mutex held. */
+static void kernel_acquire_locked()
+{
+	int waiters = ! is_rlist_empty(&kernel_queue);
+	if(! kernel_held && (! waiters || kernel_barges < kernel_barge_max)) {
+		kernel_barges += waiters;
+		kernel_held = 1;
+		return;
+	}
+
+	kernel_waiter w = { .thread = cur_thread(), .granted = 0 };
+	rlnode_init(&w.node, &w);
+	rlist_push_back(&kernel_queue, &w.node);
 
-/* Semaphore condition */
-static CondVar kernel_sem_cv = COND_INIT;
+	while(1) {
+		sleep_releasing(STOPPED, &kernel_mutex, SCHED_USER, NO_TIMEOUT);
+		Mutex_Lock(&kernel_mutex);
+		if(w.granted)
+			return;
+
+		/* When barging, the oldest waiter is woken to compete */
+		if(! kernel_held && kernel_queue.next == &w.node) {
+			rlist_remove(&w.node);
+			kernel_barges = 0;
+			kernel_held = 1;
+			return;
+		}
+	}
+}
+
+/* Release the kernel lock. Called with kernel_mutex held. */
+static void kernel_release_locked()
+{
+	if(is_rlist_empty(&kernel_queue)) {
+		kernel_held = 0;
+		return;
+	}
+
+	kernel_waiter* w = kernel_queue.next->obj;
+	if(kernel_barges < kernel_barge_max) {
+		kernel_held = 0;
+	}
+	else {
+		/* Hand the lock over; it stays held */
+		rlist_remove(&w->node);
+		w->granted = 1;
+		kernel_barges = 0;
+	}
+	wakeup(w->thread);
+}
 
 void kernel_lock()
 {
 	Mutex_Lock(& kernel_mutex);
-	while(kernel_sem<=0) {
-		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
-	}
-	kernel_sem--;
+	kernel_acquire_locked();
 	Mutex_Unlock(& kernel_mutex);
 }
 
 void kernel_unlock()
 {
 	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);
+	kernel_release_locked();
 	Mutex_Unlock(& kernel_mutex);
 }
 
 int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
 	const char* wchan_name, TimerDuration timeout)
 {
-	/* Atomically release kernel semaphore */
+	/* Atomically release the kernel lock */
 	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);	
+	kernel_release_locked();
 
 	int ret = cv_wait(&kernel_mutex, cv, cause, timeout);
 
-	/* Reacquire kernel semaphore */
-	while(kernel_sem<=0)
-		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
-	kernel_sem--;
+	/* Reacquire the kernel lock */
+	kernel_acquire_locked();
 	Mutex_Unlock(& kernel_mutex);		
 
 	return ret;
 }
 
+int kernel_wait_on(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause)
+{
+	return cv_wait(mx, cv, cause, NO_TIMEOUT);
+}
+
 void kernel_signal(CondVar* cv) 
 { 
 	Cond_Signal(cv); 
@@ -278,11 +553,27 @@ void kernel_broadcast(CondVar* cv)
 	Cond_Broadcast(cv); 
 }
 
+void kernel_handoff(CondVar* cv)
+{
+	Mutex_Lock(&(cv->waitset_lock));
+	__cv_waiter* waiter = cv->waitset;
+	if(waiter != NULL && waiter->node.next == &waiter->node) {
+		/* A single waiter: wake it up on this core, to switch to it */
+		remove_from_ring(cv, waiter);
+		waiter->removed = 1;
+		waiter->signalled = wakeup_handoff(waiter->thread);
+		Mutex_Unlock(&(cv->waitset_lock));
+	}
+	else {
+		Mutex_Unlock(&(cv->waitset_lock));
+		Cond_Broadcast(cv);
+	}
+}
+
 void kernel_sleep(Thread_state newstate, enum SCHED_CAUSE cause)
 {
 	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);
+	kernel_release_locked();
 	sleep_releasing(newstate, &kernel_mutex, cause, NO_TIMEOUT);
 }
 
@@ -30,6 +30,15 @@
 #include "kernel_sched.h"
 
 
+/**
+	@brief The value of a mutex locked outside a normal thread.
+
+	A locked @c Mutex holds the TCB of its owner, or this value when the
+	owner is not known (an idle thread, or the boot code).
+ */
+#define MUTEX_ANON ((Mutex)1)
+
+
 
 
 /*
@@ -47,6 +56,17 @@ void kernel_lock();
  */
 void kernel_unlock();
 
+/**
+	@brief Let threads barge into the kernel lock, at most @c max times in a row.
+
+	By default (@c max==0), @c kernel_unlock() hands the kernel lock to the
+	thread that has waited longest. With @c max>0, a thread that finds the 
+	lock free takes it, even ahead of waiting threads, unless the oldest 
+	waiter has been passed over @c max times. This trades fairness for 
+	fewer context switches. It should be called before @c boot().
+ */
+void kernel_lock_barging(int max);
+
 /**
 	@brief Wait on a condition variable using the kernel lock.
 	@returns 1 if signalled, 0 if not
@@ -59,6 +79,15 @@ int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause,
 #define kernel_timedwait(cv, cause, timeout) \
 	kernel_wait_wchan((cv),(cause),__FUNCTION__, (timeout))
 
+/**
+	@brief Wait on a condition variable using the lock of a kernel object.
+
+	Stream objects whose methods run without the kernel lock (see 
+	@c file_ops) wait with this instead of @c kernel_wait().
+	@returns 1 if signalled, 0 if not
+  */
+int kernel_wait_on(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause);
+
 /**
 	@brief Signal a kernel condition to one waiter.
 
@@ -71,6 +100,15 @@ void kernel_signal(CondVar* cv);
   */
 void kernel_broadcast(CondVar* cv);
 
+/**
+	@brief Signal a kernel condition, handing the core to a single waiter.
+
+	If exactly one thread waits on @c cv, it is made ready on the current
+	core, and the caller switches straight to it when it blocks next,
+	donating the rest of its quantum. Otherwise, this is @c kernel_broadcast().
+  */
+void kernel_handoff(CondVar* cv);
+
 
 /**
 	@brief Put thread to sleep, unlocking the kernel.
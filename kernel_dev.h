@@ -92,6 +92,13 @@ typedef struct file_operations {
     - There was a I/O runtime problem.
      */
     int (*Close)(void* this);
+
+    /** @brief Set if Read and Write do their own locking.
+
+      Otherwise, Read and Write are called with the kernel lock held. 
+      Close is always called with the kernel lock held.
+     */
+    int own_lock;
 } file_ops;
 
 
@@ -0,0 +1,113 @@
+#include "tinyos.h"
+#include "kernel_sched.h"
+#include "kernel_cc.h"
+
+/**
+	@file kernel_futex.c
+
+	@brief Futexes: waiting on the value of a user word.
+
+	Threads wait on the address of an int, in a table of wait queues hashed
+	by address. Since the processes of tinyos share one address space,
+	the address alone is the key.
+
+	These system calls do not take the kernel lock. A bucket is protected
+	by its own Mutex, which the waiter releases atomically as it goes to
+	sleep, so a @c FutexWake that follows a change of the word cannot be
+	lost.
+  */
+
+#define FUTEX_BUCKETS 256
+
+/** \cond HELPER A thread waiting on a futex */
+typedef struct futex_waiter {
+	rlnode node;		/* in the bucket's list */
+	int* addr;			/* the word waited on */
+	TCB* thread;		/* the waiting thread */
+	int removed;		/* set by FutexWake, as it removes us */
+	int woken;			/* set by FutexWake, if we were asleep */
+} futex_waiter;
+
+typedef struct futex_bucket {
+	Mutex lock;
+	rlnode waiters;		/* initialized on first use */
+} __attribute__((aligned(64))) futex_bucket;
+/** \endcond */
+
+static futex_bucket futex_table[FUTEX_BUCKETS];
+
+/* Return the bucket of addr, locked */
+static futex_bucket* futex_lock(int* addr)
+{
+	uintptr_t key = (uintptr_t)addr / sizeof(int);
+	futex_bucket* b = &futex_table[(key ^ (key >> 8)) % FUTEX_BUCKETS];
+
+	Mutex_Lock(&b->lock);
+	if(b->waiters.next == NULL)
+		rlnode_init(&b->waiters, NULL);
+	return b;
+}
+
+
+int sys_FutexWait(int* addr, int expected, timeout_t timeout)
+{
+	if(addr == NULL)
+		return -1;
+
+	futex_bucket* b = futex_lock(addr);
+
+	/* The word changed since the caller looked at it */
+	if(__atomic_load_n(addr, __ATOMIC_RELAXED) != expected) {
+		Mutex_Unlock(&b->lock);
+		return -1;
+	}
+
+	/* A zero timeout expires at once */
+	if(timeout == 0) {
+		Mutex_Unlock(&b->lock);
+		return -1;
+	}
+
+	futex_waiter w = { .addr = addr, .thread = cur_thread(), .removed = 0, .woken = 0 };
+	rlnode_init(&w.node, &w);
+	rlist_push_back(&b->waiters, &w.node);
+
+	/* We have to translate timeout from msec to usec */
+	sleep_releasing(STOPPED, &b->lock, SCHED_USER,
+		(timeout == INFINITE_TIMEOUT) ? NO_TIMEOUT : timeout*1000ul);
+
+	/* Remove ourselves, unless FutexWake did */
+	Mutex_Lock(&b->lock);
+	if(! w.removed)
+		rlist_remove(&w.node);
+	Mutex_Unlock(&b->lock);
+
+	return w.woken ? 0 : -1;
+}
+
+
+int sys_FutexWake(int* addr, int n)
+{
+	if(addr == NULL || n < 0)
+		return -1;
+
+	int count = 0;
+	futex_bucket* b = futex_lock(addr);
+
+	rlnode* node = b->waiters.next;
+	while(count < n && node != &b->waiters) {
+		futex_waiter* w = node->obj;
+		node = node->next;
+		if(w->addr != addr)
+			continue;
+
+		rlist_remove(&w->node);
+		w->removed = 1;
+		/* A thread that timed out is running already */
+		w->woken = wakeup(w->thread);
+		count += w->woken;
+	}
+
+	Mutex_Unlock(&b->lock);
+	return count;
+}
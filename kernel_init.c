@@ -23,6 +23,7 @@
 /* Parameters from the 'boot' call are passed to boot_tinyos()
    via static variables. */
 static struct {
+  sched_policy policy;
   Task init_task;
   int argl;
   void* args;
@@ -38,7 +39,7 @@ void boot_tinyos_kernel()
     initialize_processes();
     initialize_devices();
     initialize_files();
-    initialize_scheduler();
+    initialize_scheduler(boot_rec.policy);
 
     /* The boot task is executed normally! */
     if(Exec(boot_rec.init_task, boot_rec.argl, boot_rec.args)!=1)
@@ -59,8 +60,31 @@ void boot_tinyos_kernel()
 }
 
 
+/* The policy named by TINYOS_POLICY, to compare policies on the same program */
+static sched_policy env_policy()
+{
+  static const char* names[] = { [POLICY_MLFQ]="mlfq", [POLICY_FAIR]="fair", [POLICY_RR]="rr" };
+
+  const char* name = getenv("TINYOS_POLICY");
+  if(name == NULL || *name == '\0')
+    return POLICY_MLFQ;
+
+  for(uint p = 0; p < sizeof(names)/sizeof(names[0]); p++)
+    if(strcmp(name, names[p]) == 0)
+      return p;
+
+  FATAL("TINYOS_POLICY must be one of mlfq, fair or rr");
+}
+
 void boot(uint ncores, uint nterm, Task boot_task, int argl, void* args)
 {
+  boot_policy(env_policy(), ncores, nterm, boot_task, argl, args);
+}
+
+
+void boot_policy(sched_policy policy, uint ncores, uint nterm, Task boot_task, int argl, void* args)
+{
+  boot_rec.policy = policy;
   boot_rec.init_task = boot_task;
   boot_rec.argl = argl;
   boot_rec.args = args;
@@ -5,12 +5,18 @@
 #include "kernel_cc.h"
 
 
+/*
+  Pipes are read and written without the kernel lock. Each pipe has
+  its own lock, so that independent pipes do not contend.
+ */
+
 // file operations for the read method 
  static file_ops reader_fops = {
   .Open = NULL ,
   .Read = pipe_read,
   .Write =  NULL, 
-  .Close = pipe_reader_close
+  .Close = pipe_reader_close,
+  .own_lock = 1
 };
 
 // file operations for the write method 
@@ -18,7 +24,8 @@ static file_ops writer_fops = {
   .Open = NULL,
   .Read = NULL,
   .Write =  pipe_write,
-  .Close = pipe_writer_close
+  .Close = pipe_writer_close,
+  .own_lock = 1
 };
 
 
@@ -42,6 +49,8 @@ int sys_Pipe(pipe_t* pipe)
 		pipe->read = fid[0];
 		pipe->write = fid[1];
 
+		pipe_cb->lock = MUTEX_INIT;
+		pipe_cb->refcount = 2;
 		pipe_cb->reader = fcb[0];
 		pipe_cb->writer = fcb[1];
 		pipe_cb->has_space = COND_INIT;
@@ -66,6 +75,19 @@ int sys_Pipe(pipe_t* pipe)
 }
 
 
+/* The pipe is freed when both ends are closed, and no socket call uses it */
+void pipe_incref(Pipe_cb* pipe_cb)
+{
+	__atomic_fetch_add(&pipe_cb->refcount, 1, __ATOMIC_RELAXED);
+}
+
+void pipe_decref(Pipe_cb* pipe_cb)
+{
+	if(__atomic_sub_fetch(&pipe_cb->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+		free(pipe_cb);
+}
+
+
 int pipe_read(void* reader, char* buf,unsigned int size){
 
 	Pipe_cb *pipe_cb = (Pipe_cb*) reader;
@@ -77,22 +99,38 @@ int pipe_read(void* reader, char* buf,unsigned int size){
 
 
 	//FALSE
-	if(pipe_cb == NULL && pipe_cb->reader == NULL)
+	if(pipe_cb == NULL)
+		return -1;
+
+	Mutex_Lock(&pipe_cb->lock);
+
+	if(pipe_cb->reader == NULL) {
+		Mutex_Unlock(&pipe_cb->lock);
 		return -1;
+	}
 
-	if(pipe_cb->buf_size == 0 && pipe_cb->writer == NULL)
+	if(pipe_cb->buf_size == 0 && pipe_cb->writer == NULL) {
+		Mutex_Unlock(&pipe_cb->lock);
 		return 0;
+	}
 
 	while(byte_counter < size){
 
 		//buffer is empty , we wake up pipes and we wait until writer to write
-		while(pipe_cb->buf_size == 0 && pipe_cb->writer!= NULL){
+		while(pipe_cb->buf_size == 0 && pipe_cb->writer!= NULL && pipe_cb->reader != NULL){
 			kernel_broadcast(&pipe_cb->has_space);
-			kernel_wait(&pipe_cb->has_data, SCHED_PIPE);	 
+			kernel_wait_on(&pipe_cb->lock, &pipe_cb->has_data, SCHED_PIPE);	 
+		}
+
+		if(pipe_cb->reader == NULL) { /* Our end was closed while we waited */
+			Mutex_Unlock(&pipe_cb->lock);
+			return (byte_counter > 0) ? (int) byte_counter : -1;
 		}
 
-		if(pipe_cb->buf_size == 0) //buffer is empty after the write 
+		if(pipe_cb->buf_size == 0) { //buffer is empty after the write 
+			Mutex_Unlock(&pipe_cb->lock);
 			return byte_counter;
+		}
 
 		rem_buf_size = pipe_cb->buf_size;
 
@@ -115,6 +153,7 @@ int pipe_read(void* reader, char* buf,unsigned int size){
 	}
 
 	kernel_broadcast(&pipe_cb->has_space);
+	Mutex_Unlock(&pipe_cb->lock);
 	return byte_counter;
 
 }
@@ -128,18 +167,26 @@ int pipe_write(void* writer, const char * buf, unsigned int size){
 	int temp_buf_size = 0;
 	int final_counter = 0;
 
-	if(pipe_cb == NULL || pipe_cb->writer == NULL || pipe_cb->reader==NULL)
+	if(pipe_cb == NULL)
 		return -1;
 
+	Mutex_Lock(&pipe_cb->lock);
+
+	if(pipe_cb->writer == NULL || pipe_cb->reader==NULL) {
+		Mutex_Unlock(&pipe_cb->lock);
+		return -1;
+	}
 
 	while(byte_counter < size) {
-        while (pipe_cb->buf_size == PIPE_BUFFER_SIZE && pipe_cb->reader != NULL) {
+        while (pipe_cb->buf_size == PIPE_BUFFER_SIZE && pipe_cb->reader != NULL && pipe_cb->writer != NULL) {
             kernel_broadcast(&pipe_cb->has_data);
-            kernel_wait(&pipe_cb->has_space, SCHED_PIPE);
+            kernel_wait_on(&pipe_cb->lock, &pipe_cb->has_space, SCHED_PIPE);
         }
 
-        if (pipe_cb->writer == NULL)			/* If both writer and reader ends are closed, return copied bytes */ 
+        if (pipe_cb->writer == NULL || pipe_cb->reader == NULL) {	/* An end was closed while we waited; return copied bytes */ 
+            Mutex_Unlock(&pipe_cb->lock);
             return (int) byte_counter;
+        }
         
 
         rem_buf_size = PIPE_BUFFER_SIZE - pipe_cb->buf_size;
@@ -162,7 +209,10 @@ int pipe_write(void* writer, const char * buf, unsigned int size){
         pipe_cb->w_position = (pipe_cb->w_position + final_counter) % PIPE_BUFFER_SIZE;
    }
 
-    kernel_broadcast(&pipe_cb->has_data);
+    Mutex_Unlock(&pipe_cb->lock);
+
+    /* A lone reader runs when we block, in the rest of our quantum */
+    kernel_handoff(&pipe_cb->has_data);
     return (int) byte_counter;
 
 }
@@ -170,37 +220,33 @@ int pipe_write(void* writer, const char * buf, unsigned int size){
 
 
 int pipe_writer_close(void* fid) {
-    Pipe_cb *pipe_cb = (Pipe_cb*)fid;
+  Pipe_cb *pipe_cb = (Pipe_cb*)fid;
 
-   if (pipe_cb == NULL)
-   	return -1;
+  if (pipe_cb == NULL)
+  	return -1;
 
+  Mutex_Lock(&pipe_cb->lock);
   pipe_cb->writer = NULL;
+  kernel_broadcast(&pipe_cb->has_data);
+  kernel_broadcast(&pipe_cb->has_space);
+  Mutex_Unlock(&pipe_cb->lock);
 
-  if (pipe_cb->reader == NULL){
-  	free(pipe_cb);
-  	return 0;
-  }else{
-  	kernel_broadcast(&pipe_cb->has_data);
-  	return 0;
-  }
-    
+  pipe_decref(pipe_cb);
+  return 0;
 }
 
 int pipe_reader_close(void* fid) {
-    Pipe_cb  *pipe_cb = (Pipe_cb*)fid;
+  Pipe_cb  *pipe_cb = (Pipe_cb*)fid;
 
-    if (pipe_cb == NULL)
-    	return -1;
+  if (pipe_cb == NULL)
+  	return -1;
    
-   pipe_cb->reader = NULL;
-
-   if (pipe_cb->writer == NULL)
-   {
-   	 free(pipe_cb);
-   	 return 0;
-   }else{
-   	kernel_broadcast(&pipe_cb->has_space);
-   	return 0;
-   }
- }
\ No newline at end of file
+  Mutex_Lock(&pipe_cb->lock);
+  pipe_cb->reader = NULL;
+  kernel_broadcast(&pipe_cb->has_space);
+  kernel_broadcast(&pipe_cb->has_data);
+  Mutex_Unlock(&pipe_cb->lock);
+
+  pipe_decref(pipe_cb);
+  return 0;
+}
@@ -32,6 +32,7 @@ Pid_t get_pid(PCB* pcb)
 /* Initialize a PCB */
 static inline void initialize_PCB(PCB* pcb)
 {
+  pcb->lock = MUTEX_INIT;
   pcb->pstate = FREE;
   pcb->argl = 0;
   pcb->args = NULL;
@@ -51,6 +52,7 @@ static inline void initialize_PCB(PCB* pcb)
 
 
 static PCB* pcb_freelist;
+static Mutex pcb_freelist_lock = MUTEX_INIT;
 
 void initialize_processes()
 {
@@ -76,32 +78,55 @@ void initialize_processes()
 }
 
 
+int has_open_files(PCB* pcb)
+{
+  for(int i=0; i<MAX_FILEID; i++)
+    if(__atomic_load_n(&pcb->FIDT[i], __ATOMIC_RELAXED) != NULL)
+      return 1;
+  return 0;
+}
+
+
 /*
-  Must be called with kernel_mutex held
+  The free list has its own lock
 */
 PCB* acquire_PCB()
 {
   PCB* pcb = NULL;
 
+  Mutex_Lock(&pcb_freelist_lock);
   if(pcb_freelist != NULL) {
     pcb = pcb_freelist;
     pcb->pstate = ALIVE;
     pcb_freelist = pcb_freelist->parent;
     process_count++;
   }
+  Mutex_Unlock(&pcb_freelist_lock);
 
   return pcb;
 }
 
-/*
-  Must be called with kernel_mutex held
-*/
 void release_PCB(PCB* pcb)
 {
+  Mutex_Lock(&pcb_freelist_lock);
   pcb->pstate = FREE;
   pcb->parent = pcb_freelist;
   pcb_freelist = pcb;
   process_count--;
+  Mutex_Unlock(&pcb_freelist_lock);
+}
+
+
+PCB* lock_parent(PCB* pcb)
+{
+  while(1) {
+    PCB* parent = __atomic_load_n(&pcb->parent, __ATOMIC_ACQUIRE);
+    Mutex_Lock(&parent->lock);
+    if(pcb->parent == parent)
+      return parent;
+    /* We were reparented while we waited */
+    Mutex_Unlock(&parent->lock);
+  }
 }
 
 
@@ -151,17 +176,24 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     curproc = CURPROC;
 
     /* Add new process to the parent's child list */
+    Mutex_Lock(&curproc->lock);
     newproc->parent = curproc;
     rlist_push_front(& curproc->children_list, & newproc->children_node);
+    Mutex_Unlock(&curproc->lock);
 
     /* Inherit file streams from parent */
-    for(int i=0; i<MAX_FILEID; i++) {
-       newproc->FIDT[i] = curproc->FIDT[i];
-       if(newproc->FIDT[i])
-          FCB_incref(newproc->FIDT[i]);
+    if(has_open_files(curproc)) {
+      kernel_lock();
+      for(int i=0; i<MAX_FILEID; i++) {
+         newproc->FIDT[i] = curproc->FIDT[i];
+         if(newproc->FIDT[i])
+            FCB_incref(newproc->FIDT[i]);
+      }
+      kernel_unlock();
     }
   }
 
+  Mutex_Lock(&newproc->lock);
 
   /* Set the main thread's function */
   newproc->main_task = call;
@@ -193,6 +225,7 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     ptcb->detached = 0 ;
     ptcb->exit_cv = COND_INIT;
     ptcb->refcount = 0 ;
+    ptcb->stack_size = THREAD_STACK_SIZE;
     rlnode_init(& ptcb->ptcb_list_node,ptcb);
 
     //increase the thread_count because we have creat a ptcb 
@@ -200,10 +233,14 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     //we push the newproc and the ptcb in rlnode lists 
     rlist_push_back(&newproc->ptcb_list , &ptcb->ptcb_list_node);
 
-    ptcb->tcb = spawn_thread(newproc, start_main_thread);
+    ptcb->tcb = spawn_thread(newproc, start_main_thread, THREAD_STACK_SIZE);
     ptcb->tcb->ptcb=ptcb;  ////////////////////////////////////////////////////////////////////////////////////////////
-    wakeup(ptcb->tcb); //make it ready 
+    newproc->main_thread = ptcb->tcb;
   }
+  Mutex_Unlock(&newproc->lock);
+
+  if(call != NULL)
+    wakeup(newproc->main_thread); //make it ready 
 
 
 finish:
@@ -211,7 +248,7 @@ finish:
 }
 
 
-/* System call */
+/* System call; these two do not take the kernel lock */
 Pid_t sys_GetPid()
 {
   return get_pid(CURPROC);
@@ -220,7 +257,8 @@ Pid_t sys_GetPid()
 
 Pid_t sys_GetPPid()
 {
-  return get_pid(CURPROC->parent);
+  /* The parent may change, if we are adopted by init */
+  return get_pid(__atomic_load_n(&CURPROC->parent, __ATOMIC_ACQUIRE));
 }
 
 
@@ -246,18 +284,22 @@ static Pid_t wait_for_specific_child(Pid_t cpid, int* status)
   }
 
   PCB* parent = CURPROC;
+  Mutex_Lock(&parent->lock);
+
   PCB* child = get_pcb(cpid);
   if( child == NULL || child->parent != parent)
   {
+    Mutex_Unlock(&parent->lock);
     cpid = NOPROC;
     goto finish;
   }
 
   /* Ok, child is a legal child of mine. Wait for it to exit. */
   while(child->pstate == ALIVE)
-    kernel_wait(& parent->child_exit, SCHED_USER);
+    kernel_wait_on(&parent->lock, & parent->child_exit, SCHED_USER);
   
   cleanup_zombie(child, status);
+  Mutex_Unlock(&parent->lock);
   
 finish:
   return cpid;
@@ -269,6 +311,7 @@ static Pid_t wait_for_any_child(int* status)
   Pid_t cpid;
 
   PCB* parent = CURPROC;
+  Mutex_Lock(&parent->lock);
 
   /* Make sure I have children! */
   int no_children, has_exited;
@@ -279,16 +322,19 @@ static Pid_t wait_for_any_child(int* status)
     has_exited = ! is_rlist_empty(& parent->exited_list);
     if( has_exited ) break;
 
-    kernel_wait(& parent->child_exit, SCHED_USER);    
+    kernel_wait_on(&parent->lock, & parent->child_exit, SCHED_USER);    
   }
 
-  if(no_children)
+  if(no_children) {
+    Mutex_Unlock(&parent->lock);
     return NOPROC;
+  }
 
   PCB* child = parent->exited_list.next->pcb;
   assert(child->pstate == ZOMBIE);
   cpid = get_pid(child);
   cleanup_zombie(child, status);
+  Mutex_Unlock(&parent->lock);
 
   return cpid;
 }
@@ -354,6 +400,7 @@ int procinfo_read(void* reader, char* buf, unsigned int size){
     if (PT[pinfo_cb->PCB_cursor].pstate != FREE)
     {
       PCB* pcb = &PT[pinfo_cb->PCB_cursor];
+      Mutex_Lock(&pcb->lock);
 
       pinfo_cb->pinfo.pid = get_pid(pcb);
       pinfo_cb->pinfo.ppid = get_pid(pcb->parent);
@@ -371,6 +418,7 @@ int procinfo_read(void* reader, char* buf, unsigned int size){
 
       if(pcb->args != NULL)
         memcpy(pinfo_cb->pinfo.args, pcb->args, chars_copy_size);
+      Mutex_Unlock(&pcb->lock);
 
       memcpy(buf, (char*)&(pinfo_cb->pinfo), size);
 
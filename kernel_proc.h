@@ -35,8 +35,15 @@ typedef enum pid_state_e {
   @brief Process Control Block.
 
   This structure holds all information pertaining to a process.
+
+  The lifecycle system calls do not take the kernel lock. The @c lock of
+  a process protects its @c ptcb_list and @c thread_count, its
+  @c children_list and @c exited_list, and its @c args. The @c parent of
+  a process changes only with the lock of the process and of its new
+  parent held. The file table is still protected by the kernel lock.
  */
 typedef struct process_control_block {
+  Mutex lock;             /**< @brief Protects the lists of the process */
   pid_state  pstate;      /**< @brief The pid state for this PCB */
 
   PCB* parent;            /**< @brief Parent's pcb. */
@@ -99,6 +106,26 @@ PCB* get_pcb(Pid_t pid);
 */
 Pid_t get_pid(PCB* pcb);
 
+/**
+  @brief Lock the parent of a process.
+
+  Since a process can be reparented to the init process while this
+  call waits for the lock, the call returns the parent whose lock it
+  holds.
+
+  @param pcb the pcb of a process with a parent
+  @returns The locked parent of @c pcb.
+*/
+PCB* lock_parent(PCB* pcb);
+
+/**
+  @brief Return 1 if a process has any open file ids, else 0.
+
+  This lets process creation and exit skip the kernel lock, which
+  protects the file table, when there is nothing to copy or close.
+*/
+int has_open_files(PCB* pcb);
+
 int procinfo_read(void* procinfo_cb,char* buf, unsigned int size);
 int procinfo_close(void* fid);
 
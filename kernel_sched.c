@@ -1,6 +1,7 @@
 
 #include <assert.h>
 #include <sys/mman.h>
+#include <string.h>
 
 #include "kernel_cc.h"
 #include "kernel_proc.h"
@@ -36,10 +37,80 @@ CCB cctx[MAX_CORES];
 */
 #define CURTHREAD (CURCORE.current_thread)
 
-//#define PRIORITY_QUEUES for mlfq
-#define PRIORITY_QUEUES 10
+/*
+  MLFQ aging. A thread that has waited AGING_INTERVAL in a queue 
+  is moved one level up, to prevent starvation.
+*/
+#define AGING_INTERVAL (10 * QUANTUM)
+
+/* The time-slice of batch threads */
+#define BATCH_QUANTUM (20 * QUANTUM)
+
+/*
+  Per-level time slices. Threads at high (interactive) levels get
+  short quanta, CPU-bound threads at the low levels get long ones.
+  The quantum doubles every LEVEL_QUANTUM_STEP levels down from the top.
+*/
+#define LEVEL_QUANTUM_STEP 3
+static TimerDuration level_quantum[PRIORITY_QUEUES];
+
+/* The ready mask of a core has one bit per level */
+_Static_assert(PRIORITY_QUEUES <= 32, "ready_mask is too small for PRIORITY_QUEUES");
+
+/*
+  A scheduling policy orders the normal (not real-time) ready threads 
+  of each core. It is a table of operations, chosen at boot:
+
+  enqueue       add a ready thread to the run queue of a core
+  dequeue       remove a queued thread from the run queue of a core
+  pick_next     remove and return the best thread of a non-empty run queue
+  steal         move up to n threads allowed on the thief from the victim
+  tick          called each time a core reschedules, before pick_next
+  keep_current  return true if a preempted thread should keep the core
+  quantum       the time-slice of a thread picked to run
+  on_yield      account for the time a thread ran, and why it yields
+
+  tick, keep_current and on_yield may be NULL. If wake_preempt is set, 
+  a woken thread preempts a core that runs a thread of a lower level.
+  If lend_priority is set, Mutex waiters lend their level to the owner.
+
+  All operations are called with the sched_lock of the core held.
+*/
+typedef struct sched_policy_ops {
+	void (*enqueue)(CCB* core, TCB* tcb);
+	void (*dequeue)(CCB* core, TCB* tcb);
+	TCB* (*pick_next)(CCB* core);
+	void (*steal)(CCB* victim, CCB* thief, uint n);
+	void (*tick)(CCB* core);
+	int (*keep_current)(CCB* core, TCB* current);
+	TimerDuration (*quantum)(TCB* tcb);
+	void (*on_yield)(TCB* tcb, enum SCHED_CAUSE cause, TimerDuration ran);
+	int wake_preempt;
+	int lend_priority;
+} sched_policy_ops;
+
+static const sched_policy_ops mlfq_ops, fair_ops, rr_ops;
+
+/* The scheduling policy, set at boot */
+static const sched_policy_ops* policy = &mlfq_ops;
+
+/* Real-time utilization is kept in millionths; each core admits up to 90% */
+#define EDF_UTIL_SCALE 1000000
+#define EDF_UTIL_BOUND (EDF_UTIL_SCALE * 9 / 10)
+
+/* The utilization of a real-time thread; never 0, to count the thread */
+static inline uint edf_utilization(TimerDuration period, TimerDuration budget)
+{
+	uint util = budget * EDF_UTIL_SCALE / period;
+	return (util > 0) ? util : 1;
+}
 
-#define YIELD_CALLS 750// YIELD CALLS FOR STARVATION PROBLEM (MLFQ)
+/* Release a real-time reservation on core c */
+static void edf_unreserve(uint c, uint util)
+{
+	__atomic_fetch_sub(&cctx[c].edf_util, util, __ATOMIC_RELAXED);
+	__atomic_fetch_sub(&cctx[c].edf_threads, 1, __ATOMIC_RELAXED);
+}
 
 
 /*
@@ -66,6 +137,8 @@ TCB* cur_thread()
   +-------------+
   |   TCB       |
   +-------------+
+  | guard page  |
+  +-------------+
   |             |
   |    stack    |
   |             |
@@ -75,6 +148,11 @@ TCB* cur_thread()
   | first frame |
   +-------------+
 
+  The block is reserved with mmap, and its pages are committed by the host
+  when they are first touched, so a thread only uses as much memory as its
+  stack actually reaches. The guard page is PROT_NONE, so that a stack 
+  overrun is a seg.fault, instead of corrupting the TCB.
+
   Advantages: (a) unified memory area for stack and TCB (b) stack overrun will
   crash own thread, before it affects other threads (which may make debugging
   easier).
@@ -88,7 +166,6 @@ TCB* cur_thread()
   with the exception of idle threads (they don't count).
  */
 volatile unsigned int active_threads = 0;
-Mutex active_threads_spinlock = MUTEX_INIT;
 
 /* This is specific to Intel Pentium! */
 #define SYSTEM_PAGE_SIZE (1 << 12)
@@ -97,262 +174,1659 @@ Mutex active_threads_spinlock = MUTEX_INIT;
 #define THREAD_TCB_SIZE \
 	(((sizeof(TCB) + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE)
 
-#define THREAD_SIZE (THREAD_TCB_SIZE + THREAD_STACK_SIZE)
+/* The size of the memory block of a thread with the given stack size */
+#define THREAD_SIZE(stack_size) (THREAD_TCB_SIZE + SYSTEM_PAGE_SIZE + (stack_size))
+
+/* The lowest address of the stack of a thread */
+#define THREAD_STACK(tcb) (((void*)(tcb)) + THREAD_TCB_SIZE + SYSTEM_PAGE_SIZE)
+
+
+/*
+  Use mmap to reserve a thread block, with the guard page after the TCB.
+  Stacks are not executable, so thread functions must not be nested
+  functions that need a trampoline.
+ */
+void free_thread(void* ptr, size_t size) { CHECK(munmap(ptr, size)); }
+
+void* allocate_thread(size_t size)
+{
+	void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+
+	CHECK((ptr == MAP_FAILED) ? -1 : 0);
+	CHECK(mprotect(ptr + THREAD_TCB_SIZE, SYSTEM_PAGE_SIZE, PROT_NONE));
+
+	return ptr;
+}
+
+
+/*
+  Return how deep the stack of a thread has reached, in bytes.
+
+  The lowest page of the stack that the host has committed is found with 
+  mincore. Since stacks are zero when committed, the first non-zero word 
+  of that page is the high-water mark.
+ */
+size_t thread_stack_usage(TCB* tcb)
+{
+	enum { CHUNK = 64 };
+	unsigned char vec[CHUNK];
+	size_t pages = tcb->stack_size / SYSTEM_PAGE_SIZE;
+	void* stack = THREAD_STACK(tcb);
+
+	for (size_t p = 0; p < pages; p += CHUNK) {
+		size_t n = (pages - p < CHUNK) ? pages - p : CHUNK;
+		CHECK(mincore(stack + p * SYSTEM_PAGE_SIZE, n * SYSTEM_PAGE_SIZE, vec));
+		for (size_t i = 0; i < n; i++) {
+			if (!(vec[i] & 1)) continue;
+
+			/* Skip zero words 8 at a time; the stack size is a multiple of 64 */
+			uintptr_t* word = stack + (p + i) * SYSTEM_PAGE_SIZE;
+			uintptr_t* top = stack + tcb->stack_size;
+			while (word < top && (word[0] | word[1] | word[2] | word[3] |
+					word[4] | word[5] | word[6] | word[7]) == 0)
+				word += 8;
+			while (word < top && *word == 0)
+				word++;
+			return (void*)top - (void*)word;
+		}
+	}
+	return 0;
+}
+
+
+/*
+  Thread memory cache.
+
+  Thread blocks are recycled instead of being freed. Each core keeps up 
+  to THREAD_CACHE_MAX free blocks, which it uses with preemption off. 
+  A core with too many blocks moves a batch to a global depot, and a core
+  with none takes a batch from the depot, before allocating a new block.
+  Only blocks with the default stack size are recycled.
+
+  Recycled blocks keep the top THREAD_STACK_WARM bytes of their stack 
+  faulted in. Deeper pages are returned to the host, and the rest is 
+  zeroed, so that thread_stack_usage() works for the next thread.
+
+  A free block holds the pointer to the next one in its first word.
+*/
+#define THREAD_CACHE_MAX 16
+#define THREAD_CACHE_BATCH (THREAD_CACHE_MAX / 2)
+#define THREAD_DEPOT_MAX 256
+#define THREAD_STACK_WARM (8 * 1024)
+
+static void* thread_depot = NULL;
+static uint thread_depot_count = 0;
+static Spinlock thread_depot_lock = SPINLOCK_INIT;
+
+#define NEXT_BLOCK(block) (*(void**)(block))
+
+/* Get a thread block. Must be called with preemption off */
+static void* thread_block_get(size_t stack_size)
+{
+	CCB* core = &CURCORE;
+
+	if (stack_size != THREAD_STACK_SIZE)
+		return allocate_thread(THREAD_SIZE(stack_size));
+
+	if (core->thread_cached == 0 && thread_depot_count > 0) {
+		Spinlock_Lock(&thread_depot_lock);
+		while (thread_depot != NULL && core->thread_cached < THREAD_CACHE_BATCH) {
+			void* block = thread_depot;
+			thread_depot = NEXT_BLOCK(block);
+			thread_depot_count--;
+			NEXT_BLOCK(block) = core->thread_cache;
+			core->thread_cache = block;
+			core->thread_cached++;
+		}
+		Spinlock_Unlock(&thread_depot_lock);
+	}
+
+	if (core->thread_cached == 0)
+		return allocate_thread(THREAD_SIZE(stack_size));
+
+	void* block = core->thread_cache;
+	core->thread_cache = NEXT_BLOCK(block);
+	core->thread_cached--;
+	return block;
+}
+
+/* Clean the stack of a block for the next thread */
+static void thread_stack_scrub(TCB* tcb)
+{
+	size_t used = thread_stack_usage(tcb);
+	void* top = THREAD_STACK(tcb) + tcb->stack_size;
+
+	if (used > THREAD_STACK_WARM) {
+		CHECK(madvise(THREAD_STACK(tcb), tcb->stack_size - THREAD_STACK_WARM, MADV_DONTNEED));
+		used = THREAD_STACK_WARM;
+	}
+	memset(top - used, 0, used);
+}
+
+/* Return a thread block. Must be called with preemption off */
+static void thread_block_put(TCB* tcb)
+{
+	CCB* core = &CURCORE;
+	void* block = tcb;
+
+	if (tcb->stack_size != THREAD_STACK_SIZE) {
+		free_thread(block, THREAD_SIZE(tcb->stack_size));
+		return;
+	}
+
+	thread_stack_scrub(tcb);
+
+	NEXT_BLOCK(block) = core->thread_cache;
+	core->thread_cache = block;
+	if (++core->thread_cached <= THREAD_CACHE_MAX)
+		return;
+
+	/* Move a batch to the depot. What does not fit is freed */
+	void* excess = NULL;
+	Spinlock_Lock(&thread_depot_lock);
+	for (int i = 0; i < THREAD_CACHE_BATCH; i++) {
+		block = core->thread_cache;
+		core->thread_cache = NEXT_BLOCK(block);
+		core->thread_cached--;
+		if (thread_depot_count < THREAD_DEPOT_MAX) {
+			NEXT_BLOCK(block) = thread_depot;
+			thread_depot = block;
+			thread_depot_count++;
+		} else {
+			NEXT_BLOCK(block) = excess;
+			excess = block;
+		}
+	}
+	Spinlock_Unlock(&thread_depot_lock);
+
+	while (excess != NULL) {
+		block = excess;
+		excess = NEXT_BLOCK(block);
+		free_thread(block, THREAD_SIZE(THREAD_STACK_SIZE));
+	}
+}
+
+
+/*
+  This is the function that is used to start normal threads.
+*/
+
+void gain(int preempt); /* forward */
+
+static void thread_start()
+{
+	gain(1);
+	cur_thread()->thread_func();
+
+	/* We are not supposed to get here! */
+	assert(0);
+}
+
+/*
+  Initialize and return a new TCB
+*/
+
+TCB* spawn_thread(PCB* pcb, void (*func)(), size_t stack_size)
+{
+	/* The allocated thread size must be a multiple of page size */
+	stack_size = (stack_size + SYSTEM_PAGE_SIZE - 1) & ~(size_t)(SYSTEM_PAGE_SIZE - 1);
+	int preempt = preempt_off;
+	TCB* tcb = (TCB*)thread_block_get(stack_size);
+	if (preempt) preempt_on;
+	tcb->stack_size = stack_size;
+
+	/* Set the owner */
+	tcb->owner_pcb = pcb;
+
+	/* Initialize the other attributes */
+	tcb->type = NORMAL_THREAD;
+	tcb->state = INIT;
+	tcb->phase = CTX_CLEAN;
+	tcb->thread_func = func;
+	tcb->wakeup_time = NO_TIMEOUT;
+	tcb->core = cpu_core_id;
+	tcb->priority = PRIORITY_QUEUES - 1; 
+	tcb->lent_for = NULL;
+	tcb->vruntime = 0;
+	tcb->period = 0;
+
+	/* Inherit the affinity of the creating thread */
+	TCB* creator = CURCORE.current_thread;
+	tcb->affinity = (creator != NULL && creator->type != IDLE_THREAD) ? creator->affinity : ALL_CORES;
+	tcb->sched_class = (creator != NULL && creator->type != IDLE_THREAD) ? creator->sched_class : CLASS_NORMAL;
+	rlnode_init(&tcb->sched_node, tcb); /* Intrusive list node */
+
+	tcb->its = level_quantum[tcb->priority];
+	tcb->rts = tcb->its;
+	tcb->last_cause = SCHED_IDLE;
+	tcb->curr_cause = SCHED_IDLE;
+
+	/* Compute the stack segment address and size */
+	void* sp = THREAD_STACK(tcb);
+
+	/* Init the context */
+	cpu_initialize_context(&tcb->context, sp, stack_size, thread_start);
+
+#ifndef NVALGRIND
+	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + stack_size);
+#endif
+
+	/* increase the count of active threads */
+	__atomic_add_fetch(&active_threads, 1, __ATOMIC_RELAXED);
+
+	return tcb;
+}
+
+/* Keeps a TCB from being freed while a mutex waiter lends it priority */
+static Spinlock lend_lock = SPINLOCK_INIT;
+
+/*
+  This is called with preemption off and no sched_lock held, since it 
+  takes lend_lock.
+ */
+void release_TCB(TCB* tcb)
+{
+#ifndef NVALGRIND
+	VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);
+#endif
+
+	/* Release a real-time reservation */
+	if (tcb->period != 0)
+		edf_unreserve(tcb->rt_core, edf_utilization(tcb->period, tcb->budget));
+
+	/* Wait for a mutex waiter that may still be looking at tcb */
+	Spinlock_Lock(&lend_lock);
+	Spinlock_Unlock(&lend_lock);
+
+	thread_block_put(tcb);
+
+	__atomic_sub_fetch(&active_threads, 1, __ATOMIC_RELAXED);
+}
+
+/*
+	The normal thread running on this core, or NULL, set by gain().
+
+	Reading CURTHREAD takes two loads, cpu_core_id and then the CCB, and 
+	with preemption on we could move to another core in between. On 
+	x86_64, this variable is read with a single instruction relative to 
+	%fs, as the interrupt flag in bios.c; so, the read is atomic with 
+	respect to preemption, and returns the caller.
+ */
+static _Thread_local TCB* core_thread __attribute__((used));
+
+static inline void core_thread_set(TCB* tcb)
+{
+	core_thread = tcb;
+}
+
+TCB* cur_thread_fast()
+{
+#if defined(__x86_64__)
+	TCB* tcb;
+	__asm__ __volatile__("movq %%fs:core_thread@tpoff, %0" : "=r"(tcb) : : "memory");
+	return tcb;
+#else
+	int preempt = preempt_off;
+	TCB* tcb = core_thread;
+	if(preempt) preempt_on;
+	return tcb;
+#endif
+}
+
+/*
+ *
+ * Scheduler
+ *
+ */
+
+/*
+ *  Note: the scheduler routines are all in the non-preemptive domain.
+ */
+
+/*
+  Each core owns its scheduler queues: one doubly linked list per MLFQ
+  level, stored in the CCB. The core also keeps a list of the threads
+  that went to sleep on it with a timeout.
+
+  All these structures are protected by the core's @c sched_lock. The
+  same lock protects the state of all threads whose @c core field points
+  to the core. Since @c tcb->core may change (when the thread is stolen
+  by another core), it must be read via @c lock_tcb_core().
+
+  Lock ordering: a core never blocks on another core's lock while it
+  holds its own; stealing uses a try-lock on the victim.
+
+  A ready thread whose affinity does not allow it on its core is 
+  forwarded to the inbox of an allowed core. The inbox has its own
+  lock, which may be taken while holding any sched_lock. The target
+  core moves its inbox to its queues the next time it selects a thread.
+*/
+
+/* Interrupt handler for ALARM */
+void yield_handler() { yield(SCHED_QUANTUM); }
+
+/* Interrupt handle for inter-core interrupts */
+void ici_handler()
+{
+	/* A more urgent thread was queued on this core */
+	if (__atomic_load_n(&CURCORE.need_resched, __ATOMIC_RELAXED))
+		yield(SCHED_PREEMPT);
+}
+
+/*
+  Lock the core whose queues hold tcb, and return it. If the
+  thread is stolen while we wait for the lock, we try again.
+*/
+static CCB* lock_tcb_core(TCB* tcb)
+{
+	while(1) {
+		uint c = __atomic_load_n(&tcb->core, __ATOMIC_ACQUIRE);
+		Spinlock_Lock(&cctx[c].sched_lock);
+		if(c == tcb->core)
+			return &cctx[c];
+		Spinlock_Unlock(&cctx[c].sched_lock);
+	}
+}
+
+/*
+  Push a thread to the back of its level queue on a core, keeping
+  the core's ready mask up to date.
+
+  *** MUST BE CALLED WITH core->sched_lock HELD ***
+*/
+static inline void sched_level_push(CCB* core, TCB* tcb)
+{
+	rlist_push_back(&core->sched_queue[tcb->priority], &tcb->sched_node);
+	core->ready_mask |= (1u << tcb->priority);
+	core->ready_count++;
+}
+
+/*
+  Pop the head of a non-empty level queue of a core, keeping
+  the core's ready mask up to date.
+
+  *** MUST BE CALLED WITH core->sched_lock HELD ***
+*/
+static inline TCB* sched_level_pop(CCB* core, int level)
+{
+	rlnode* queue = &core->sched_queue[level];
+	TCB* tcb = rlist_pop_front(queue)->tcb;
+	assert(tcb != NULL);
+	if(is_rlist_empty(queue))
+		core->ready_mask &= ~(1u << level);
+	core->ready_count--;
+	return tcb;
+}
+
+/*
+  Remove a queued thread from its level queue on a core, keeping
+  the core's ready mask up to date.
+
+  *** MUST BE CALLED WITH core->sched_lock HELD ***
+*/
+static inline void sched_level_remove(CCB* core, TCB* tcb)
+{
+	rlist_remove(&tcb->sched_node);
+	if(is_rlist_empty(&core->sched_queue[tcb->priority]))
+		core->ready_mask &= ~(1u << tcb->priority);
+	core->ready_count--;
+}
+
+/*
+  Fair-share run queues.
+
+  With POLICY_FAIR, the ready threads of a core are kept in a binary
+  min-heap (an implicit balanced tree) ordered by virtual runtime. 
+  A running thread is charged its run time, multiplied by the number of
+  threads of its process.
+
+  A thread that slept, or moved from another core, is not allowed to 
+  lag behind the core's min_vruntime by more than FAIR_SLEEPER_CREDIT.
+*/
+#define FAIR_SLEEPER_CREDIT QUANTUM
+
+static inline void fair_set(CCB* core, uint i, TCB* tcb)
+{
+	core->fair_heap[i] = tcb;
+	tcb->heap_index = i;
+}
+
+static void fair_sift_up(CCB* core, uint i)
+{
+	TCB* tcb = core->fair_heap[i];
+	while(i > 0) {
+		uint parent = (i-1)/2;
+		if(core->fair_heap[parent]->vruntime <= tcb->vruntime) break;
+		fair_set(core, i, core->fair_heap[parent]);
+		i = parent;
+	}
+	fair_set(core, i, tcb);
+}
+
+static void fair_sift_down(CCB* core, uint i)
+{
+	TCB* tcb = core->fair_heap[i];
+	uint n = core->ready_count;
+	for(;;) {
+		uint child = 2*i+1;
+		if(child >= n) break;
+		if(child+1 < n && core->fair_heap[child+1]->vruntime < core->fair_heap[child]->vruntime)
+			child++;
+		if(tcb->vruntime <= core->fair_heap[child]->vruntime) break;
+		fair_set(core, i, core->fair_heap[child]);
+		i = child;
+	}
+	fair_set(core, i, tcb);
+}
+
+/*
+  Push a thread to the heap of a core.
+
+  *** MUST BE CALLED WITH core->sched_lock HELD ***
+*/
+static void fair_push(CCB* core, TCB* tcb)
+{
+	if(core->ready_count == core->fair_cap) {
+		core->fair_cap = (core->fair_cap == 0) ? 64 : 2*core->fair_cap;
+		core->fair_heap = realloc(core->fair_heap, core->fair_cap * sizeof(TCB*));
+		if(core->fair_heap == NULL)
+			FATAL("virtual memory exhausted");
+	}
+
+	if(tcb->vruntime + FAIR_SLEEPER_CREDIT < core->min_vruntime)
+		tcb->vruntime = core->min_vruntime - FAIR_SLEEPER_CREDIT;
+
+	fair_set(core, core->ready_count, tcb);
+	core->ready_count++;
+	fair_sift_up(core, core->ready_count-1);
+}
+
+/*
+  Remove the i-th thread of the heap of a core.
+
+  *** MUST BE CALLED WITH core->sched_lock HELD ***
+*/
+static TCB* fair_remove(CCB* core, uint i)
+{
+	TCB* tcb = core->fair_heap[i];
+	core->ready_count--;
+	if(i != core->ready_count) {
+		TCB* moved = core->fair_heap[core->ready_count];
+		fair_set(core, i, moved);
+		fair_sift_down(core, i);
+		if(moved->heap_index == i)
+			fair_sift_up(core, i);
+	}
+	return tcb;
+}
+
+/* Charge a thread for the time it ran */
+static inline void fair_charge(TCB* tcb, TimerDuration runtime)
+{
+	int threads = tcb->owner_pcb->thread_count;
+	tcb->vruntime += runtime * (threads > 1 ? threads : 1);
+}
+
+/*
+  Earliest-deadline-first class.
+
+  A thread with a period is a real-time thread. It is pinned to the core
+  that admitted it (rt_core), and runs ahead of all normal threads there.
+  Each core keeps its runnable real-time threads in a list sorted by 
+  deadline, and those that used up their budget in another list sorted
+  by deadline, which is also when they are replenished. There are few
+  real-time threads per core, so sorted lists suffice.
+*/
+
+static inline int is_realtime(TCB* tcb) { return tcb->period != 0; }
+
+/* A batch thread that was lent a priority is normal, until it gives it back */
+static inline int is_batch(TCB* tcb) 
+{ 
+	return tcb->sched_class == CLASS_BATCH && tcb->lent_for == NULL && ! is_realtime(tcb); 
+}
+
+/*
+  Make a core reschedule as soon as it enables preemption. The ICI is
+  pending until then; ici_handler() yields if need_resched is set.
+*/
+static inline void sched_preempt(CCB* core)
+{
+	__atomic_store_n(&core->need_resched, 1, __ATOMIC_RELAXED);
+	cpu_ici(core->id);
+}
+
+/* Return true if the thread may run on core c */
+static inline int sched_allowed(TCB* tcb, uint c)
+{
+	return is_realtime(tcb) ? c == tcb->rt_core : CORE_IN_MASK(c, tcb->affinity);
+}
+
+/* Insert into a list sorted by deadline, after the equal ones */
+static void edf_insert(rlnode* list, TCB* tcb)
+{
+	rlnode* n = list->next;
+	for (; n != list; n = n->next)
+		if (tcb->deadline < n->tcb->deadline)
+			break;
+	rl_splice(n->prev, &tcb->sched_node);
+}
+
+/*
+  Queue a ready real-time thread on its core. A thread that is ready
+  after its deadline starts a new period. Return 1 if the thread is
+  runnable, 0 if it must wait for its next period.
+
+  *** MUST BE CALLED WITH core->sched_lock HELD ***
+*/
+static int edf_push(CCB* core, TCB* tcb)
+{
+	TimerDuration now = bios_clock();
+	if (now >= tcb->deadline) {
+		tcb->deadline = now + tcb->period;
+		tcb->runtime_left = tcb->budget;
+	}
+
+	if (tcb->runtime_left > 0) {
+		edf_insert(&core->edf_queue, tcb);
+		core->edf_ready++;
+		return 1;
+	}
+	edf_insert(&core->edf_throttled, tcb);
+	return 0;
+}
+
+/*
+  Give a new budget to the throttled threads whose period has ended.
+
+  *** MUST BE CALLED WITH core->sched_lock HELD ***
+*/
+static void edf_replenish(CCB* core, TimerDuration now)
+{
+	while (! is_rlist_empty(&core->edf_throttled)) {
+		TCB* tcb = core->edf_throttled.next->tcb;
+		if (tcb->deadline > now)
+			break;
+		rlist_remove(&tcb->sched_node);
+		tcb->deadline += tcb->period;
+		if (tcb->deadline <= now)
+			tcb->deadline = now + tcb->period;
+		tcb->runtime_left = tcb->budget;
+		edf_insert(&core->edf_queue, tcb);
+		core->edf_ready++;
+	}
+}
+
+/*
+  Select the most urgent real-time thread of the core, or NULL if none
+  is runnable. The current thread is considered if current_ok.
+
+  *** MUST BE CALLED WITH core->sched_lock HELD ***
+*/
+static TCB* edf_select(CCB* core, TCB* current, int current_ok)
+{
+	edf_replenish(core, bios_clock());
+
+	int cur = current_ok && is_realtime(current) && current->runtime_left > 0;
+	if (core->edf_ready == 0)
+		return cur ? current : NULL;
+
+	TCB* head = core->edf_queue.next->tcb;
+	if (cur && current->deadline <= head->deadline)
+		return current;
+
+	rlist_remove(&head->sched_node);
+	core->edf_ready--;
+	return head;
+}
+
+/*
+  Ask a core to reschedule, if it runs a less urgent thread than tcb.
+  The core gets an ICI, which is pending until it enables preemption.
+
+  *** MUST BE CALLED WITH core->sched_lock HELD ***
+*/
+static void edf_preempt(CCB* core, TCB* tcb)
+{
+	TCB* running = core->current_thread;
+	if (running != NULL && is_realtime(running) && running->deadline <= tcb->deadline)
+		return;
+	sched_preempt(core);
+}
+
+/*
+  Push a ready thread to the run queue of a core, according to the policy.
+
+  *** MUST BE CALLED WITH core->sched_lock HELD ***
+*/
+static inline void sched_rq_push(CCB* core, TCB* tcb)
+{
+	policy->enqueue(core, tcb);
+}
+
+/*
+  Remove and return the best thread of a non-empty run queue of a core.
+
+  *** MUST BE CALLED WITH core->sched_lock HELD ***
+*/
+static inline TCB* sched_rq_pop(CCB* core)
+{
+	return policy->pick_next(core);
+}
+
+/*
+  Remove a thread from the run queue of a core.
+
+  *** MUST BE CALLED WITH core->sched_lock HELD ***
+*/
+static inline void sched_rq_remove(CCB* core, TCB* tcb)
+{
+	policy->dequeue(core, tcb);
+}
+
+/*
+  Batch class. The batch threads of a core wait in a FIFO list, which
+  is served only when the run queue of the policy is empty.
+
+  *** MUST BE CALLED WITH core->sched_lock HELD ***
+*/
+static inline void batch_push(CCB* core, TCB* tcb)
+{
+	rlist_push_back(&core->batch_queue, &tcb->sched_node);
+	core->batch_ready++;
+}
+
+static inline void batch_remove(CCB* core, TCB* tcb)
+{
+	rlist_remove(&tcb->sched_node);
+	core->batch_ready--;
+}
+
+/*
+  Forward a ready thread, which is not in any queue, to the inbox of 
+  the least loaded core in its affinity mask. The target core is 
+  interrupted if it is halting.
+
+  *** MUST BE CALLED WITH tcb->core's sched_lock HELD ***
+*/
+static void sched_forward_to(CCB* target, TCB* tcb)
+{
+	__atomic_store_n(&tcb->core, target->id, __ATOMIC_RELEASE);
+
+	Spinlock_Lock(&target->inbox_lock);
+	rlist_push_back(&target->inbox, &tcb->sched_node);
+	Spinlock_Unlock(&target->inbox_lock);
+
+	if(__atomic_load_n(&target->halting, __ATOMIC_RELAXED))
+		cpu_ici(target->id);
+}
+
+static void sched_forward(TCB* tcb)
+{
+	CCB* target = is_realtime(tcb) ? &cctx[tcb->rt_core] : NULL;
+	uint least = 0;
+	for(uint c = 0; c < cpu_cores() && ! is_realtime(tcb); c++) {
+		if(! CORE_IN_MASK(c, tcb->affinity)) continue;
+		uint count = __atomic_load_n(&cctx[c].ready_count, __ATOMIC_RELAXED);
+		if(target == NULL || count < least) {
+			target = &cctx[c];
+			least = count;
+		}
+	}
+	assert(target != NULL);
+
+	sched_forward_to(target, tcb);
+}
+
+/*
+  Move the threads forwarded to a core into its queues.
+
+  *** MUST BE CALLED WITH core->sched_lock HELD ***
+*/
+static void sched_drain_inbox(CCB* core)
+{
+	if(__atomic_load_n(&core->inbox.next, __ATOMIC_RELAXED) == &core->inbox)
+		return;
+
+	rlnode forwarded;
+	rlnode_init(&forwarded, NULL);
+
+	Spinlock_Lock(&core->inbox_lock);
+	rlist_append(&forwarded, &core->inbox);
+	Spinlock_Unlock(&core->inbox_lock);
+
+	while(! is_rlist_empty(&forwarded)) {
+		TCB* tcb = rlist_pop_front(&forwarded)->tcb;
+		/* The affinity may have changed again */
+		if(! sched_allowed(tcb, core->id)) {
+			if(core->handoff == tcb)
+				core->handoff = NULL;
+			sched_forward(tcb);
+		}
+		else if(is_realtime(tcb)) {
+			if(edf_push(core, tcb))
+				edf_preempt(core, tcb);
+		}
+		else if(is_batch(tcb))
+			batch_push(core, tcb);
+		else
+			sched_rq_push(core, tcb);
+	}
+}
+
+/*
+  Timing wheels.
+
+  Each core keeps its sleeping threads in a hierarchical timing wheel.
+  A thread is placed according to its wakeup tick, which is its 
+  wakeup_time rounded up to TW_TICK, so that it is never woken early.
+*/
+
+/* The number of ticks covered by the whole wheel */
+#define TW_SPAN (1ull << (TW_SLOT_BITS * TW_LEVELS))
+
+static void tw_init(timer_wheel* tw, TimerDuration now)
+{
+	tw->now = now / TW_TICK;
+	tw->count = 0;
+	for(int l = 0; l < TW_LEVELS; l++) {
+		tw->occupied[l] = 0;
+		for(int s = 0; s < TW_SLOTS; s++)
+			rlnode_init(&tw->slot[l][s], NULL);
+	}
+}
+
+/*
+  Place a thread in the slot for the given tick. Ticks not after 
+  tw->now go to the slot of tw->now.
+*/
+static void tw_place(timer_wheel* tw, TCB* tcb, TimerDuration tick)
+{
+	if(tick < tw->now)
+		tick = tw->now;
+
+	/* Threads beyond the span go to the last level, and are re-placed when cascaded */
+	TimerDuration delta = tick - tw->now;
+	if(delta >= TW_SPAN)
+		tick = tw->now + TW_SPAN - 1;
+
+	int level = 0;
+	while(level < TW_LEVELS-1 && delta >= (1ull << (TW_SLOT_BITS * (level+1))))
+		level++;
+
+	int s = (tick >> (TW_SLOT_BITS * level)) & (TW_SLOTS-1);
+	rlist_push_back(&tw->slot[level][s], &tcb->sched_node);
+	tw->occupied[level] |= (1ull << s);
+}
+
+/*
+  Return a lower bound for the next tick at which the wheel has work:
+  either the next occupied slot of level 0, or the next cascade of an
+  occupied slot of a higher level. Return 0 if the wheel is empty.
+*/
+static TimerDuration tw_next_tick(timer_wheel* tw)
+{
+	if(tw->count == 0) return 0;
+
+	TimerDuration next = 0;
+	for(int l = 0; l < TW_LEVELS; l++) {
+		uint64_t occ = tw->occupied[l];
+		if(occ == 0) continue;
+
+		/* Rotate the bitmap, so that bit 0 is the slot after the current one */
+		uint shift = TW_SLOT_BITS * l;
+		int cur = (tw->now >> shift) & (TW_SLOTS-1);
+		uint64_t rot = (cur == TW_SLOTS-1) ? occ : (occ >> (cur+1)) | (occ << (TW_SLOTS-1-cur));
+		TimerDuration tick = ((tw->now >> shift) + __builtin_ctzll(rot) + 1) << shift;
+
+		if(next == 0 || tick < next)
+			next = tick;
+	}
+	return next;
+}
+
+/* Add a sleeping thread to the wheel. */
+static void tw_insert(timer_wheel* tw, TCB* tcb)
+{
+	TimerDuration tick = (tcb->wakeup_time + TW_TICK - 1) / TW_TICK;
+
+	/* The slot of tw->now has already been processed */
+	if(tick <= tw->now)
+		tick = tw->now + 1;
+
+	tw_place(tw, tcb, tick);
+	tw->count++;
+}
+
+/* Remove a sleeping thread from the wheel. */
+static inline void tw_remove(timer_wheel* tw, TCB* tcb)
+{
+	rlist_remove(&tcb->sched_node);
+	tw->count--;
+}
+
+/* Move the threads of a slot at some level to the lower levels. */
+static void tw_cascade(timer_wheel* tw, int level, int s)
+{
+	rlnode* slot = &tw->slot[level][s];
+	tw->occupied[level] &= ~(1ull << s);
+	while(! is_rlist_empty(slot)) {
+		TCB* tcb = rlist_pop_front(slot)->tcb;
+		tw_place(tw, tcb, (tcb->wakeup_time + TW_TICK - 1) / TW_TICK);
+	}
+}
+
+/*
+  Advance the wheel up to the given time, calling expire() on every
+  thread whose wakeup tick has passed. The callback must remove the 
+  thread from the wheel.
+*/
+static void tw_advance(timer_wheel* tw, TimerDuration time, void (*expire)(TCB*))
+{
+	TimerDuration target = time / TW_TICK;
+
+	while(tw->now < target) {
+		if(tw->count == 0) {
+			tw->now = target;
+			break;
+		}
+
+		/* Skip whole revolutions of the empty lower levels */
+		int l = 0;
+		while(l < TW_LEVELS-1 && tw->occupied[l] == 0)
+			l++;
+		if(l > 0) {
+			TimerDuration skip = tw->now | ((1ull << (TW_SLOT_BITS * l)) - 1);
+			tw->now = (skip < target) ? skip : target;
+			if(tw->now == target) break;
+		}
+
+		TimerDuration t = ++tw->now;
+
+		/* Cascade the higher levels when the lower ones wrap around */
+		for(int level = 1; level < TW_LEVELS; level++) {
+			if((t & ((1ull << (TW_SLOT_BITS * level)) - 1)) != 0)
+				break;
+			tw_cascade(tw, level, (t >> (TW_SLOT_BITS * level)) & (TW_SLOTS-1));
+		}
+
+		/* Expire the current slot */
+		int s = t & (TW_SLOTS-1);
+		rlnode* slot = &tw->slot[0][s];
+		tw->occupied[0] &= ~(1ull << s);
+		while(! is_rlist_empty(slot))
+			expire(slot->next->tcb);
+	}
+}
+
+/*
+  Return the time of the next timer event of the core: a timeout in its
+  timing wheel, or the replenishment of a throttled real-time thread.
+  Return 0 if there is none.
+
+  *** MUST BE CALLED WITH core->sched_lock HELD ***
+*/
+static TimerDuration sched_next_event(CCB* core)
+{
+	TimerDuration next = tw_next_tick(&core->timeouts) * TW_TICK;
+	if (! is_rlist_empty(&core->edf_throttled)) {
+		TimerDuration replenish = core->edf_throttled.next->tcb->deadline;
+		if (next == 0 || replenish < next)
+			next = replenish;
+	}
+	return next;
+}
+
+
+/*
+  Possibly add TCB to the timing wheel of its core.
+
+  *** MUST BE CALLED WITH tcb->core's sched_lock HELD ***
+*/
+static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
+{
+	if (timeout != NO_TIMEOUT) {
+		/* set the wakeup time */
+		TimerDuration curtime = bios_clock();
+		tcb->wakeup_time = curtime + timeout;
+
+		tw_insert(&cctx[tcb->core].timeouts, tcb);
+	}
+}
+
+/*
+  Restart up to n halted cores in mask, other than core 'from', which
+  gets an ICI when a thread is queued on it.
+*/
+static void sched_restart_halted(uint from, coremask_t mask, int n)
+{
+	for(uint i = 1; i < cpu_cores() && n > 0; i++) {
+		uint c = (from + i) % cpu_cores();
+		if(CORE_IN_MASK(c, mask) && __atomic_load_n(&cctx[c].halting, __ATOMIC_RELAXED)) {
+			cpu_core_restart(c);
+			n--;
+		}
+	}
+}
+
+/*
+  Add TCB to the end of its core's scheduler list. Return 1 if the
+  core is busy, so that a halted core could steal the thread.
+
+  *** MUST BE CALLED WITH tcb->core's sched_lock HELD ***
+*/
+static int sched_queue_insert(TCB* tcb)
+{
+	CCB* core = &cctx[tcb->core];
+
+	tcb->enqueue_time = bios_clock();
+
+	/* The thread may not run on its core */
+	if(! sched_allowed(tcb, core->id)) {
+		sched_forward(tcb);
+		return 0;
+	}
+
+	/* Real-time threads have their own queues, and are never stolen */
+	if(is_realtime(tcb)) {
+		if(edf_push(core, tcb))
+			edf_preempt(core, tcb);
+		else if(core->id != cpu_core_id && core->halting)
+			cpu_ici(core->id);
+		return 0;
+	}
+
+	/* Insert at the end of the scheduling list */
+	if(is_batch(tcb))
+		batch_push(core, tcb);
+	else
+		sched_rq_push(core, tcb); // insert tcb at the end of the list(queue) with priority
+
+	/* Interrupt the thread's core, if it is halting */
+	if(core->id != cpu_core_id && core->halting)
+		cpu_ici(core->id);
+
+	return core->id == cpu_core_id || core->ready_count > 1;
+}
+
+/*
+  Add TCB to the end of its core's scheduler list. If the core is busy,
+  restart a halted core that may steal the thread.
+
+  *** MUST BE CALLED WITH tcb->core's sched_lock HELD ***
+*/
+static void sched_queue_add(TCB* tcb)
+{
+	if(sched_queue_insert(tcb))
+		sched_restart_halted(tcb->core, tcb->affinity, 1);
+}
+ 
+/*
+  Queue a thread that just woke up. If the policy preempts on wakeup
+  (as POLICY_MLFQ does), and its core runs a thread of a lower level, 
+  that core is preempted. Else, if another allowed core runs a thread 
+  of a lower level, the thread is forwarded
+  to the core running the lowest one, which is preempted. Otherwise, 
+  this is sched_queue_insert(). Idle cores are not targets; they are 
+  restarted by sched_queue_insert() and steal.
+
+  The levels of the running threads are read without locking.
+
+  *** MUST BE CALLED WITH tcb->core's sched_lock HELD ***
+*/
+static int sched_queue_wake(TCB* tcb)
+{
+	CCB* core = &cctx[tcb->core];
+
+	if(! policy->wake_preempt || is_realtime(tcb) || ! sched_allowed(tcb, core->id))
+		return sched_queue_insert(tcb);
+
+	if(__atomic_load_n(&core->current_priority, __ATOMIC_RELAXED) < tcb->priority) {
+		sched_queue_insert(tcb);
+		sched_preempt(core);
+		return 0;
+	}
+
+	CCB* target = NULL;
+	int lowest = tcb->priority;
+	for(uint c = 0; c < cpu_cores(); c++) {
+		int level = __atomic_load_n(&cctx[c].current_priority, __ATOMIC_RELAXED);
+		if(c != core->id && CORE_IN_MASK(c, tcb->affinity) && level >= 0 && level < lowest) {
+			target = &cctx[c];
+			lowest = level;
+		}
+	}
+	if(target == NULL)
+		return sched_queue_insert(tcb);
+
+	tcb->enqueue_time = bios_clock();
+	sched_forward_to(target, tcb);
+	sched_preempt(target);
+	return 0;
+}
+
+/*
+	Take a thread out of the timing wheel and mark it READY.
+
+	*** MUST BE CALLED WITH tcb->core's sched_lock HELD ***
+ */
+static void sched_unblock(TCB* tcb)
+{
+	assert(tcb->state == STOPPED || tcb->state == INIT);
+
+	/* Possibly remove from the timing wheel */
+	if (tcb->wakeup_time != NO_TIMEOUT) {
+		/* tcb is in the timing wheel, fix it */
+		assert(tcb->sched_node.next != &(tcb->sched_node) && tcb->state == STOPPED);
+		tw_remove(&cctx[tcb->core].timeouts, tcb);
+		tcb->wakeup_time = NO_TIMEOUT;
+	}
+
+	/* Mark as ready */
+	tcb->state = READY;
+}
+
+/*
+	Adjust the state of a thread to make it READY. Return 1 if the 
+	thread was queued on a busy core (see sched_queue_insert).
+
+	*** MUST BE CALLED WITH tcb->core's sched_lock HELD ***
+ */
+static int sched_ready(TCB* tcb)
+{
+	sched_unblock(tcb);
+
+	/* Possibly add to the scheduler queue */
+	return (tcb->phase == CTX_CLEAN) ? sched_queue_wake(tcb) : 0;
+}
+
+/*
+	Make a thread READY, and restart a halted core if needed.
+
+	*** MUST BE CALLED WITH tcb->core's sched_lock HELD ***
+ */
+static void sched_make_ready(TCB* tcb)
+{
+	if (sched_ready(tcb))
+		sched_restart_halted(tcb->core, tcb->affinity, 1);
+}
+
+/*
+  Wake up the threads of the core whose timeout has expired.
+
+  *** MUST BE CALLED WITH core->sched_lock HELD ***
+*/
+static void sched_wakeup_expired_timeouts(CCB* core)
+{
+	tw_advance(&core->timeouts, bios_clock(), sched_make_ready);
+}
+
+/*
+  Move up to n threads allowed on the thief from the victim's MLFQ
+  queues, starting from the lowest level.
+
+  *** MUST BE CALLED WITH BOTH sched_locks HELD ***
+*/
+static void mlfq_steal(CCB* victim, CCB* thief, uint n)
+{
+	uint32_t levels = victim->ready_mask;
+	while(levels != 0 && n > 0) {
+		int level = __builtin_ctz(levels);
+		levels &= ~(1u << level);
+
+		rlnode* queue = &victim->sched_queue[level];
+		rlnode* node = queue->next;
+		while(node != queue && n > 0) {
+			TCB* tcb = node->tcb;
+			node = node->next;
+			if(! CORE_IN_MASK(thief->id, tcb->affinity))
+				continue;
+			if(victim->handoff == tcb)
+				victim->handoff = NULL;
+			sched_level_remove(victim, tcb);
+			__atomic_store_n(&tcb->core, thief->id, __ATOMIC_RELEASE);
+			sched_level_push(thief, tcb);
+			n--;
+		}
+	}
+}
+
+/*
+  Move up to n threads allowed on the thief from the victim's heap,
+  starting from the leaves (the most served threads).
+
+  *** MUST BE CALLED WITH BOTH sched_locks HELD ***
+*/
+static void fair_steal(CCB* victim, CCB* thief, uint n)
+{
+	for(uint i = victim->ready_count; i-- > 0 && n > 0; ) {
+		if(i >= victim->ready_count) continue;
+		TCB* tcb = victim->fair_heap[i];
+		if(! CORE_IN_MASK(thief->id, tcb->affinity))
+			continue;
+		if(victim->handoff == tcb)
+			victim->handoff = NULL;
+		fair_remove(victim, i);
+		__atomic_store_n(&tcb->core, thief->id, __ATOMIC_RELEASE);
+		fair_push(thief, tcb);
+		n--;
+	}
+}
+
+/*
+  Age the threads of the core's MLFQ queues. The head of each queue 
+  has waited the longest at its level; if it has waited for k aging
+  intervals, it moves up k levels. Only the heads are inspected, so 
+  this takes time proportional to the number of levels. 
+
+  *** MUST BE CALLED WITH core->sched_lock HELD ***
+*/
+static void mlfq_age(CCB* core)
+{
+	TimerDuration now = bios_clock();
+
+	/* Scan from the top, so that a thread is not aged twice */
+	uint32_t levels = core->ready_mask & ~(1u << (PRIORITY_QUEUES-1));
+	while(levels != 0) {
+		int level = 31 - __builtin_clz(levels);
+		levels &= ~(1u << level);
+
+		TCB* tcb = core->sched_queue[level].next->tcb;
+		TimerDuration waited = (now > tcb->enqueue_time) ? now - tcb->enqueue_time : 0;
+		if(waited < AGING_INTERVAL)
+			continue;
+
+		int up = waited / AGING_INTERVAL;
+		if(up > PRIORITY_QUEUES-1 - level)
+			up = PRIORITY_QUEUES-1 - level;
+
+		sched_level_pop(core, level);
+		tcb->priority = level + up;
+		tcb->enqueue_time = now;
+		sched_level_push(core, tcb);
+	}
+}
+
+/*
+  The policies. 
+
+  POLICY_MLFQ and POLICY_RR share the level queues. Under POLICY_RR,
+  no thread ever leaves the top level, so the queue of each core is
+  a single FIFO list served with a fixed quantum.
+*/
+static TCB* mlfq_pick_next(CCB* core)
+{
+	return sched_level_pop(core, 31 - __builtin_clz(core->ready_mask));
+}
 
-//#define MMAPPED_THREAD_MEM
-#ifdef MMAPPED_THREAD_MEM
+static TimerDuration mlfq_quantum(TCB* tcb)
+{
+	return level_quantum[tcb->priority];
+}
 
+/* A thread that uses up its quantum moves down, one that does I/O moves up */
+static void mlfq_on_yield(TCB* tcb, enum SCHED_CAUSE cause, TimerDuration ran)
+{
+	switch(cause) {
+		case SCHED_QUANTUM:
+			if(tcb->priority > 0)
+				tcb->priority--;
+			break; 
+		case SCHED_IO:
+			if(tcb->priority < PRIORITY_QUEUES-1)
+				tcb->priority++; 
+			break;
+		case SCHED_MUTEX:
+			if(tcb->curr_cause == tcb->last_cause && tcb->priority > 0)
+				tcb->priority--;
+			break; 
+		default: 
+			break;
+	}
+}
 
-/*
-  Use mmap to allocate a thread. A more detailed implementation can allocate a
-  "sentinel page", and change access to PROT_NONE, so that a stack overflow
-  is detected as seg.fault.
- */
-void free_thread(void* ptr, size_t size) { CHECK(munmap(ptr, size)); }
+static TimerDuration rr_quantum(TCB* tcb)
+{
+	return QUANTUM;
+}
 
-void* allocate_thread(size_t size)
+static void fair_enqueue(CCB* core, TCB* tcb)
 {
-	void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC,
-		MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	fair_push(core, tcb);
+}
 
-	CHECK((ptr == MAP_FAILED) ? -1 : 0);
+static void fair_dequeue(CCB* core, TCB* tcb)
+{
+	fair_remove(core, tcb->heap_index);
+}
 
-	return ptr;
+static TCB* fair_pick_next(CCB* core)
+{
+	TCB* tcb = fair_remove(core, 0);
+	if(tcb->vruntime > core->min_vruntime)
+		core->min_vruntime = tcb->vruntime;
+	return tcb;
 }
-#else
-/*
-  Use malloc to allocate a thread. This is probably faster than  mmap, but
-  cannot be made easily to 'detect' stack overflow.
- */
-void free_thread(void* ptr, size_t size) { free(ptr); }
 
-void* allocate_thread(size_t size)
+/* A preempted thread keeps the core while it is the least served */
+static int fair_keep_current(CCB* core, TCB* current)
 {
-	void* ptr = aligned_alloc(SYSTEM_PAGE_SIZE, size);
-	CHECK((ptr == NULL) ? -1 : 0);
-	return ptr;
+	return core->ready_count == 0 || current->vruntime <= core->fair_heap[0]->vruntime;
 }
-#endif
 
+static TimerDuration fair_quantum(TCB* tcb)
+{
+	return QUANTUM;
+}
 
+static void fair_on_yield(TCB* tcb, enum SCHED_CAUSE cause, TimerDuration ran)
+{
+	if(tcb->type != IDLE_THREAD)
+		fair_charge(tcb, ran);
+}
 
+static const sched_policy_ops mlfq_ops = {
+	.enqueue = sched_level_push,
+	.dequeue = sched_level_remove,
+	.pick_next = mlfq_pick_next,
+	.steal = mlfq_steal,
+	.tick = mlfq_age,
+	.quantum = mlfq_quantum,
+	.on_yield = mlfq_on_yield,
+	.wake_preempt = 1,
+	.lend_priority = 1
+};
+
+static const sched_policy_ops fair_ops = {
+	.enqueue = fair_enqueue,
+	.dequeue = fair_dequeue,
+	.pick_next = fair_pick_next,
+	.steal = fair_steal,
+	.keep_current = fair_keep_current,
+	.quantum = fair_quantum,
+	.on_yield = fair_on_yield
+};
+
+static const sched_policy_ops rr_ops = {
+	.enqueue = sched_level_push,
+	.dequeue = sched_level_remove,
+	.pick_next = mlfq_pick_next,
+	.steal = mlfq_steal,
+	.quantum = rr_quantum
+};
 
 /*
-  This is the function that is used to start normal threads.
-*/
+  Move up to n batch threads allowed on the thief from the victim.
 
-void gain(int preempt); /* forward */
-
-static void thread_start()
+  *** MUST BE CALLED WITH BOTH sched_locks HELD ***
+*/
+static void batch_steal(CCB* victim, CCB* thief, uint n)
 {
-	gain(1);
-	cur_thread()->thread_func();
-
-	/* We are not supposed to get here! */
-	assert(0);
+	rlnode* node = victim->batch_queue.next;
+	while(node != &victim->batch_queue && n > 0) {
+		TCB* tcb = node->tcb;
+		node = node->next;
+		if(! CORE_IN_MASK(thief->id, tcb->affinity))
+			continue;
+		batch_remove(victim, tcb);
+		__atomic_store_n(&tcb->core, thief->id, __ATOMIC_RELEASE);
+		batch_push(thief, tcb);
+		n--;
+	}
 }
 
 /*
-  Initialize and return a new TCB
-*/
+  Steal work for an idle core. We pick the core with the most ready
+  threads, and move up to half of them to the thief: the ones at the
+  lowest MLFQ levels, or the ones with the most virtual runtime.
+  If no core has normal threads ready, and the thief has no batch 
+  threads, we take half of the batch threads of the core with the most.
 
-TCB* spawn_thread(PCB* pcb, void (*func)())
+  *** MUST BE CALLED WITH thief->sched_lock HELD ***
+*/
+static void sched_steal(CCB* thief)
 {
-	/* The allocated thread size must be a multiple of page size */
-	TCB* tcb = (TCB*)allocate_thread(THREAD_SIZE);
-
-	/* Set the owner */
-	tcb->owner_pcb = pcb;
+	CCB* victim = NULL;
+	uint most = 0;
+
+	/* Find the busiest core. The counts are read without locking */
+	for(uint i = 1; i < cpu_cores(); i++) {
+		CCB* core = &cctx[(thief->id + i) % cpu_cores()];
+		uint count = __atomic_load_n(&core->ready_count, __ATOMIC_RELAXED);
+		if(count > most) {
+			most = count;
+			victim = core;
+		}
+	}
 
-	/* Initialize the other attributes */
-	tcb->type = NORMAL_THREAD;
-	tcb->state = INIT;
-	tcb->phase = CTX_CLEAN;
-	tcb->thread_func = func;
-	tcb->wakeup_time = NO_TIMEOUT;
-	tcb->priority = PRIORITY_QUEUES - 1; 
-	rlnode_init(&tcb->sched_node, tcb); /* Intrusive list node */
+	int batch = (victim == NULL && thief->batch_ready == 0);
+	for(uint i = 1; batch && i < cpu_cores(); i++) {
+		CCB* core = &cctx[(thief->id + i) % cpu_cores()];
+		uint count = __atomic_load_n(&core->batch_ready, __ATOMIC_RELAXED);
+		if(count > most) {
+			most = count;
+			victim = core;
+		}
+	}
 
-	tcb->its = QUANTUM;
-	tcb->rts = QUANTUM;
-	tcb->last_cause = SCHED_IDLE;
-	tcb->curr_cause = SCHED_IDLE;
+	/* Never wait for the victim's lock while holding our own */
+	if(victim == NULL || ! Spinlock_TryLock(&victim->sched_lock))
+		return;
 
-	/* Compute the stack segment address and size */
-	void* sp = ((void*)tcb) + THREAD_TCB_SIZE;
+	/* Take up to half of the victim's threads */
+	if(batch)
+		batch_steal(victim, thief, (victim->batch_ready + 1) / 2);
+	else
+		policy->steal(victim, thief, (victim->ready_count + 1) / 2);
 
-	/* Init the context */
-	cpu_initialize_context(&tcb->context, sp, THREAD_STACK_SIZE, thread_start);
+	Spinlock_Unlock(&victim->sched_lock);
+}
 
-#ifndef NVALGRIND
-	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + THREAD_STACK_SIZE);
-#endif
+/*
+  Remove the head of the highest non-empty scheduler list of the core,
+  and return it. If the core has no ready threads, try to steal some
+  from another core. If there is still nothing to run, return the 
+  current thread (if it is ready) or the idle thread.
 
-	/* increase the count of active threads */
-	Mutex_Lock(&active_threads_spinlock);
-	active_threads++;
-	Mutex_Unlock(&active_threads_spinlock);
+  The highest non-empty level is the most significant bit of the
+  core's ready mask, so selection takes constant time.
 
-	return tcb;
-}
+  With POLICY_FAIR, the thread with the least virtual runtime is 
+  selected instead. Batch threads are selected only when there is
+  no normal thread to run.
 
-/*
-  This is called with sched_spinlock locked !
- */
-void release_TCB(TCB* tcb)
+  *** MUST BE CALLED WITH core->sched_lock HELD ***
+*/
+static TCB* sched_queue_select(CCB* core, TCB* current)
 {
-#ifndef NVALGRIND
-	VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);
-#endif
+	sched_drain_inbox(core);
 
-	free_thread(tcb, THREAD_SIZE);
+	int current_ok = current->state == READY && current->type != IDLE_THREAD
+		&& sched_allowed(current, core->id);
 
-	Mutex_Lock(&active_threads_spinlock);
-	active_threads--;
-	Mutex_Unlock(&active_threads_spinlock);
-}
+	/* Real-time threads come first */
+	TCB* next_thread = (core->edf_threads > 0) ? edf_select(core, current, current_ok) : NULL;
+	if(next_thread != NULL) {
+		next_thread->its = next_thread->runtime_left;
+		return next_thread;
+	}
 
-/*
- *
- * Scheduler
- *
- */
+	/* 
+		When the thread that called wakeup_handoff() blocks, the woken thread 
+		runs next, for the rest of the time-slice. It is still in our queue, 
+		since every path that takes it out clears core->handoff.
+	*/
+	TCB* handoff = core->handoff;
+	core->handoff = NULL;
+	if(handoff != NULL && current == core->handoff_from && current->state != READY) {
+		sched_rq_remove(core, handoff);
+		handoff->its = (current->rts > 0) ? current->rts : policy->quantum(handoff);
+		return handoff;
+	}
 
-/*
- *  Note: the scheduler routines are all in the non-preemptive domain.
- */
+	/* A real-time thread that used up its budget waits for its next period */
+	if(is_realtime(current))
+		current_ok = 0;
 
-/*
-  The scheduler queue is implemented as a doubly linked list. The
-  head and tail of this list are stored in  SCHED.
+	if(core->ready_count == 0 && !current_ok)
+		sched_steal(core);
 
-  Also, the scheduler contains a linked list of all the sleeping
-  threads with a timeout.
+	if(policy->tick != NULL)
+		policy->tick(core);
 
-  Both of these structures are protected by @c sched_spinlock.
-*/
-//int boost_thread ; // boost of thread 
-rlnode SCHED[PRIORITY_QUEUES]; /* The scheduler queue  PRIORITY_QUEUES = N  */
-rlnode TIMEOUT_LIST; /* The list of threads with a timeout */
-Mutex sched_spinlock = MUTEX_INIT; /* spinlock for scheduler queue */
+	int current_batch = current_ok && is_batch(current);
 
-/* Interrupt handler for ALARM */
-void yield_handler() { yield(SCHED_QUANTUM); }
+	if(policy->keep_current != NULL && current_ok && ! current_batch 
+		&& current->curr_cause == SCHED_QUANTUM && policy->keep_current(core, current))
+		next_thread = current;
 
-/* Interrupt handle for inter-core interrupts */
-void ici_handler()
-{ /* noop for now... */
-}
+	while(next_thread == NULL && core->ready_count != 0) {
+		next_thread = sched_rq_pop(core);
+		if(sched_allowed(next_thread, core->id))
+			break;
+		/* Its affinity changed while it was queued */
+		sched_forward(next_thread);
+		next_thread = NULL;
+	}
 
-/*
-  Possibly add TCB to the scheduler timeout list.
+	if(next_thread == NULL && current_ok && ! current_batch)
+		next_thread = current;
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
-*/
-static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
-{
-	if (timeout != NO_TIMEOUT) {
-		/* set the wakeup time */
-		TimerDuration curtime = bios_clock();
-		tcb->wakeup_time = (timeout == NO_TIMEOUT) ? NO_TIMEOUT : curtime + timeout;
+	while(next_thread == NULL && core->batch_ready != 0) {
+		next_thread = core->batch_queue.next->tcb;
+		batch_remove(core, next_thread);
+		if(sched_allowed(next_thread, core->id))
+			break;
+		sched_forward(next_thread);
+		next_thread = NULL;
+	}
 
-		/* add to the TIMEOUT_LIST in sorted order */
-		rlnode* n = TIMEOUT_LIST.next;
-		for (; n != &TIMEOUT_LIST; n = n->next)
-			/* skip earlier entries */
-			if (tcb->wakeup_time < n->tcb->wakeup_time)
-				break;
-		/* insert before n */
-		rl_splice(n->prev, &tcb->sched_node);
+	if(next_thread == NULL)
+		next_thread = current_ok ? current : &core->idle_thread;
+
+	next_thread->its = (next_thread->type == IDLE_THREAD) ? QUANTUM 
+		: is_batch(next_thread) ? BATCH_QUANTUM : policy->quantum(next_thread);
+
+	/* 
+		A normal thread must not delay the next real-time event of the core,
+		and a batch thread must not delay the threads whose sleep expires.
+		Under a policy where woken threads preempt, neither must a thread 
+		with the long quantum of a low level.
+	*/
+	if((core->edf_threads > 0 || is_batch(next_thread) || policy->wake_preempt) 
+		&& next_thread->type != IDLE_THREAD) {
+		TimerDuration next = sched_next_event(core);
+		TimerDuration now = bios_clock();
+		if(next != 0) {
+			TimerDuration gap = (next > now + TW_TICK) ? next - now : TW_TICK;
+			if(gap < next_thread->its)
+				next_thread->its = gap;
+		}
 	}
-}
 
-/*
-  Add TCB to the end of the scheduler list.
+	return next_thread;
+}
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
-*/
-static void sched_queue_add(TCB* tcb)
+void set_affinity(TCB* tcb, coremask_t mask)
 {
-	/* Insert at the end of the scheduling list */
-	rlist_push_back(&SCHED[tcb->priority], &tcb->sched_node); // insert tcb at the end of the list(queue) with priority
+	/* The schedulers read the mask when they queue or select the thread */
+	__atomic_store_n(&tcb->affinity, mask, __ATOMIC_RELAXED);
+}
 
-	/* Restart possibly halted cores */
-	cpu_core_restart_one();
+/* Try to reserve utilization util on a core, within the bound */
+static int edf_reserve(uint c, uint util)
+{
+	uint cur = __atomic_load_n(&cctx[c].edf_util, __ATOMIC_RELAXED);
+	do {
+		if (cur + util > EDF_UTIL_BOUND)
+			return 0;
+	} while (! __atomic_compare_exchange_n(&cctx[c].edf_util, &cur, cur + util,
+			0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	__atomic_fetch_add(&cctx[c].edf_threads, 1, __ATOMIC_RELAXED);
+	return 1;
 }
- 
-/*
-	Adjust the state of a thread to make it READY.
 
-	*** MUST BE CALLED WITH sched_spinlock HELD ***
- */
-static void sched_make_ready(TCB* tcb)
+int set_deadline(TCB* tcb, TimerDuration period, TimerDuration budget)
 {
-	assert(tcb->state == STOPPED || tcb->state == INIT);
+	assert(tcb == cur_thread());
+
+	if (period != 0 && (budget == 0 || budget > period))
+		return -1;
+
+	uint old_core = tcb->rt_core;
+	uint old_util = is_realtime(tcb) ? edf_utilization(tcb->period, tcb->budget) : 0;
+	uint util = (period != 0) ? edf_utilization(period, budget) : 0;
+
+	/* Release the old reservation, and admit on the least loaded allowed core */
+	if (old_util != 0)
+		edf_unreserve(old_core, old_util);
+
+	uint rt_core = 0;
+	if (period != 0) {
+		int admitted = 0;
+		while (! admitted) {
+			uint best = MAX_CORES;
+			for (uint c = 0; c < cpu_cores(); c++)
+				if (CORE_IN_MASK(c, tcb->affinity) && (best == MAX_CORES 
+					|| __atomic_load_n(&cctx[c].edf_util, __ATOMIC_RELAXED) 
+						< __atomic_load_n(&cctx[best].edf_util, __ATOMIC_RELAXED)))
+					best = c;
+			if (best == MAX_CORES || 
+				__atomic_load_n(&cctx[best].edf_util, __ATOMIC_RELAXED) + util > EDF_UTIL_BOUND)
+				break;
+			admitted = edf_reserve(best, util);
+			rt_core = best;
+		}
 
-	/* Possibly remove from TIMEOUT_LIST */
-	if (tcb->wakeup_time != NO_TIMEOUT) {
-		/* tcb is in TIMEOUT_LIST, fix it */
-		assert(tcb->sched_node.next != &(tcb->sched_node) && tcb->state == STOPPED);
-		rlist_remove(&tcb->sched_node);
-		tcb->wakeup_time = NO_TIMEOUT;
+		if (! admitted) {
+			/* Keep the old parameters */
+			if (old_util != 0) {
+				__atomic_fetch_add(&cctx[old_core].edf_util, old_util, __ATOMIC_RELAXED);
+				__atomic_fetch_add(&cctx[old_core].edf_threads, 1, __ATOMIC_RELAXED);
+			}
+			return -1;
+		}
 	}
 
-	/* Mark as ready */
-	tcb->state = READY;
+	int preempt = preempt_off;
+	CCB* core = &CURCORE;
+	Spinlock_Lock(&core->sched_lock);
+	tcb->period = period;
+	tcb->budget = budget;
+	tcb->rt_core = rt_core;
+	tcb->deadline = 0;
+	tcb->runtime_left = 0;
+	Spinlock_Unlock(&core->sched_lock);
+	if (preempt) preempt_on;
+
+	/* Requeue, to enter the new class on the right core */
+	yield(SCHED_USER);
+	return 0;
+}
 
-	/* Possibly add to the scheduler queue */
-	if (tcb->phase == CTX_CLEAN)
-		sched_queue_add(tcb);
+int set_sched_class(TCB* tcb, sched_class cls)
+{
+	assert(tcb == cur_thread());
+
+	if (cls != CLASS_NORMAL && cls != CLASS_BATCH)
+		return -1;
+
+	int preempt = preempt_off;
+	CCB* core = &CURCORE;
+	Spinlock_Lock(&core->sched_lock);
+	tcb->sched_class = cls;
+	Spinlock_Unlock(&core->sched_lock);
+	if (preempt) preempt_on;
+
+	/* Requeue, to enter the new class */
+	yield(SCHED_USER);
+	return 0;
 }
 
+
 /*
-  Scan the \c TIMEOUT_LIST for threads whose timeout has expired, and
-  wake them up.
+  Priority lending.
+
+  A locked Mutex holds the TCB of its owner. Under POLICY_MLFQ, a thread
+  that keeps failing to lock a mutex raises a lower-priority owner to its
+  own level, moving it up in its core's queues, so that the owner is not 
+  kept off the cores by the waiters. The owner takes its priority back 
+  when it unlocks the mutex.
+
+  Under every policy, a batch owner with a normal waiter is moved to the
+  normal class in the same way, until it unlocks the mutex.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  The owner may unlock and exit while a waiter looks at it; release_TCB
+  waits for lend_lock, which the waiter holds.
 */
-static void sched_wakeup_expired_timeouts()
+
+int thread_is_running(TCB* tcb)
 {
-	/* Empty the timeout list up to the current time and wake up each thread */
-	TimerDuration curtime = bios_clock();
+	for (uint i = 0; i < cpu_cores(); i++)
+		if (__atomic_load_n(&cctx[i].current_thread, __ATOMIC_RELAXED) == tcb)
+			return 1;
+	return 0;
+}
 
-	while (!is_rlist_empty(&TIMEOUT_LIST)) {
-		TCB* tcb = TIMEOUT_LIST.next->tcb;
-		if (tcb->wakeup_time > curtime)
-			break;
-		sched_make_ready(tcb);
-	}
+/* Return true if tcb is in its level queue on core */
+static int sched_level_holds(CCB* core, TCB* tcb)
+{
+	rlnode* queue = &core->sched_queue[tcb->priority];
+	for (rlnode* n = queue->next; n != queue; n = n->next)
+		if (n == &tcb->sched_node)
+			return 1;
+	return 0;
 }
 
-/*
-  Remove the head of the scheduler list, if any, and
-  return it. Return NULL if the list is empty.
+/* Return true if tcb is in the batch queue of core */
+static int batch_holds(CCB* core, TCB* tcb)
+{
+	for (rlnode* n = core->batch_queue.next; n != &core->batch_queue; n = n->next)
+		if (n == &tcb->sched_node)
+			return 1;
+	return 0;
+}
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
-*/
-static TCB* sched_queue_select(TCB* current)
+int mutex_lend_priority(Mutex* lock)
 {
-	int top_thread = PRIORITY_QUEUES-1;
+	int preempt = preempt_off;
+	TCB* self = CURTHREAD;
+	int lent = 0;
 
-	for(int i = PRIORITY_QUEUES-1; i >= 0; i--){
-		if(!is_rlist_empty(&SCHED[i])){
-			top_thread = i;
-			break;
+	Spinlock_Lock(&lend_lock);
+
+	Mutex owner_value = __atomic_load_n(lock, __ATOMIC_RELAXED);
+	TCB* owner = (TCB*) owner_value;
+	if (owner_value != MUTEX_INIT && owner_value != MUTEX_ANON && owner != self
+		&& ! is_realtime(owner) && ! is_realtime(self)) {
+
+		CCB* core = lock_tcb_core(owner);
+
+		if (is_batch(owner) && ! is_batch(self)) {
+			int queued = owner->state == READY && batch_holds(core, owner);
+			if (queued)
+				batch_remove(core, owner);
+			owner->base_priority = owner->priority;
+			owner->lent_for = lock;
+			if (queued)
+				sched_rq_push(core, owner);
+
+			if (core->id != cpu_core_id && core->halting)
+				cpu_ici(core->id);
 		}
-	}
 
-	/* Get the head of the SCHED list */
-	rlnode* sel = rlist_pop_front(&SCHED[top_thread]); 
+		if (policy->lend_priority && owner->priority < self->priority) {
+			if (owner->lent_for == NULL)
+				owner->base_priority = owner->priority;
 
-	TCB* next_thread = sel->tcb; /* When the list is empty, this is NULL */
+			int queued = owner->state == READY && sched_level_holds(core, owner);
+			if (queued)
+				sched_level_remove(core, owner);
+			owner->priority = self->priority;
+			if (queued)
+				sched_level_push(core, owner);
+			owner->lent_for = lock;
 
-	if (next_thread == NULL)
-		next_thread = (current->state == READY) ? current : &CURCORE.idle_thread;
+			if (core->id != cpu_core_id && core->halting)
+				cpu_ici(core->id);
+		}
+		lent = policy->lend_priority && owner->priority >= self->priority;
 
-	next_thread->its = QUANTUM;
+		Spinlock_Unlock(&core->sched_lock);
+	}
 
-	return next_thread;
+	Spinlock_Unlock(&lend_lock);
+
+	if (preempt) preempt_on;
+	return lent;
+}
+
+void mutex_restore_priority(TCB* tcb, Mutex* lock)
+{
+	if (__atomic_compare_exchange_n(&tcb->lent_for, &lock, NULL, 0, 
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		tcb->priority = tcb->base_priority;
 }
 
 /*
@@ -365,15 +1839,15 @@ int wakeup(TCB* tcb)
 	/* Preemption off */
 	int oldpre = preempt_off;
 
-	/* To touch tcb->state, we must get the spinlock. */
-	Mutex_Lock(&sched_spinlock);
+	/* To touch tcb->state, we must get the spinlock of its core. */
+	CCB* core = lock_tcb_core(tcb);
 
 	if (tcb->state == STOPPED || tcb->state == INIT) {
 		sched_make_ready(tcb);
 		ret = 1;
 	}
 
-	Mutex_Unlock(&sched_spinlock);
+	Spinlock_Unlock(&core->sched_lock);
 
 	/* Restore preemption state */
 	if (oldpre)
@@ -382,6 +1856,106 @@ int wakeup(TCB* tcb)
 	return ret;
 }
 
+int wakeup_handoff(TCB* tcb)
+{
+	int ret = 0, handoff = 0;
+
+	int oldpre = preempt_off;
+
+	CCB* self = &CURCORE;
+	CCB* core = lock_tcb_core(tcb);
+
+	if (tcb->state == STOPPED || tcb->state == INIT) {
+		ret = 1;
+		handoff = tcb->phase == CTX_CLEAN && ! is_realtime(tcb) && ! is_batch(tcb)
+			&& sched_allowed(tcb, self->id) && self->current_thread->type != IDLE_THREAD;
+		if (handoff) {
+			sched_unblock(tcb);
+			tcb->enqueue_time = bios_clock();
+			if (core == self)
+				sched_rq_push(self, tcb);
+			else
+				sched_forward_to(self, tcb);
+		}
+		else
+			sched_make_ready(tcb);
+	}
+
+	if (handoff && core == self) {
+		self->handoff = tcb;
+		self->handoff_from = self->current_thread;
+	}
+	Spinlock_Unlock(&core->sched_lock);
+
+	/* Only this core takes threads out of its inbox, so tcb is still there */
+	if (handoff && core != self) {
+		Spinlock_Lock(&self->sched_lock);
+		self->handoff = tcb;
+		self->handoff_from = self->current_thread;
+		Spinlock_Unlock(&self->sched_lock);
+	}
+
+	if (oldpre)
+		preempt_on;
+
+	return ret;
+}
+
+int wakeup_batch(TCB** tcbs, int n, int* woken)
+{
+	int count = 0;
+
+	/* 
+		Restart as many halted cores as there are threads they could steal,
+		but not more than can run in parallel with us on the host.
+	*/
+	uint parallel = cpu_physical_cores();
+	int limit = (parallel > 2) ? parallel - 1 : 1;
+
+	int oldpre = preempt_off;
+
+	for (int i = 0; i < n; i++)
+		woken[i] = -1;
+
+	/* Take each core's lock once, for all the threads queued there */
+	for (int i = 0; i < n; i++) {
+		if (woken[i] >= 0) continue;
+
+		int busy = 0;
+		coremask_t mask = 0;
+
+		CCB* core = lock_tcb_core(tcbs[i]);
+		for (int j = i; j < n; j++) {
+			TCB* tcb = tcbs[j];
+			/* A thread's core only changes under the lock we hold */
+			if (woken[j] >= 0 || __atomic_load_n(&tcb->core, __ATOMIC_RELAXED) != core->id)
+				continue;
+
+			woken[j] = (tcb->state == STOPPED || tcb->state == INIT);
+			if (woken[j]) {
+				count++;
+				if (sched_ready(tcb)) {
+					busy++;
+					mask |= tcb->affinity;
+				}
+			}
+		}
+
+		/* As in sched_make_ready, restart while the queue is still locked */
+		if (busy > 0 && limit > 0) {
+			if (busy > limit) busy = limit;
+			sched_restart_halted(core->id, mask, busy);
+			limit -= busy;
+		}
+		Spinlock_Unlock(&core->sched_lock);
+	}
+
+	if (oldpre)
+		preempt_on;
+
+	return count;
+}
+
 /*
   Atomically put the current process to sleep, after unlocking mx.
  */
@@ -393,7 +1967,7 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 
 	int preempt = preempt_off;
 	TCB* tcb = CURTHREAD;
-	Mutex_Lock(&sched_spinlock);
+	Spinlock_Lock(&CURCORE.sched_lock);
 
 	/* mark the thread as stopped or exited */
 	tcb->state = state;
@@ -407,7 +1981,7 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 		Mutex_Unlock(mx);
 
 	/* Release the schduler spinlock before calling yield() !!! */
-	Mutex_Unlock(&sched_spinlock);
+	Spinlock_Unlock(&CURCORE.sched_lock);
 
 	/* call this to schedule someone else */
 	yield(cause);
@@ -422,79 +1996,59 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 /* This function is the entry point to the scheduler's context switching */
 
 
-int yield_counter; 
-
-
 void yield(enum SCHED_CAUSE cause)
 {
-
-	yield_counter++; //calling counter
-
-
 	/* Reset the timer, so that we are not interrupted by ALARM */
 	TimerDuration remaining = bios_cancel_timer();
 
 	/* We must stop preemption but save it! */
 	int preempt = preempt_off;
 
-	TCB* current = CURTHREAD; /* Make a local copy of current process, for speed */
+	CCB* core = &CURCORE;
+	TCB* current = core->current_thread; /* Make a local copy of current process, for speed */
 
-	Mutex_Lock(&sched_spinlock);
+	Spinlock_Lock(&core->sched_lock);
 
-	yield_counter = priority_boost(yield_counter); //boost 
+	core->halting = 0;
 
 	/* Update CURTHREAD state */
 	if (current->state == RUNNING)
 		current->state = READY;
 
+	/* An alarm set early, for the next timer event, does not end the quantum */
+	if (cause == SCHED_QUANTUM && current->type != IDLE_THREAD && ! is_realtime(current) 
+		&& ! is_batch(current) && current->its < policy->quantum(current))
+		cause = SCHED_PREEMPT;
+
 	/* Update CURTHREAD scheduler data */
 	current->rts = remaining;
 	current->last_cause = current->curr_cause;
 	current->curr_cause = cause;
 
-
+	TimerDuration ran = (remaining < current->its) ? current->its - remaining : 0;
+	if(is_realtime(current))
+		current->runtime_left -= (ran < current->runtime_left) ? ran : current->runtime_left;
+	else if(policy->on_yield != NULL && ! is_batch(current))
+		policy->on_yield(current, cause, ran);
 
 	/* Wake up threads whose sleep timeout has expired */
-	sched_wakeup_expired_timeouts();
+	sched_wakeup_expired_timeouts(core);
 
-	/* Get next */
-	TCB* next = sched_queue_select(current);
+	/* Get next. A thread queued from now on may ask for preemption again */
+	core->need_resched = 0;
+	TCB* next = sched_queue_select(core, current);
 	assert(next != NULL);
+	core->current_priority = (next->type == IDLE_THREAD) ? -1 
+		: (is_realtime(next) || is_batch(next)) ? PRIORITY_QUEUES : next->priority;
 
 	/* Save the current TCB for the gain phase */
-	CURCORE.previous_thread = current;
+	core->previous_thread = current;
 
-	Mutex_Unlock(&sched_spinlock);
+	Spinlock_Unlock(&core->sched_lock);
 	
-	// switch case for each cause
-	switch(cause) {
-		case SCHED_QUANTUM:
-			if(current->priority == 0)
-				current->priority = 0;
-			else
-				current->priority--;
-			break; 
-		case SCHED_IO:
-			if(current->priority == PRIORITY_QUEUES -1)
-				current->priority = PRIORITY_QUEUES -1;
-			else
-				current->priority ++; 
-			break;
-		case SCHED_MUTEX:
-			if(current->curr_cause == current->last_cause){
-				if(current->priority == 0)
-					current->priority = 0;
-				else
-					current->priority--;
-			}
-			break; 
-		default : 
-			break;
-	}
-
 	/* Switch contexts */
 	if (current != next) {
-		CURTHREAD = next;
+		core->current_thread = next;
 		cpu_swap_context(&current->context, &next->context);
 	}
 	
@@ -506,22 +2060,6 @@ void yield(enum SCHED_CAUSE cause)
 	gain(preempt);
 }
 
-//function for the boost 
-int priority_boost(int counter){
-
-	if(counter > YIELD_CALLS){
-		for(int i = PRIORITY_QUEUES - 2; i >= 0; i--){
-			while(!is_rlist_empty(&SCHED[i])){
-				rlnode* current_node = rlist_pop_front(&SCHED[i]);
-				current_node->tcb->priority++;
-				rlist_push_back(&SCHED[i+1], current_node); 
-			}
-			counter = 0;
-		}
-	}
-	return counter;
-}
-
 /*
   This function must be called at the beginning of each new timeslice.
   This is done mostly from inside yield().
@@ -537,9 +2075,11 @@ int priority_boost(int counter){
 
 void gain(int preempt)
 {	
-	Mutex_Lock(&sched_spinlock);
+	CCB* core = &CURCORE;
+	Spinlock_Lock(&core->sched_lock);
 
-	TCB* current = CURTHREAD;
+	TCB* current = core->current_thread;
+	core_thread_set((current->type == NORMAL_THREAD) ? current : NULL);
 
 	/* Mark current state */
 	current->state = RUNNING;
@@ -547,7 +2087,8 @@ void gain(int preempt)
 	current->rts = current->its;
 
 	/* Take care of the previous thread */
-	TCB* prev = CURCORE.previous_thread;
+	TCB* prev = core->previous_thread;
+	TCB* exited = NULL;
 	if (current != prev) {
 		prev->phase = CTX_CLEAN;
 		switch (prev->state) {
@@ -556,7 +2097,7 @@ void gain(int preempt)
 				sched_queue_add(prev);
 			break;
 		case EXITED:
-			release_TCB(prev);
+			exited = prev;
 			break;
 		case STOPPED:
 			break;
@@ -565,14 +2106,62 @@ void gain(int preempt)
 		}
 	}
 
-	Mutex_Unlock(&sched_spinlock);
+	Spinlock_Unlock(&core->sched_lock);
+
+	/* An exited thread is released outside the lock */
+	if (exited != NULL)
+		release_TCB(exited);
 
 	/* Reset preemption as needed */
 	if (preempt)
 		preempt_on;
 
-	/* Set a 1-quantum alarm */
-	bios_set_timer(current->rts);
+	/* Set a 1-quantum alarm. The idle thread sets its own timer. */
+	if (current->type != IDLE_THREAD)
+		bios_set_timer(current->rts);
+}
+
+/*
+  Halt the core until there is work for it. 
+
+  Before halting, the core is marked as halting and the timer is set
+  to the next timeout of the core, if any. Both are done with 
+  interrupts disabled, so that an ICI sent by sched_queue_add() after
+  the check will be pending, and will end the halt immediately.
+*/
+static void idle_halt()
+{
+	CCB* core = &CURCORE;
+	TimerDuration next_event;
+
+	preempt_off;
+
+	Spinlock_Lock(&core->sched_lock);
+	int has_work = (core->ready_count > 0) || (core->edf_ready > 0) || (core->batch_ready > 0)
+		|| (active_threads == 0);
+	if (! has_work) {
+		core->halting = 1;
+		next_event = sched_next_event(core);
+
+		/* A thread forwarded before we set 'halting' got no ICI */
+		Spinlock_Lock(&core->inbox_lock);
+		has_work = ! is_rlist_empty(&core->inbox);
+		Spinlock_Unlock(&core->inbox_lock);
+	}
+	Spinlock_Unlock(&core->sched_lock);
+
+	if (has_work) {
+		preempt_on;
+		return;
+	}
+
+	if (next_event != 0) {
+		/* bios_clock() is coarse; never set a timer in the past */
+		TimerDuration now = bios_clock();
+		bios_set_timer((next_event > now) ? next_event - now : TW_TICK);
+	}
+
+	cpu_core_halt();
 }
 
 static void idle_thread()
@@ -582,26 +2171,60 @@ static void idle_thread()
 
 	/* We come here whenever we cannot find a ready thread for our core */
 	while (active_threads > 0) {
-		cpu_core_halt();
+		idle_halt();
 		yield(SCHED_IDLE);
 	}
 
 	/* If the idle thread exits here, we are leaving the scheduler! */
 	bios_cancel_timer();
-	cpu_core_restart_all();
+
+	/* Interrupt the other cores; they may be about to halt */
+	for (uint c = 0; c < cpu_cores(); c++)
+		if (c != cpu_core_id)
+			cpu_ici(c);
 }
 
 /*
   Initialize the scheduler queue
  */
-void initialize_scheduler()
+void initialize_scheduler(sched_policy boot_policy)
 {
-	for(int i = 0; i < PRIORITY_QUEUES; i++){
-		rlnode_init(&SCHED[i], NULL);
+	switch(boot_policy) {
+		case POLICY_FAIR: policy = &fair_ops; break;
+		case POLICY_RR: policy = &rr_ops; break;
+		default: policy = &mlfq_ops; break;
+	}
+
+	for(uint c = 0; c < MAX_CORES; c++) {
+		CCB* core = &cctx[c];
+		core->id = c;
+		core->sched_lock = SPINLOCK_INIT;
+		for(int i = 0; i < PRIORITY_QUEUES; i++){
+			rlnode_init(&core->sched_queue[i], NULL);
+		}
+		core->ready_mask = 0;
+		core->ready_count = 0;
+		tw_init(&core->timeouts, bios_clock());
+		core->halting = 0;
+		core->inbox_lock = SPINLOCK_INIT;
+		rlnode_init(&core->inbox, NULL);
+		/* The thread caches are kept across boots */
+		core->current_thread = NULL;
+		core->min_vruntime = 0;
+		rlnode_init(&core->edf_queue, NULL);
+		rlnode_init(&core->edf_throttled, NULL);
+		rlnode_init(&core->batch_queue, NULL);
+		core->batch_ready = 0;
+		core->edf_ready = 0;
+		core->edf_threads = 0;
+		core->edf_util = 0;
+		core->need_resched = 0;
+		core->current_priority = -1;
+		core->handoff = NULL;
 	}
 	
-	rlnode_init(&TIMEOUT_LIST, NULL);
-	yield_counter = 0;
+	for(int i = 0; i < PRIORITY_QUEUES; i++)
+		level_quantum[i] = QUANTUM << ((PRIORITY_QUEUES - 1 - i) / LEVEL_QUANTUM_STEP);
 }
 
 void run_scheduler()
@@ -618,6 +2241,8 @@ void run_scheduler()
 	curcore->idle_thread.state = RUNNING;
 	curcore->idle_thread.phase = CTX_DIRTY;
 	curcore->idle_thread.wakeup_time = NO_TIMEOUT;
+	curcore->idle_thread.core = curcore->id;
+	curcore->idle_thread.affinity = ALL_CORES;
 	rlnode_init(&curcore->idle_thread.sched_node, &curcore->idle_thread);
 
 	curcore->idle_thread.its = QUANTUM;
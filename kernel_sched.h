@@ -88,7 +88,8 @@ enum SCHED_CAUSE {
 	SCHED_PIPE, /**< @brief Sleep at a pipe or socket */
 	SCHED_POLL, /**< @brief The thread is polling a device */
 	SCHED_IDLE, /**< @brief The idle thread called yield */
-	SCHED_USER /**< @brief User-space code called yield */
+	SCHED_USER, /**< @brief User-space code called yield */
+	SCHED_PREEMPT /**< @brief A more urgent thread became ready on the core */
 };
 
 
@@ -112,14 +113,38 @@ typedef struct thread_control_block {
 	Thread_phase phase; /**< @brief The phase of the thread */
 
 	void (*thread_func)(); /**< @brief The initial function executed by this thread */
+	size_t stack_size; /**< @brief The size of the thread stack, a multiple of the page size */
 
 	TimerDuration wakeup_time; /**< @brief The time this thread will be woken up by the scheduler */
 
+	uint core; /**< @brief The core whose run queue holds this thread.
+
+	  This is the core the thread last ran on (or was created on), and it is
+	  where the thread is queued when it is woken up. It changes only when
+	  another core steals the thread, with both cores' @c sched_lock held,
+	  or when the thread is forwarded to a core in its affinity mask.
+	  */
+
+	coremask_t affinity; /**< @brief The cores this thread may run on */
+
+	uint64_t vruntime; /**< @brief Weighted run time, for @c POLICY_FAIR */
+	uint heap_index; /**< @brief Position in the run queue heap, for @c POLICY_FAIR */
+
+	TimerDuration period; /**< @brief The real-time period, or 0 for normal threads */
+	TimerDuration budget; /**< @brief The real-time budget per period */
+	TimerDuration deadline; /**< @brief The absolute deadline of the current period */
+	TimerDuration runtime_left; /**< @brief The budget left in the current period */
+	uint rt_core; /**< @brief The core that admitted the real-time thread */
+	sched_class sched_class; /**< @brief @c CLASS_NORMAL, or @c CLASS_BATCH for background threads */
+
 	rlnode sched_node; /**< @brief Node to use when queueing in the scheduler queue */
 	TimerDuration its; /**< @brief Initial time-slice for this thread */
 	TimerDuration rts; /**< @brief Remaining time-slice for this thread */
+	TimerDuration enqueue_time; /**< @brief When the thread became ready, or was last aged */
 	
 	int priority ; //priority thread mlfq
+	int base_priority; /**< @brief The priority to restore when a lent priority is returned */
+	Mutex* lent_for; /**< @brief The mutex for which a waiter lent us its priority, or NULL */
 
 	enum SCHED_CAUSE curr_cause; /**< @brief The endcause for the current time-slice */
 	enum SCHED_CAUSE last_cause; /**< @brief The endcause for the last time-slice */
@@ -153,6 +178,9 @@ typedef struct process_thread_control_block {
 
 	int refcount;
 
+	size_t stack_size;	// Stack size of the thread
+	size_t stack_used;	// Stack high-water mark, recorded at exit
+
 	rlnode ptcb_list_node;
 } PTCB;
 /** @brief Thread stack size.
@@ -161,15 +189,105 @@ typedef struct process_thread_control_block {
  */
 #define THREAD_STACK_SIZE (128 * 1024)
 
+/** @brief The smallest thread stack size. Smaller requests are rounded up to it. */
+#define THREAD_STACK_MIN (16 * 1024)
+
+/** @brief The largest thread stack size. */
+#define THREAD_STACK_MAX (64 * 1024 * 1024)
+
 /************************
  *
  *      Scheduler
  *
  ************************/
 
+/** @brief The number of MLFQ priority levels.
+
+  Level @c PRIORITY_QUEUES-1 is the highest priority and level 0 the lowest.
+ */
+#define PRIORITY_QUEUES 10
+
+/** @brief Number of levels of a timing wheel. */
+#define TW_LEVELS 4
+
+/** @brief log2 of the number of slots per timing wheel level. */
+#define TW_SLOT_BITS 6
+
+/** @brief Number of slots per timing wheel level. */
+#define TW_SLOTS (1 << TW_SLOT_BITS)
+
+/** @brief The resolution of a timing wheel, in microseconds. */
+#define TW_TICK 1000
+
+/** @brief A hierarchical timing wheel of sleeping threads.
+
+  Level @c l has @c TW_SLOTS slots, each spanning @f$ 64^l @f$ ticks.
+  A thread whose wakeup tick is @c d ticks away is kept at the lowest
+  level @c l with @f$ d < 64^{l+1} @f$. When the lower levels wrap
+  around, the next slot of level @c l is cascaded to the lower levels.
+  Insertion and removal take constant time, and expiry takes amortized
+  constant time per tick.
+ */
+typedef struct timer_wheel {
+	TimerDuration now; /**< @brief The last tick processed */
+	uint count; /**< @brief Number of threads in the wheel */
+	uint64_t occupied[TW_LEVELS]; /**< @brief Hints: bit @c s is set if @c slot[l][s] may be non-empty */
+	rlnode slot[TW_LEVELS][TW_SLOTS]; /**< @brief The slot lists */
+} timer_wheel;
+
+/** @brief Return true if core @c c is in mask @c m. */
+#define CORE_IN_MASK(c, m) (((m) >> (c)) & 1u)
+
+/** 
+  @brief A queued (MCS) spinlock, for the non-preemptive kernel.
+
+  Waiters queue up in FIFO order and each one spins on a node of its own
+  core, so a contended lock does not bounce one cache line among all the 
+  cores, and no core is passed over. A @c Spinlock must be locked and 
+  unlocked with preemption off, on the same core.
+
+  When the VM has more cores than the host has processors, i.e.,
+  @c cpu_cores() > @c cpu_physical_cores(), a @c Spinlock is a 
+  test-and-set lock instead: a FIFO handoff would wait for the host to 
+  run a waiter that is not running. Then, waiters are not served in order.
+  @c spinlock_force_mcs() turns this fallback off.
+
+  @see Spinlock_Lock
+ */
+typedef struct spinlock {
+	struct spinlock_node* tail; /**< @brief The last node in the queue; NULL when unlocked */
+	struct spinlock_node* holder; /**< @brief The node of the core holding the lock */
+} Spinlock;
+
+/** @brief The initial value of a @c Spinlock */
+#define SPINLOCK_INIT ((Spinlock){ NULL, NULL })
+
+/** @brief Lock a @c Spinlock, with preemption off. */
+void Spinlock_Lock(Spinlock* lock);
+
+/** @brief Lock a @c Spinlock if it is free. Return 1 on success. */
+int Spinlock_TryLock(Spinlock* lock);
+
+/** @brief Unlock a @c Spinlock, on the core that locked it. */
+void Spinlock_Unlock(Spinlock* lock);
+
+/** 
+  @brief Keep @c Spinlock queued (MCS) even when the VM has more cores than the host.
+
+  With @c force set, a @c Spinlock does not fall back to test-and-set,
+  so that its FIFO handoff can be tested on any host. It should be called 
+  before @c boot().
+ */
+void spinlock_force_mcs(int force);
+
+
 /** @brief Core control block.
 
   Per-core info in memory (basically scheduler-related). 
+
+  Each core owns its own MLFQ run queues and timeout list, protected by
+  its own @c sched_lock. The lock also protects the state of every thread
+  whose @c core field designates this core.
  */
 typedef struct core_control_block {
 	uint id; /**< @brief The core id */
@@ -178,7 +296,38 @@ typedef struct core_control_block {
 	TCB* previous_thread; /**< @brief Points to the thread that previously owned the core */
 	TCB idle_thread; /**< @brief Used by the scheduler to handle the core's idle thread */
 
-} CCB;
+	Spinlock sched_lock; /**< @brief Spinlock for the core's scheduler data */
+	rlnode sched_queue[PRIORITY_QUEUES]; /**< @brief The MLFQ run queues of the core */
+	uint32_t ready_mask; /**< @brief Bit @c i is set iff @c sched_queue[i] is non-empty */
+	uint ready_count; /**< @brief Number of ready threads in the run queues */
+
+	TCB** fair_heap; /**< @brief The run queue of @c POLICY_FAIR, a min-heap on @c vruntime */
+	uint fair_cap; /**< @brief The capacity of @c fair_heap */
+	uint64_t min_vruntime; /**< @brief Lower bound on the @c vruntime of the core's ready threads */
+
+	rlnode edf_queue; /**< @brief Runnable real-time threads, by deadline */
+	rlnode edf_throttled; /**< @brief Real-time threads that used up their budget, by deadline */
+	uint edf_ready; /**< @brief Number of threads in @c edf_queue */
+	uint edf_threads; /**< @brief Number of real-time threads admitted on this core */
+	uint edf_util; /**< @brief Utilization admitted on this core, in millionths */
+	rlnode batch_queue; /**< @brief Ready batch threads, in FIFO order */
+	uint batch_ready; /**< @brief Number of threads in @c batch_queue */
+	int need_resched; /**< @brief Set when a more urgent thread is queued on this core */
+	int current_priority; /**< @brief MLFQ level of the running thread; -1 when idle.
+
+	  It is @c PRIORITY_QUEUES for real-time and batch threads, which woken
+	  normal threads do not preempt. */
+	TCB* handoff; /**< @brief A thread queued here by @c wakeup_handoff(), or NULL */
+	TCB* handoff_from; /**< @brief The thread that called @c wakeup_handoff() */
+	timer_wheel timeouts; /**< @brief Threads sleeping with a timeout on this core */
+	int halting; /**< @brief Set by the idle thread before it halts the core */
+
+	Spinlock inbox_lock; /**< @brief Lock for @c inbox. Never held while taking another lock */
+	rlnode inbox; /**< @brief Ready threads forwarded from other cores, due to affinity */
+	void* thread_cache; /**< @brief Free thread memory blocks of this core, in a chain */
+	uint thread_cached; /**< @brief Number of blocks in @c thread_cache */
+
+} __attribute__((aligned(64))) CCB;
 
 /** @brief the array of Core Control Blocks (CCB) for the kernel */
 extern CCB cctx[MAX_CORES];
@@ -197,6 +346,43 @@ extern CCB cctx[MAX_CORES];
 */
 TCB* cur_thread();
 
+/**
+  @brief The current thread, without disabling preemption.
+
+  This is cheap enough for the fast path of @c Mutex_Lock. It reads a 
+  per-core variable that is set whenever a thread starts a time-slice.
+
+  @returns the TCB of the caller, or NULL if the caller is not a normal
+    thread (an idle thread, or the boot code).
+*/
+TCB* cur_thread_fast();
+
+/**
+  @brief Return true if a thread is the current thread of some core.
+
+  This only reads the @c current_thread of each core, so @c tcb may 
+  be any value, even the TCB of a thread that has exited.
+*/
+int thread_is_running(TCB* tcb);
+
+/**
+  @brief Lend the priority of the current thread to the owner of a mutex.
+
+  This is called by @c Mutex_Lock, with preemption on, when the lock 
+  keeps failing. Under @c POLICY_MLFQ, an owner of lower priority is 
+  raised to the level of the caller until it unlocks the mutex.
+
+  @returns 1 if the owner now runs at the caller's priority or above.
+*/
+int mutex_lend_priority(Mutex* lock);
+
+/**
+  @brief Return the priority lent to the current thread for a mutex.
+
+  Called by @c Mutex_Unlock of the owner of @c lock.
+*/
+void mutex_restore_priority(TCB* tcb, Mutex* lock);
+
 /** 
   @brief The current process.
 
@@ -223,9 +409,61 @@ TCB* cur_thread();
                 otherwise ignores it
 
     @param func The function to execute in the new thread.
+    @param stack_size The stack size of the new thread, rounded up to whole pages.
     @returns  A pointer to the TCB of the new thread, in the @c INIT state.
 */
-TCB* spawn_thread(PCB* pcb, void (*func)());
+TCB* spawn_thread(PCB* pcb, void (*func)(), size_t stack_size);
+
+/**
+  @brief Return how many bytes of its stack a thread has used.
+
+  This is the high-water mark of the stack, measured from its start. 
+  The thread must not be released while this is called.
+*/
+size_t thread_stack_usage(TCB* tcb);
+
+/**
+  @brief Set the cores a thread may run on.
+
+  The mask must contain some existing core. The change takes effect 
+  the next time the thread is queued or selected by a scheduler.
+ */
+void set_affinity(TCB* tcb, coremask_t mask);
+
+/**
+  @brief Move a thread to the real-time class, or back.
+
+  A thread with a period is scheduled by earliest deadline first, ahead
+  of all normal threads on its core, and runs for at most @c budget 
+  in each period. The thread is admitted on a core of its affinity mask,
+  where the real-time threads' total utilization stays within a bound.
+  A zero period moves the thread back to the normal class.
+
+  This must be called by the thread itself, with preemption on.
+
+  @param tcb the current thread
+  @param period the period, in microseconds, or 0
+  @param budget the budget per period, in microseconds
+  @returns 0 on success, -1 if the arguments are invalid or the thread
+    was not admitted
+ */
+int set_deadline(TCB* tcb, TimerDuration period, TimerDuration budget);
+
+/**
+  @brief Set the scheduling class of a normal thread.
+
+  A batch thread is queued apart from the normal threads of its core,
+  and runs only when none of them is ready, for a long quantum that 
+  woken normal threads do not preempt. While a batch thread owns a
+  mutex that a waiter lends it its priority for, it is a normal thread.
+
+  This must be called by the thread itself, with preemption on.
+
+  @param tcb the current thread
+  @param cls the new class
+  @returns 0 on success, -1 if the class is invalid
+ */
+int set_sched_class(TCB* tcb, sched_class cls);
 
 /**
   @brief Wakeup a blocked thread.
@@ -239,6 +477,35 @@ TCB* spawn_thread(PCB* pcb, void (*func)());
 */
 int wakeup(TCB* tcb);
 
+/**
+  @brief Wakeup a batch of blocked threads.
+
+  This has the effect of calling @c wakeup() on each thread, but takes
+  the @c sched_lock of each core once for all its threads. Afterwards,
+  as many halted cores are restarted as there are new ready threads 
+  queued on busy cores.
+
+  @param tcbs the threads to be made @c READY
+  @param n the number of threads
+  @param woken an array of @c n results; @c woken[i] is what @c wakeup(tcbs[i]) 
+    would return
+  @returns the number of threads that were woken up
+*/
+int wakeup_batch(TCB** tcbs, int n, int* woken);
+
+/**
+  @brief Wakeup a blocked thread, to switch to it directly.
+
+  This is like @c wakeup(), but the thread is queued on the current core 
+  if it may run there. When the current thread blocks next, it switches 
+  straight to the woken thread, giving it the rest of its time-slice. 
+  Real-time threads are woken up as usual.
+
+  @param tcb the thread to be made @c READY.
+  @returns 1 if the thread state was @c STOPPED or @c INIT, 0 otherwise
+*/
+int wakeup_handoff(TCB* tcb);
+
 /** 
   @brief Block the current thread.
 
@@ -294,18 +561,19 @@ void run_scheduler(void);
   @brief Initialize the scheduler.
 
    This function is called during kernel initialization.
+
+   @param policy the scheduling policy used until the next boot
  */
-void initialize_scheduler(void);
+void initialize_scheduler(sched_policy policy);
 
 /**
   @brief Quantum (in microseconds) 
 
-  This is the default quantum for each thread, in microseconds.
+  This is the quantum of the highest priority levels, in microseconds.
+  Lower levels get progressively longer quanta.
   */
 #define QUANTUM (10000L)
 
-int priority_boost(int counter);//Gradually trnasfer the threads of each queue to the immediately higher one
-
 /** @} */
 
 #endif
@@ -10,7 +10,8 @@ static file_ops socket_file_ops={
 	.Open = NULL,
 	.Read = socket_read,
 	.Write = socket_write,
-	.Close = socket_close
+	.Close = socket_close,
+	.own_lock = 1
 };
 
 
@@ -33,6 +34,7 @@ Fid_t sys_Socket(port_t port)
 			return NOFILE;
 		}
 
+		scb->lock = MUTEX_INIT;
 		scb->fcb = fcb[0];
 
 		scb->fcb->streamobj = scb;
@@ -122,13 +124,11 @@ Fid_t sys_Accept(Fid_t lsock)
         		return NOFILE;
 			}
 
-			FCB* fcb1[2];			/* List of FCBs */
-
-			//fcb1[0] = NULL;
-			//fcb1[1] = NULL;
-
-			pipe1->reader = fcb1[0];
-			pipe1->writer = fcb1[1];
+			/* The server writes to pipe1, the client reads from it */
+			pipe1->lock = MUTEX_INIT;
+			pipe1->refcount = 2;
+			pipe1->reader = client->fcb;
+			pipe1->writer = fcb_server;
 			pipe1->has_space = COND_INIT;
 			pipe1->has_data = COND_INIT;
 			pipe1->r_position = 0;
@@ -141,13 +141,10 @@ Fid_t sys_Accept(Fid_t lsock)
         		return NOFILE;
 			}
 
-			FCB* fcb2[2];			/* List of FCBs */
-			
-			//fcb2[0] = NULL;
-			//fcb2[1] = NULL;
-
-			pipe2->reader = fcb2[0];
-			pipe2->writer = fcb2[1];
+			pipe2->lock = MUTEX_INIT;
+			pipe2->refcount = 2;
+			pipe2->reader = fcb_server;
+			pipe2->writer = client->fcb;
 			pipe2->has_space = COND_INIT;
 			pipe2->has_data = COND_INIT;
 			pipe2->r_position = 0;
@@ -158,15 +155,19 @@ Fid_t sys_Accept(Fid_t lsock)
 				return NOFILE;
 			}
 
+			Mutex_Lock(&server->lock);
 			server->type = SOCKET_PEER;
 			server->peer.write_pipe = pipe1;
 			server->peer.read_pipe = pipe2;
 			server->peer.peer = client;
+			Mutex_Unlock(&server->lock);
 
+			Mutex_Lock(&client->lock);
 			client->type = SOCKET_PEER;
 			client->peer.write_pipe = pipe2;
 			client->peer.read_pipe = pipe1;
 			client->peer.peer = server;		
+			Mutex_Unlock(&client->lock);
 
 			req->admited = 1;
 
@@ -246,21 +247,26 @@ int sys_ShutDown(Fid_t sock, shutdown_mode how)
 		Socket_cb* scb = fcb->streamobj;
 
 		if(scb != NULL && scb->type == SOCKET_PEER){
+			/* Detach the pipes under the socket lock, and close them after */
+			Pipe_cb* read_pipe = NULL;
+			Pipe_cb* write_pipe = NULL;
+
+			Mutex_Lock(&scb->lock);
 			switch(how){
 
 				case SHUTDOWN_READ:
-					pipe_reader_close(scb->peer.read_pipe);
+					read_pipe = scb->peer.read_pipe;
 					scb->peer.read_pipe = NULL;
 					break;
 
 				case SHUTDOWN_WRITE:
-					pipe_writer_close(scb->peer.write_pipe);
+					write_pipe = scb->peer.write_pipe;
 					scb->peer.write_pipe = NULL;
 					break;
 
 				case SHUTDOWN_BOTH:
-					pipe_reader_close(scb->peer.read_pipe);
-					pipe_writer_close(scb->peer.write_pipe);
+					read_pipe = scb->peer.read_pipe;
+					write_pipe = scb->peer.write_pipe;
 					scb->peer.read_pipe = NULL;
 					scb->peer.write_pipe = NULL;
 					break;
@@ -268,6 +274,12 @@ int sys_ShutDown(Fid_t sock, shutdown_mode how)
 				default:
 					assert(0);
 			}
+			Mutex_Unlock(&scb->lock);
+
+			if(read_pipe != NULL)
+				pipe_reader_close(read_pipe);
+			if(write_pipe != NULL)
+				pipe_writer_close(write_pipe);
 			return 0;
 		}
 	}
@@ -311,20 +323,44 @@ int socket_close(void* fid){
 int socket_read(void* socket, char* buf, unsigned int size){
 	Socket_cb* scb = (Socket_cb*) socket;
 
-	if(scb == NULL || scb->type != SOCKET_PEER || scb->peer.read_pipe == NULL){
+	if(scb == NULL)
+		return -1;
+
+	Mutex_Lock(&scb->lock);
+	Pipe_cb* pipe = (scb->type == SOCKET_PEER) ? scb->peer.read_pipe : NULL;
+	/* ShutDown may close the pipe while we use it */
+	if(pipe != NULL)
+		pipe_incref(pipe);
+	Mutex_Unlock(&scb->lock);
+
+	if(pipe == NULL){
 		return -1;
 	}
 	
-	return pipe_read(scb->peer.read_pipe, buf, size);
+	int ret = pipe_read(pipe, buf, size);
+	pipe_decref(pipe);
+	return ret;
 }
 
 int socket_write(void* socket, const char* buf, unsigned int size){
 	Socket_cb* scb = (Socket_cb*)socket;
 
-	if(scb == NULL || scb->type != SOCKET_PEER || scb->peer.write_pipe == NULL){
+	if(scb == NULL)
+		return -1;
+
+	Mutex_Lock(&scb->lock);
+	Pipe_cb* pipe = (scb->type == SOCKET_PEER) ? scb->peer.write_pipe : NULL;
+	/* ShutDown may close the pipe while we use it */
+	if(pipe != NULL)
+		pipe_incref(pipe);
+	Mutex_Unlock(&scb->lock);
+
+	if(pipe == NULL){
 		return -1;
 	}
 	
-	return pipe_write(scb->peer.write_pipe, buf, size);
+	int ret = pipe_write(pipe, buf, size);
+	pipe_decref(pipe);
+	return ret;
 }
 
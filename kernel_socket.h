@@ -35,6 +35,7 @@ struct peer_socket
 
 typedef struct socket_control_block{
 
+	Mutex lock;	/* protects type and peer, which Read and Write use without the kernel lock */
 	uint refcount;
 	FCB* fcb;
 	socket_type type;
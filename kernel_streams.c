@@ -29,6 +29,8 @@ FCB* acquire_FCB()
   if(! is_rlist_empty(& FCB_freelist)) {
     FCB* fcb = rlist_pop_front(& FCB_freelist)->fcb;
     fcb->refcount = 0;
+    /* Until the stream is opened, I/O on it fails */
+    fcb->streamfunc = NULL;
     return fcb;
   }
   else
@@ -41,18 +43,25 @@ void release_FCB(FCB* fcb)
 }
 
 
+/*
+  The reference counts are atomic, since Read and Write take and drop
+  references without the kernel lock. Everything else about FCBs,
+  including the freelist and the fid tables, changes under the kernel 
+  lock.
+ */
+
 void FCB_incref(FCB* fcb)
 {
   assert(fcb);
-  fcb->refcount++;
+  __atomic_add_fetch(&fcb->refcount, 1, __ATOMIC_RELAXED);
 }
 
 int FCB_decref(FCB* fcb)
 {
   assert(fcb);
-  fcb->refcount --;
-  if(fcb->refcount==0) {
-    int retval = fcb->streamfunc->Close(fcb->streamobj);
+  if(__atomic_sub_fetch(&fcb->refcount, 1, __ATOMIC_ACQ_REL)==0) {
+    /* An unreserved FCB has no stream to close */
+    int retval = fcb->streamfunc ? fcb->streamfunc->Close(fcb->streamobj) : 0;
     release_FCB(fcb);
     return retval;
   }
@@ -103,8 +112,10 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
     PCB* cur = CURPROC;
     for(size_t i=0; i<num ; i++) {
 	assert(cur->FIDT[fid[i]]==fcb[i]);
-	cur->FIDT[fid[i]] = NULL;
-	release_FCB(fcb[i]);
+	__atomic_store_n(&cur->FIDT[fid[i]], NULL, __ATOMIC_RELEASE);
+	/* A concurrent Read or Write may hold a reference */
+	fcb[i]->streamfunc = NULL;
+	FCB_decref(fcb[i]);
     }
 }
 
@@ -128,33 +139,72 @@ FCB* get_fcb(Fid_t fid)
 }
 
 
+/*
+  Drop a reference taken by get_fcb_ref(). If it is the last one, the
+  fid was closed while we used it, and the stream is closed under the
+  kernel lock, like in Close.
+ */
+static void put_fcb_ref(FCB* fcb)
+{
+  uint ref = __atomic_load_n(&fcb->refcount, __ATOMIC_RELAXED);
+  while(ref > 1)
+    if(__atomic_compare_exchange_n(&fcb->refcount, &ref, ref-1,
+        0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      return;
+
+  kernel_lock();
+  FCB_decref(fcb);
+  kernel_unlock();
+}
+
+
+/*
+  Read and Write run without the kernel lock, so another thread of the
+  process may close the fid at any time. We take a reference to the FCB
+  only while it still has one, and check that the fid still maps to it.
+  The FCBs are never freed, so it is safe to look at a released one.
+ */
+static FCB* get_fcb_ref(Fid_t fid)
+{
+  if(fid < 0 || fid >= MAX_FILEID) return NULL;
+
+  FCB** slot = &CURPROC->FIDT[fid];
+  FCB* fcb;
+  while((fcb = __atomic_load_n(slot, __ATOMIC_ACQUIRE)) != NULL) {
+    uint ref = __atomic_load_n(&fcb->refcount, __ATOMIC_RELAXED);
+    if(ref == 0 || ! __atomic_compare_exchange_n(&fcb->refcount, &ref, ref+1,
+        0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      continue;
+    if(__atomic_load_n(slot, __ATOMIC_ACQUIRE) == fcb)
+      return fcb;
+    put_fcb_ref(fcb);
+  }
+  return NULL;
+}
+
+
+
 int sys_Read(Fid_t fd, char *buf, unsigned int size)
 {
   int retcode = -1;
-  int (*devread)(void*,char*,uint);
-  void* sobj;
 
-  
-  /* Get the fields from the stream */
-  FCB* fcb = get_fcb(fd);
+  /* make sure that the stream will not be closed (by another thread) 
+     while we are using it! */
+  FCB* fcb = get_fcb_ref(fd);
 
   if(fcb) {
-    sobj = fcb->streamobj;
-    devread = fcb->streamfunc->Read;
+    file_ops* fops = fcb->streamfunc;
 
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
-  
-    if(devread)
-      retcode = devread(sobj, buf, size);
+    if(fops && fops->Read) {
+      /* Streams that lack their own locks are read under the kernel lock */
+      if(! fops->own_lock) kernel_lock();
+      retcode = fops->Read(fcb->streamobj, buf, size);
+      if(! fops->own_lock) kernel_unlock();
+    }
 
     /* Need to decrease the reference to FCB */
-    FCB_decref(fcb);
+    put_fcb_ref(fcb);
   }
-  
-  /* We must not go into non-preemptive domain with kernel_mutex locked */
-
 
   return retcode;
 }
@@ -163,32 +213,25 @@ int sys_Read(Fid_t fd, char *buf, unsigned int size)
 int sys_Write(Fid_t fd, const char *buf, unsigned int size)
 {
   int retcode = -1;
-  int (*devwrite)(void*, const char*, uint) = NULL;
-  void* sobj = NULL;
 
-  
-  /* Get the fields from the stream */
-  FCB* fcb = get_fcb(fd);
+  /* make sure that the stream will not be closed (by another thread) 
+     while we are using it! */
+  FCB* fcb = get_fcb_ref(fd);
 
   if(fcb) {
+    file_ops* fops = fcb->streamfunc;
 
-    sobj = fcb->streamobj;
-    devwrite = fcb->streamfunc->Write;
-
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
-  
-
-    if(devwrite)
-      retcode = devwrite(sobj, buf, size);
+    if(fops && fops->Write) {
+      /* Streams that lack their own locks are written under the kernel lock */
+      if(! fops->own_lock) kernel_lock();
+      retcode = fops->Write(fcb->streamobj, buf, size);
+      if(! fops->own_lock) kernel_unlock();
+    }
 
     /* Need to decrease the reference to FCB */
-    FCB_decref(fcb);
-
+    put_fcb_ref(fcb);
   }
 
-
   return retcode;
 }
 
@@ -200,7 +243,7 @@ int sys_Close(int fd)
   FCB* fcb = get_fcb(fd);
 
   if(fcb) {
-    CURPROC->FIDT[fd] = NULL;
+    __atomic_store_n(&CURPROC->FIDT[fd], NULL, __ATOMIC_RELEASE);
     retcode = FCB_decref(fcb);    
   }
 
@@ -228,10 +271,10 @@ int sys_Dup2(int oldfd, int newfd)
     retcode = -1;
   }
   else if(old!=new) {
+    FCB_incref(old);
+    __atomic_store_n(&CURPROC->FIDT[newfd], old, __ATOMIC_RELEASE);
     if(new)
       FCB_decref(new);
-    FCB_incref(old);
-    CURPROC->FIDT[newfd] = old;
   }
 
   return retcode;
@@ -239,6 +282,7 @@ int sys_Dup2(int oldfd, int newfd)
 
 
 
+/* The device table is fixed at boot, so this takes no lock */
 unsigned int sys_GetTerminalDevices()
 {
   return device_no(DEV_SERIAL);
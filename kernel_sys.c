@@ -32,6 +32,13 @@ RET NAME SIG \
 	return __ret;\
 }\
 
+/* without the kernel lock; the call does its own locking */
+#define SYSCALL_NOLOCK(NAME, RET, SIG, ARGS)\
+RET NAME SIG \
+{\
+	return sys_##NAME ARGS;\
+}\
+
 /* without return */
 #define SYSCALLV(NAME, SIG, ARGS)\
 void NAME SIG \
@@ -41,6 +48,104 @@ void NAME SIG \
 	POST_CALL\
 }\
 
+/* without return, without the kernel lock */
+#define SYSCALLV_NOLOCK(NAME, SIG, ARGS)\
+void NAME SIG \
+{\
+	sys_##NAME ARGS;\
+}\
+
 
 SYSCALLS
 
+
+
+/*
+	Syscall batches
+ */
+
+#undef SYSCALL
+#undef SYSCALL_NOLOCK
+#undef SYSCALLV
+#undef SYSCALLV_NOLOCK
+
+/* 
+	A failed call returns -1, or NOTHREAD for a Tid_t. GetAffinity returns
+	an empty mask; coremask_t is unsigned int, like other results, so it 
+	is told apart by name.
+ */
+#define SYSCALL_FAILED(NAME, RET, r) \
+	((SYS_ ## NAME == SYS_GetAffinity) ? (r) == 0 : \
+	_Generic((RET)0, Tid_t: (r) == NOTHREAD, default: (r) == (RET)-1))
+
+/* The entry constructors */
+#define SYSCALL(NAME, RET, SIG, ARGS)\
+syscall_entry Batch_ ## NAME SIG \
+{\
+	return (syscall_entry){ .no = SYS_ ## NAME, .ret = 0,\
+		.args = { SYSCALL_PACK(ARGS) } };\
+}
+#define SYSCALL_NOLOCK SYSCALL
+#define SYSCALLV(NAME, SIG, ARGS)
+#define SYSCALLV_NOLOCK(NAME, SIG, ARGS)
+SYSCALLS
+#undef SYSCALL
+#undef SYSCALL_NOLOCK
+
+/* Execute an entry; return 1 if it failed */
+#define SYSCALL(NAME, RET, SIG, ARGS)\
+static int batch_ ## NAME(syscall_entry* e) \
+{\
+	SYSCALL_FIELDS(SIG, ARGS)\
+	SYSCALL_UNPACK(e->args, ARGS)\
+	RET __ret = sys_ ## NAME ARGS;\
+	e->ret = (intptr_t) __ret;\
+	return SYSCALL_FAILED(NAME, RET, __ret);\
+}
+#define SYSCALL_NOLOCK SYSCALL
+SYSCALLS
+#undef SYSCALL
+#undef SYSCALL_NOLOCK
+
+/* The dispatch table */
+static const struct {
+	int (*call)(syscall_entry*);
+	int locked;		/* the call needs the kernel lock */
+} batch_table[SYSCALL_BATCHABLE] = {
+#define SYSCALL(NAME, RET, SIG, ARGS) [SYS_ ## NAME] = { batch_ ## NAME, 1 },
+#define SYSCALL_NOLOCK(NAME, RET, SIG, ARGS) [SYS_ ## NAME] = { batch_ ## NAME, 0 },
+	SYSCALLS
+};
+
+int SyscallBatch(syscall_entry* entries, unsigned int n, int flags)
+{
+	if(n > 0 && entries == NULL)
+		return -1;
+	for(unsigned int i = 0; i < n; i++)
+		if(entries[i].no >= SYSCALL_BATCHABLE)
+			return -1;
+
+	/* Hold the kernel lock over runs of calls that need it */
+	int locked = 0;
+	unsigned int i;
+	for(i = 0; i < n; i++) {
+		int need = batch_table[entries[i].no].locked;
+		if(need && !locked) {
+			PRE_CALL
+		}
+		else if(!need && locked) {
+			POST_CALL
+		}
+		locked = need;
+
+		if(batch_table[entries[i].no].call(&entries[i]) && (flags & BATCH_STOP_ON_ERROR)) {
+			i++;
+			break;
+		}
+	}
+	if(locked) {
+		POST_CALL
+	}
+
+	return i;
+}
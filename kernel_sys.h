@@ -4,22 +4,35 @@
 #include "bios.h"
 #include "tinyos.h"
 
+/*
+	The system calls. The wrapper of a SYSCALL takes the kernel lock.
+	A SYSCALL_NOLOCK does its own locking, or only reads data of the
+	current thread and process, or data fixed at boot.
+ */
 #define SYSCALLS \
-SYSCALL(Exec, int, (Task task, int argl, void* args), (task, argl, args))\
-SYSCALLV(Exit, (int exitval), (exitval))\
-SYSCALL(GetPid, int, (void), ())\
-SYSCALL(GetPPid, int, (void), ())\
-SYSCALL(WaitChild, Pid_t, (Pid_t proc, int* exitval), (proc, exitval))\
-SYSCALL(CreateThread, Tid_t, (Task task, int argl, void* args), (task, argl, args))\
-SYSCALL(ThreadSelf, Tid_t, (void), ())\
-SYSCALL(ThreadJoin, int, (Tid_t tid, int* exitval), (tid, exitval))\
-SYSCALL(ThreadDetach, int, (Tid_t tid), (tid))\
-SYSCALLV(ThreadExit, (int exitval), (exitval))\
-SYSCALL(GetTerminalDevices, unsigned int, (), ())\
+SYSCALL_NOLOCK(Exec, int, (Task task, int argl, void* args), (task, argl, args))\
+SYSCALLV_NOLOCK(Exit, (int exitval), (exitval))\
+SYSCALL_NOLOCK(GetPid, int, (void), ())\
+SYSCALL_NOLOCK(GetPPid, int, (void), ())\
+SYSCALL_NOLOCK(WaitChild, Pid_t, (Pid_t proc, int* exitval), (proc, exitval))\
+SYSCALL_NOLOCK(CreateThread, Tid_t, (Task task, int argl, void* args), (task, argl, args))\
+SYSCALL_NOLOCK(CreateThreadEx, Tid_t, (Task task, int argl, void* args, size_t stack_size), (task, argl, args, stack_size))\
+SYSCALL_NOLOCK(ThreadSelf, Tid_t, (void), ())\
+SYSCALL_NOLOCK(ThreadJoin, int, (Tid_t tid, int* exitval), (tid, exitval))\
+SYSCALL_NOLOCK(ThreadDetach, int, (Tid_t tid), (tid))\
+SYSCALLV_NOLOCK(ThreadExit, (int exitval), (exitval))\
+SYSCALL_NOLOCK(SetAffinity, int, (Tid_t tid, coremask_t mask), (tid, mask))\
+SYSCALL_NOLOCK(GetAffinity, coremask_t, (Tid_t tid), (tid))\
+SYSCALL_NOLOCK(GetStackUsage, int, (Tid_t tid, size_t* size, size_t* used), (tid, size, used))\
+SYSCALL(SetDeadline, int, (timeout_t period, timeout_t budget), (period, budget))\
+SYSCALL(SetSchedClass, int, (sched_class cls), (cls))\
+SYSCALL_NOLOCK(FutexWait, int, (int* addr, int expected, timeout_t timeout), (addr, expected, timeout))\
+SYSCALL_NOLOCK(FutexWake, int, (int* addr, int n), (addr, n))\
+SYSCALL_NOLOCK(GetTerminalDevices, unsigned int, (void), ())\
 SYSCALL(OpenTerminal, Fid_t, (unsigned int termno), (termno))\
-SYSCALL(OpenNull, Fid_t, (), ())\
-SYSCALL(Read,int,(Fid_t fd, char *buf, unsigned int size), (fd,buf,size))\
-SYSCALL(Write,int,(Fid_t fd, const char *buf, unsigned int size), (fd,buf,size))\
+SYSCALL(OpenNull, Fid_t, (void), ())\
+SYSCALL_NOLOCK(Read,int,(Fid_t fd, char *buf, unsigned int size), (fd,buf,size))\
+SYSCALL_NOLOCK(Write,int,(Fid_t fd, const char *buf, unsigned int size), (fd,buf,size))\
 SYSCALL(Close,int,(Fid_t fd),(fd))\
 SYSCALL(Dup2,int, (Fid_t oldfd, Fid_t newfd), (oldfd,newfd))\
 SYSCALL(Pipe, int, (pipe_t* pipe), (pipe))\
@@ -28,20 +41,92 @@ SYSCALL(Listen, int, (Fid_t sock), (sock))\
 SYSCALL(Accept, Fid_t, (Fid_t lsock), (lsock))\
 SYSCALL(Connect, int, (Fid_t sock, port_t port, timeout_t timeout), (sock, port, timeout))\
 SYSCALL(ShutDown, int, (Fid_t sock, shutdown_mode how), (sock, how))\
-SYSCALL(OpenInfo, Fid_t, (), ())\
+SYSCALL(OpenInfo, Fid_t, (void), ())\
 
 
 
 #define SYSCALL(NAME, RET, SIG, ARGS)\
 RET sys_ ## NAME SIG;
 
+/* without the kernel lock */
+#define SYSCALL_NOLOCK(NAME, RET, SIG, ARGS)\
+RET sys_ ## NAME SIG;
+
 /* without return */
 #define SYSCALLV(NAME, SIG, ARGS)\
 void sys_ ## NAME SIG;
 
+/* without return, without the kernel lock */
+#define SYSCALLV_NOLOCK(NAME, SIG, ARGS)\
+void sys_ ## NAME SIG;
+
 SYSCALLS
 
 #undef SYSCALL
+#undef SYSCALL_NOLOCK
+#undef SYSCALLV
+#undef SYSCALLV_NOLOCK
+
+
+/*
+	Syscall batching, see SyscallBatch() in tinyos.h.
+	
+	The entries of a batch are marshalled and dispatched by code generated 
+	from SYSCALLS. Calls that do not return (Exit, ThreadExit) cannot be 
+	batched.
+ */
+
+/* Helpers to count the arguments of a call and to expand them */
+#define SYSCALL_UNPAREN(...) __VA_ARGS__
+#define SYSCALL_NARGS(...) SYSCALL_NARGS_(_0 __VA_OPT__(,) __VA_ARGS__, 4, 3, 2, 1, 0)
+#define SYSCALL_NARGS_(_0, _1, _2, _3, _4, N, ...) N
+#define SYSCALL_CAT(A, B) SYSCALL_CAT_(A, B)
+#define SYSCALL_CAT_(A, B) A ## B
+#define SYSCALL_APPLY(M, ...) M(__VA_ARGS__)
+
+/* 
+	The parameters (Fid_t fd, char* buf) as declarations Fid_t fd; char* buf;
+	They are counted by ARGS, so that a (void) SIG declares nothing.
+ */
+#define SYSCALL_FIELDS(SIG, ARGS) \
+	SYSCALL_CAT(SYSCALL_FIELDS_, SYSCALL_NARGS ARGS) SIG
+#define SYSCALL_FIELDS_0(...)
+#define SYSCALL_FIELDS_1(a) a;
+#define SYSCALL_FIELDS_2(a, b) a; b;
+#define SYSCALL_FIELDS_3(a, b, c) a; b; c;
+#define SYSCALL_FIELDS_4(a, b, c, d) a; b; c; d;
+
+/* The arguments (fd, buf) stored as (uintptr_t) fd, (uintptr_t) buf */
+#define SYSCALL_PACK(ARGS) \
+	SYSCALL_APPLY(SYSCALL_CAT(SYSCALL_PACK_, SYSCALL_NARGS ARGS), SYSCALL_UNPAREN ARGS)
+#define SYSCALL_PACK_0(...) 0
+#define SYSCALL_PACK_1(a) (uintptr_t) a
+#define SYSCALL_PACK_2(a, b) SYSCALL_PACK_1(a), (uintptr_t) b
+#define SYSCALL_PACK_3(a, b, c) SYSCALL_PACK_2(a, b), (uintptr_t) c
+#define SYSCALL_PACK_4(a, b, c, d) SYSCALL_PACK_3(a, b, c), (uintptr_t) d
+
+/* The arguments (fd, buf) loaded from W as fd = W[0]; buf = W[1]; */
+#define SYSCALL_UNPACK(W, ARGS) \
+	SYSCALL_APPLY(SYSCALL_CAT(SYSCALL_UNPACK_, SYSCALL_NARGS ARGS), W, SYSCALL_UNPAREN ARGS)
+#define SYSCALL_LOAD(W, i, a) a = (__typeof__(a)) W[i];
+#define SYSCALL_UNPACK_0(W, ...)
+#define SYSCALL_UNPACK_1(W, a) SYSCALL_LOAD(W, 0, a)
+#define SYSCALL_UNPACK_2(W, a, b) SYSCALL_UNPACK_1(W, a) SYSCALL_LOAD(W, 1, b)
+#define SYSCALL_UNPACK_3(W, a, b, c) SYSCALL_UNPACK_2(W, a, b) SYSCALL_LOAD(W, 2, c)
+#define SYSCALL_UNPACK_4(W, a, b, c, d) SYSCALL_UNPACK_3(W, a, b, c) SYSCALL_LOAD(W, 3, d)
+
+/* The number of a system call in a batch */
+#define SYSCALL(NAME, RET, SIG, ARGS) SYS_ ## NAME,
+#define SYSCALL_NOLOCK SYSCALL
+#define SYSCALLV(NAME, SIG, ARGS)
+#define SYSCALLV_NOLOCK(NAME, SIG, ARGS)
+enum syscall_no {
+	SYSCALLS
+	SYSCALL_BATCHABLE	/* The number of calls that can be batched */
+};
+#undef SYSCALL
+#undef SYSCALL_NOLOCK
 #undef SYSCALLV
+#undef SYSCALLV_NOLOCK
 
-#endif
\ No newline at end of file
+#endif
@@ -24,6 +24,21 @@ void creating_process_thread()
   */
 Tid_t sys_CreateThread(Task task, int argl, void* args)
 {
+  return sys_CreateThreadEx(task, argl, args, 0);
+}
+
+/** 
+  @brief Create a new thread with the given stack size in the current process.
+  */
+Tid_t sys_CreateThreadEx(Task task, int argl, void* args, size_t stack_size)
+{
+  if(stack_size == 0)
+    stack_size = THREAD_STACK_SIZE;
+  else if(stack_size > THREAD_STACK_MAX)
+    return NOTHREAD;
+  else if(stack_size < THREAD_STACK_MIN)
+    stack_size = THREAD_STACK_MIN;
+
   if(task != NULL){
     PTCB *ptcb;
 
@@ -38,13 +53,21 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
     ptcb->refcount=0;
 
     rlnode_init(& ptcb->ptcb_list_node, ptcb);
-    CURPROC->thread_count++;
+
+    PCB* curproc = CURPROC;
+    Mutex_Lock(&curproc->lock);
+    curproc->thread_count++;
     
     
-    rlist_push_back(&CURPROC->ptcb_list, &ptcb->ptcb_list_node);
-    ptcb->tcb = spawn_thread(CURPROC, creating_process_thread);
-    ptcb->tcb->ptcb=ptcb;
-    wakeup(ptcb->tcb);                                           
+    rlist_push_back(&curproc->ptcb_list, &ptcb->ptcb_list_node);
+    TCB* tcb = spawn_thread(curproc, creating_process_thread, stack_size);
+    ptcb->tcb = tcb;
+    ptcb->stack_size = tcb->stack_size;
+    tcb->ptcb=ptcb;
+    Mutex_Unlock(&curproc->lock);
+
+    /* The thread may exit and be joined as soon as it is awake */
+    wakeup(tcb);                                           
     return (Tid_t)ptcb;
     
   } else{
@@ -65,26 +88,30 @@ Tid_t sys_ThreadSelf()
   */
 int sys_ThreadJoin(Tid_t tid, int* exitval)
 {
-  rlnode* ptcb_node = rlist_find(&CURPROC->ptcb_list, (PTCB*)tid, NULL);  //find the running thrread
+  PCB* curproc = CURPROC;
+  int ret = -1;
+
+  Mutex_Lock(&curproc->lock);
+  rlnode* ptcb_node = rlist_find(&curproc->ptcb_list, (PTCB*)tid, NULL);  //find the running thrread
 
   if(ptcb_node == NULL)
-   return -1;
+   goto finish;
 
   PTCB* ptcb = ptcb_node->ptcb;
 
   if(ptcb == NULL || ptcb->detached == 1 || tid == sys_ThreadSelf()) //ptcb does not exist or ptcb is not jooinable
-    return -1;
+    goto finish;
 
   ptcb->refcount++; // increase joints PTCB_list
 
   while(ptcb->exited != 1 && ptcb->detached != 1){
-    kernel_wait(&ptcb->exit_cv, SCHED_USER);        //thread ready to join, waits until (PTCB*)tid exits
+    kernel_wait_on(&curproc->lock, &ptcb->exit_cv, SCHED_USER);        //thread ready to join, waits until (PTCB*)tid exits
   }
 
   ptcb->refcount--; // decrease reference counts
 
   if (ptcb->detached==1){   //ptcb is detached not joinable
-    return -1;
+    goto finish;
   }
 
   if(exitval != NULL)
@@ -94,7 +121,11 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
     rlist_remove(&ptcb->ptcb_list_node);
     free(ptcb);
   }
-  return 0;
+  ret = 0;
+
+finish:
+  Mutex_Unlock(&curproc->lock);
+  return ret;
 }
 
 /**
@@ -102,92 +133,198 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
   */
 int sys_ThreadDetach(Tid_t tid)
 {
-  rlnode* ptcb_node = rlist_find(&CURPROC->ptcb_list, (PTCB*)tid, NULL);
+  PCB* curproc = CURPROC;
+  Mutex_Lock(&curproc->lock);
+  rlnode* ptcb_node = rlist_find(&curproc->ptcb_list, (PTCB*)tid, NULL);
 
-  if(ptcb_node==NULL || ptcb_node->ptcb->exited == 1)
+  if(ptcb_node==NULL || ptcb_node->ptcb->exited == 1) {
+    Mutex_Unlock(&curproc->lock);
     return -1;
+  }
 
   ptcb_node->ptcb->detached = 1;
   kernel_broadcast(&ptcb_node->ptcb->exit_cv);
 
+  Mutex_Unlock(&curproc->lock);
   return 0;
 }
 
+/* The mask of the cores of the VM */
+static coremask_t existing_cores()
+{
+  return (cpu_cores() < 32) ? (1u << cpu_cores()) - 1 : ALL_CORES;
+}
+
 /**
-  @brief Terminate the current thread.
+  @brief Set the cores a thread may run on.
   */
-void sys_ThreadExit(int exitval)
+int sys_SetAffinity(Tid_t tid, coremask_t mask)
 {
-  PTCB* ptcb = (PTCB*) sys_ThreadSelf();
-  ptcb->exitval = exitval;   
-  ptcb->exited = 1;         // initialize 
-  CURPROC->thread_count--; // make thread counter ready to use it (make it 1)
-  kernel_broadcast(&ptcb->exit_cv);
+  /* Ignore the cores that do not exist */
+  mask &= existing_cores();
+  if(mask == 0)
+    return -1;
 
+  PCB* curproc = CURPROC;
+  Mutex_Lock(&curproc->lock);
+  rlnode* ptcb_node = rlist_find(&curproc->ptcb_list, (PTCB*)tid, NULL);
 
+  if(ptcb_node==NULL || ptcb_node->ptcb->exited == 1) {
+    Mutex_Unlock(&curproc->lock);
+    return -1;
+  }
 
-  if(CURPROC->thread_count == 0){
-    if (get_pid(CURPROC) != 1){            // sys_exit code here 
+  set_affinity(ptcb_node->ptcb->tcb, mask);
+  Mutex_Unlock(&curproc->lock);
+  return 0;
+}
 
-      /* Reparent any children of the exiting process to the 
-       initial task */
-    PCB* initpcb = get_pcb(1);
-    while(!is_rlist_empty(&CURPROC->children_list)) {
-      rlnode* child = rlist_pop_front(&CURPROC->children_list);
-      child->pcb->parent = initpcb;
-      rlist_push_front(& initpcb->children_list, child);
-    }
+/**
+  @brief Return the cores a thread may run on.
+  */
+coremask_t sys_GetAffinity(Tid_t tid)
+{
+  coremask_t mask = 0;
 
-    /* Add exited children to the initial task's exited list 
-       and signal the initial task */
-    if(!is_rlist_empty(&CURPROC->exited_list)) {
-      rlist_append(& initpcb->exited_list, &CURPROC->exited_list);
-      kernel_broadcast(& initpcb->child_exit);
-    }
+  PCB* curproc = CURPROC;
+  Mutex_Lock(&curproc->lock);
+  rlnode* ptcb_node = rlist_find(&curproc->ptcb_list, (PTCB*)tid, NULL);
+
+  if(ptcb_node!=NULL && ptcb_node->ptcb->exited != 1)
+    mask = ptcb_node->ptcb->tcb->affinity & existing_cores();
+
+  Mutex_Unlock(&curproc->lock);
+  return mask;
+}
 
-    /* Put me into my parent's exited list */
-    rlist_push_front(&CURPROC->parent->exited_list, &CURPROC->exited_node);
-    kernel_broadcast(&CURPROC->parent->child_exit);
+/**
+  @brief Return the stack size and high-water mark of a thread.
+  */
+int sys_GetStackUsage(Tid_t tid, size_t* size, size_t* used)
+{
+  PCB* curproc = CURPROC;
+  Mutex_Lock(&curproc->lock);
+  rlnode* ptcb_node = rlist_find(&curproc->ptcb_list, (PTCB*)tid, NULL);
 
+  if(ptcb_node==NULL) {
+    Mutex_Unlock(&curproc->lock);
+    return -1;
   }
 
-  assert(is_rlist_empty(&CURPROC->children_list));
-  assert(is_rlist_empty(&CURPROC->exited_list));
+  PTCB* ptcb = ptcb_node->ptcb;
+  if(size != NULL)
+    *size = ptcb->stack_size;
+  if(used != NULL)
+    *used = ptcb->exited ? ptcb->stack_used : thread_stack_usage(ptcb->tcb);
+  Mutex_Unlock(&curproc->lock);
+  return 0;
+}
 
+/**
+  @brief Make the current thread a real-time thread.
+  */
+int sys_SetDeadline(timeout_t period, timeout_t budget)
+{
+  /* We have to translate from msec to usec */
+  return set_deadline(cur_thread(), period*1000ul, budget*1000ul);
+}
 
-  /* 
-    Do all the other cleanup we want here, close files etc. 
-   */
+/**
+  @brief Set the scheduling class of the current thread.
+  */
+int sys_SetSchedClass(sched_class cls)
+{
+  return set_sched_class(cur_thread(), cls);
+}
 
-  /* Release the args data */
-  if(CURPROC->args) {
-    free(CURPROC->args);
-    CURPROC->args = NULL;
-  }
+/**
+  @brief Terminate the current thread.
+  */
+void sys_ThreadExit(int exitval)
+{
+  PCB* curproc = CURPROC;
+  PTCB* ptcb = (PTCB*) sys_ThreadSelf();
 
-  /* Clean up FIDT */
-  for(int i=0;i<MAX_FILEID;i++) {
-    if(CURPROC->FIDT[i] != NULL) {
-      FCB_decref(CURPROC->FIDT[i]);
-      CURPROC->FIDT[i] = NULL;
-    }
+  Mutex_Lock(&curproc->lock);
+  ptcb->exitval = exitval;   
+  ptcb->stack_used = thread_stack_usage(cur_thread());
+  ptcb->exited = 1;         // initialize 
+  curproc->thread_count--; // make thread counter ready to use it (make it 1)
+  kernel_broadcast(&ptcb->exit_cv);
+
+  if(curproc->thread_count > 0) {
+    /* Bye-bye cruel world */
+    sleep_releasing(EXITED, &curproc->lock, SCHED_USER, NO_TIMEOUT);
+    return;
   }
 
-  while(rlist_find(&CURPROC->ptcb_list, ptcb, NULL) != NULL){
-      if (ptcb->refcount < 1){
-        rlist_remove(&ptcb->ptcb_list_node);
-        free(ptcb);
+  /* We are the last thread; nobody can join the others any more */
+  while(! is_rlist_empty(&curproc->ptcb_list))
+    free(rlist_pop_front(&curproc->ptcb_list)->ptcb);
+
+  /* Release the args data */
+  if(curproc->args) {
+    free(curproc->args);
+    curproc->args = NULL;
+  }
+  Mutex_Unlock(&curproc->lock);
+
+  /* Clean up FIDT; closing a stream needs the kernel lock */
+  if(has_open_files(curproc)) {
+    kernel_lock();
+    for(int i=0;i<MAX_FILEID;i++) {
+      if(curproc->FIDT[i] != NULL) {
+        FCB_decref(curproc->FIDT[i]);
+        curproc->FIDT[i] = NULL;
       }
     }
+    kernel_unlock();
+  }
 
-   /* Disconnect my main_thread */
-  CURPROC->main_thread = NULL;
+  /* Disconnect my main_thread */
+  curproc->main_thread = NULL;
 
-  /* Now, mark the process as exited. */
-  CURPROC->pstate = ZOMBIE;
+  if (get_pid(curproc) == 1) {
+    Mutex_Lock(&curproc->lock);
+    curproc->pstate = ZOMBIE;
+    sleep_releasing(EXITED, &curproc->lock, SCHED_USER, NO_TIMEOUT);
+    return;
   }
-  
+
+  /* Reparent any children of the exiting process to the 
+     initial task */
+  PCB* initpcb = get_pcb(1);
+  Mutex_Lock(&curproc->lock);
+  Mutex_Lock(&initpcb->lock);
+  while(!is_rlist_empty(&curproc->children_list)) {
+    rlnode* child = rlist_pop_front(&curproc->children_list);
+    __atomic_store_n(&child->pcb->parent, initpcb, __ATOMIC_RELEASE);
+    rlist_push_front(& initpcb->children_list, child);
+  }
+
+  /* Add exited children to the initial task's exited list 
+     and signal the initial task */
+  if(!is_rlist_empty(&curproc->exited_list)) {
+    rlist_append(& initpcb->exited_list, &curproc->exited_list);
+    kernel_broadcast(& initpcb->child_exit);
+  }
+  Mutex_Unlock(&initpcb->lock);
+  Mutex_Unlock(&curproc->lock);
+
+  assert(is_rlist_empty(&curproc->children_list));
+  assert(is_rlist_empty(&curproc->exited_list));
+
+  /* 
+    Put me into my parent's exited list, and mark the process as
+    exited. The parent may release the PCB as soon as we let go of
+    its lock, so this is the last thing we do.
+   */
+  PCB* parent = lock_parent(curproc);
+  rlist_push_front(&parent->exited_list, &curproc->exited_node);
+  curproc->pstate = ZOMBIE;
+  kernel_broadcast(&parent->child_exit);
+
   /* Bye-bye cruel world */
-  kernel_sleep(EXITED, SCHED_USER);
+  sleep_releasing(EXITED, &parent->lock, SCHED_USER, NO_TIMEOUT);
 }
 
@@ -64,7 +64,8 @@ void usage(const char* pname)
     <philosiphers> is from 1 to %d\n\
     <bites> is the number of times each philisopher eats.\n\n\
     <Dbase> integers (maybe negative) control \n\
-    <Dgap>  the hardness of the computation (0 if omitted)\n",
+    <Dgap>  the hardness of the computation (0 if omitted)\n\n\
+    The scheduling policy is set by TINYOS_POLICY=mlfq|fair|rr.\n",
 	 pname, MAX_PROC);
   exit(1);
 }
@@ -0,0 +1,504 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "util.h"
+#include "unit_testing.h"
+#include "kernel_sched.h"
+#include "kernel_cc.h"
+
+
+/*
+	Tests of kernel internals, which the public API of tinyos.h cannot
+	observe. The tests of the system calls are in validate_api.c.
+ */
+
+
+static int affinity_thread(int argl, void* args)
+{
+	coremask_t mask = argl;
+	ASSERT(SetAffinity(ThreadSelf(), mask)==0);
+
+	/* We move at the end of the time-slice */
+	yield(SCHED_USER);
+
+	for(int i=0; i<1000; i++) {
+		ASSERT(CORE_IN_MASK(cpu_core_id, mask));
+		yield(SCHED_USER);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_affinity_cores,
+	"Test that threads run only on the cores in their affinity mask.",
+	.minimum_cores = 2
+	)
+{
+	uint ncores = cpu_cores();
+
+	/* Pin each thread to one core, or to a pair of cores */
+	Tid_t tids[2*ncores];
+	for(uint c=0; c<ncores; c++) {
+		tids[2*c] = CreateThread(affinity_thread, 1u << c, NULL);
+		tids[2*c+1] = CreateThread(affinity_thread, (1u << c) | (1u << ((c+1)%ncores)), NULL);
+	}
+	for(uint i=0; i<2*ncores; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+
+	return 0;
+}
+
+
+/* State of the kernel lock test */
+#define KLM_THREADS 8
+#define KLM_CALLS 2000
+static int klm_done[KLM_THREADS];
+
+static int kernel_lock_mode_caller(int argl, void* args)
+{
+	for(int i=0; i<KLM_CALLS; i++) {
+		Fid_t fid = OpenNull();
+		if(fid == NOFILE || Close(fid) != 0)
+			break;
+		klm_done[argl]++;
+	}
+	return 0;
+}
+
+static int kernel_lock_mode_boot(int argl, void* args)
+{
+	Tid_t tid[KLM_THREADS];
+	for(int i=0; i<KLM_THREADS; i++)
+		tid[i] = CreateThread(kernel_lock_mode_caller, i, NULL);
+	for(int i=0; i<KLM_THREADS; i++)
+		ThreadJoin(tid[i], NULL);
+	return 0;
+}
+
+BARE_TEST(test_kernel_lock_modes,
+	"Test system calls that take the kernel lock from 8 threads on 4 cores,\n"
+	"with the lock handed to the oldest waiter and with bounded barging."
+	)
+{
+	for(int barging=0; barging<=2; barging+=2) {
+		memset(klm_done, 0, sizeof(klm_done));
+		kernel_lock_barging(barging);
+		boot(4, 0, kernel_lock_mode_boot, 0, NULL);
+		for(int i=0; i<KLM_THREADS; i++)
+			ASSERT_MSG(klm_done[i] == KLM_CALLS, "barging=%d thread %d made %d calls\n",
+				barging, i, klm_done[i]);
+	}
+	kernel_lock_barging(0);
+}
+
+
+/* State of the spinlock test */
+static struct {
+	Spinlock lock;
+	int ready;			/* waiters running on their cores */
+	int turn;			/* the last waiter that may queue up */
+	int inside;			/* a thread holds the lock */
+	int overlaps;		/* times a thread found the lock held by another */
+	long counter;
+	int order[MAX_CORES], served;
+} sl;
+
+/* Pin the current thread to a core, and wait until it runs there */
+static void pin_to_core(uint core)
+{
+	ASSERT(SetAffinity(ThreadSelf(), 1u << core)==0);
+	while(cpu_core_id != core)
+		yield(SCHED_USER);
+}
+
+static int spinlock_counter(int argl, void* args)
+{
+	pin_to_core(argl);
+	for(int i=0; i<200; i++) {
+		int preempt = preempt_off;
+		Spinlock_Lock(&sl.lock);
+		if(__atomic_exchange_n(&sl.inside, 1, __ATOMIC_RELAXED))
+			sl.overlaps++;
+		sl.counter++;
+		__atomic_store_n(&sl.inside, 0, __ATOMIC_RELAXED);
+		Spinlock_Unlock(&sl.lock);
+		if(preempt) preempt_on;
+	}
+	return 0;
+}
+
+static int spinlock_waiter(int argl, void* args)
+{
+	pin_to_core(argl);
+	__atomic_add_fetch(&sl.ready, 1, __ATOMIC_RELEASE);
+	while(__atomic_load_n(&sl.turn, __ATOMIC_ACQUIRE) < argl)
+		yield(SCHED_USER);
+
+	int preempt = preempt_off;
+	Spinlock_Lock(&sl.lock);
+	sl.order[sl.served++] = argl;
+	Spinlock_Unlock(&sl.lock);
+	if(preempt) preempt_on;
+	return 0;
+}
+
+static int spinlock_boot(int argl, void* args)
+{
+	uint ncores = cpu_cores();
+	Tid_t tids[ncores];
+
+	/* Mutual exclusion, with a thread on every core */
+	for(uint c=0; c<ncores; c++)
+		tids[c] = CreateThread(spinlock_counter, c, NULL);
+	for(uint c=0; c<ncores; c++)
+		ASSERT(ThreadJoin(tids[c], NULL)==0);
+	ASSERT_MSG(sl.overlaps == 0, "%d overlaps\n", sl.overlaps);
+	ASSERT(sl.counter == 200*ncores);
+
+	/* 
+		FIFO order: core 0 holds the lock, while the waiters on the other 
+		cores queue up in a known order, each after the previous one has 
+		changed the tail of the queue.
+	 */
+	for(uint c=1; c<ncores; c++)
+		tids[c] = CreateThread(spinlock_waiter, c, NULL);
+	pin_to_core(0);
+	while(__atomic_load_n(&sl.ready, __ATOMIC_ACQUIRE) < ncores-1)
+		yield(SCHED_USER);
+
+	int preempt = preempt_off;
+	Spinlock_Lock(&sl.lock);
+	for(uint c=1; c<ncores; c++) {
+		struct spinlock_node* tail = __atomic_load_n(&sl.lock.tail, __ATOMIC_ACQUIRE);
+		__atomic_store_n(&sl.turn, c, __ATOMIC_RELEASE);
+		TimerDuration t0 = bios_clock();
+		while(__atomic_load_n(&sl.lock.tail, __ATOMIC_ACQUIRE) == tail 
+				&& bios_clock() - t0 < 1000000)
+			cpu_spin_yield();
+		ASSERT_MSG(sl.lock.tail != tail, "waiter %u did not queue up\n", c);
+	}
+	Spinlock_Unlock(&sl.lock);
+	if(preempt) preempt_on;
+
+	for(uint c=1; c<ncores; c++)
+		ASSERT(ThreadJoin(tids[c], NULL)==0);
+	ASSERT(sl.served == ncores-1);
+	for(uint c=1; c<ncores; c++)
+		ASSERT_MSG(sl.order[c-1] == c, "waiter %d served in place %u\n", sl.order[c-1], c);
+	return 0;
+}
+
+BARE_TEST(test_spinlock_mcs,
+	"Test mutual exclusion and FIFO order of the queued Spinlock, on 4 cores,\n"
+	"even when the host has fewer processors."
+	)
+{
+	memset(&sl, 0, sizeof(sl));
+	sl.lock = SPINLOCK_INIT;
+	spinlock_force_mcs(1);
+	boot(4, 0, spinlock_boot, 0, NULL);
+	spinlock_force_mcs(0);
+}
+
+
+
+/*
+	Benchmarks of the kernel's internal modes. Like the benchmarks in 
+	validate_api.c, they do not check correctness and are not part of
+	all_tests; run them with
+	  ./test_kernel benchmarks
+ */
+
+static const uint bench_cores[] = { 1, 2, 4, 8, 16, 32 };
+#define BENCH_CONFIGS (sizeof(bench_cores)/sizeof(uint))
+
+static void mark_time(struct timeval* t)
+{
+	CHECK(gettimeofday(t, NULL));
+}
+
+static double time_since(struct timeval* t0)
+{
+	struct timeval t1;
+	mark_time(&t1);
+	return ((double)(t1.tv_sec-t0->tv_sec)) + 1E-6* (t1.tv_usec - t0->tv_usec);
+}
+
+
+/* State of bench_yield_wakeup and bench_context_switch */
+static struct {
+	int rounds;
+	double yield_rate, wakeup_rate;
+} yb;
+
+struct pingpong {
+	Mutex mx;
+	CondVar cv[2];
+	int turn;
+};
+
+static int bench_yielder(int argl, void* args)
+{
+	for(int i=0; i<yb.rounds; i++)
+		yield(SCHED_USER);
+	return 0;
+}
+
+static int bench_pinger(int me, void* args)
+{
+	struct pingpong* pp = args;
+	Mutex_Lock(&pp->mx);
+	for(int i=0; i<yb.rounds; i++) {
+		while(pp->turn != me)
+			Cond_Wait(&pp->mx, &pp->cv[me]);
+		pp->turn = 1-me;
+		Cond_Signal(&pp->cv[1-me]);
+	}
+	Mutex_Unlock(&pp->mx);
+	return 0;
+}
+
+static int yield_wakeup_boot(int argl, void* args)
+{
+	uint n = cpu_cores();
+	Tid_t tid[2*MAX_CORES];
+	struct pingpong pp[MAX_CORES];
+	struct timeval t0;
+
+	mark_time(&t0);
+	for(uint i=0; i<2*n; i++)
+		tid[i] = CreateThread(bench_yielder, 0, NULL);
+	for(uint i=0; i<2*n; i++)
+		ThreadJoin(tid[i], NULL);
+	yb.yield_rate = 2.0*n*yb.rounds / time_since(&t0);
+
+	mark_time(&t0);
+	for(uint i=0; i<n; i++) {
+		pp[i].mx = MUTEX_INIT;
+		pp[i].cv[0] = pp[i].cv[1] = COND_INIT;
+		pp[i].turn = 0;
+		tid[2*i] = CreateThread(bench_pinger, 0, &pp[i]);
+		tid[2*i+1] = CreateThread(bench_pinger, 1, &pp[i]);
+	}
+	for(uint i=0; i<2*n; i++)
+		ThreadJoin(tid[i], NULL);
+	yb.wakeup_rate = 2.0*n*yb.rounds / time_since(&t0);
+
+	return 0;
+}
+
+BARE_TEST(bench_yield_wakeup,
+	"Measure the throughput of yield() and of Cond_Signal wakeups, as\n"
+	"the number of cores increases. Each core gets two yielding threads\n"
+	"and then a pair of threads ping-ponging over a condition variable.",
+	.timeout = 600
+	)
+{
+	yb.rounds = 20000;
+	for(uint c=0; c<BENCH_CONFIGS; c++) {
+		boot(bench_cores[c], 0, yield_wakeup_boot, 0, NULL);
+		MSG("cores=%2u   yield/sec=%10.0f   wakeup/sec=%10.0f\n", 
+			bench_cores[c], yb.yield_rate, yb.wakeup_rate);
+	}
+}
+
+
+static int context_switch_boot(int argl, void* args)
+{
+	struct timeval t0;
+	mark_time(&t0);
+	Tid_t t1 = CreateThread(bench_yielder, 0, NULL);
+	Tid_t t2 = CreateThread(bench_yielder, 0, NULL);
+	ThreadJoin(t1, NULL);
+	ThreadJoin(t2, NULL);
+	yb.yield_rate = 2.0*yb.rounds / time_since(&t0);
+	return 0;
+}
+
+BARE_TEST(bench_context_switch,
+	"Measure the rate of context switches, with two threads on one core\n"
+	"yielding to each other.",
+	.timeout = 300
+	)
+{
+	yb.rounds = 200000;
+	boot(1, 0, context_switch_boot, 0, NULL);
+	MSG("switches/sec=%10.0f   switch time=%6.3f usec\n", yb.yield_rate, 1E6/yb.yield_rate);
+}
+
+
+/* State of bench_kernel_lock_latency */
+#define KL_THREADS 32
+#define KL_CALLS 20000
+static struct {
+	double* lat;
+	double rate;
+} kl;
+
+static int kernel_lock_caller(int argl, void* args)
+{
+	struct timeval t;
+	double* mylat = kl.lat + argl*KL_CALLS;
+	for(int i=0; i<KL_CALLS; i++) {
+		mark_time(&t);
+		GetPid();
+		mylat[i] = time_since(&t);
+	}
+	return 0;
+}
+
+static int kernel_lock_boot(int argl, void* args)
+{
+	Tid_t tid[KL_THREADS];
+	struct timeval t0;
+	mark_time(&t0);
+	for(int i=0; i<KL_THREADS; i++)
+		tid[i] = CreateThread(kernel_lock_caller, i, NULL);
+	for(int i=0; i<KL_THREADS; i++)
+		ThreadJoin(tid[i], NULL);
+	kl.rate = KL_THREADS*KL_CALLS / time_since(&t0);
+	return 0;
+}
+
+static int by_value(const void* a, const void* b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+BARE_TEST(bench_kernel_lock_latency,
+	"Measure the latency of a system call that takes the kernel lock, called\n"
+	"by 32 threads at once, when the lock is handed to the oldest waiter\n"
+	"and when up to 4 threads may barge ahead of it.",
+	.timeout = 600
+	)
+{
+	const int N = KL_THREADS*KL_CALLS;
+	const int barging[] = { 0, 4 };
+	kl.lat = xmalloc(N*sizeof(double));
+
+	for(uint b=0; b<2; b++)
+	for(uint c=0; c<3; c++) {
+		kernel_lock_barging(barging[b]);
+		boot(bench_cores[c], 0, kernel_lock_boot, 0, NULL);
+		qsort(kl.lat, N, sizeof(double), by_value);
+		MSG("barging=%d  cores=%2u   calls/sec=%9.0f   p50=%7.1f  p99=%8.1f  max=%8.1f usec\n",
+			barging[b], bench_cores[c], kl.rate, 1E6*kl.lat[N/2],
+			1E6*kl.lat[N*99/100], 1E6*kl.lat[N-1]);
+	}
+	kernel_lock_barging(0);
+	free(kl.lat);
+}
+
+
+/* State of bench_spinlock_contention */
+static struct {
+	Mutex mx;
+	Spinlock sl;
+	volatile long shared;
+	volatile int go, stop;
+	int kind;			/* 0 for the Mutex, 1 for the Spinlock */
+	long count[MAX_CORES];
+	double rate[2], fairness[2];
+} sc;
+
+static int spinlock_hammer(int argl, void* args)
+{
+	SetAffinity(ThreadSelf(), 1u << argl);
+	while(! sc.go) yield(SCHED_USER);
+	long n = 0;
+	while(! sc.stop) {
+		int pre = cpu_disable_interrupts();
+		for(int k=0; k<100; k++) {
+			if(sc.kind) Spinlock_Lock(&sc.sl); else Mutex_Lock(&sc.mx);
+			sc.shared++;
+			if(sc.kind) Spinlock_Unlock(&sc.sl); else Mutex_Unlock(&sc.mx);
+		}
+		if(pre) cpu_enable_interrupts();
+		n += 100;
+	}
+	sc.count[argl] = n;
+	return 0;
+}
+
+static int spinlock_contention_boot(int argl, void* args)
+{
+	const double DURATION = 0.3;
+	uint ncores = cpu_cores();
+	Tid_t tid[MAX_CORES];
+
+	sc.mx = MUTEX_INIT;
+	sc.sl = SPINLOCK_INIT;
+	for(sc.kind=0; sc.kind<2; sc.kind++) {
+		sc.go = sc.stop = 0;
+		for(uint c=0; c<ncores; c++)
+			tid[c] = CreateThread(spinlock_hammer, c, NULL);
+
+		/* Sleep while they run */
+		Mutex sm = MUTEX_INIT;
+		CondVar cv = COND_INIT;
+		sc.go = 1;
+		Mutex_Lock(&sm);
+		Cond_TimedWait(&sm, &cv, (timeout_t)(DURATION*1000));
+		Mutex_Unlock(&sm);
+		sc.stop = 1;
+
+		long total = 0, lo = -1, hi = 0;
+		for(uint c=0; c<ncores; c++) {
+			ThreadJoin(tid[c], NULL);
+			total += sc.count[c];
+			if(lo < 0 || sc.count[c] < lo) lo = sc.count[c];
+			if(sc.count[c] > hi) hi = sc.count[c];
+		}
+		sc.rate[sc.kind] = total / DURATION;
+		sc.fairness[sc.kind] = (hi > 0) ? (double)lo / hi : 1.0;
+	}
+	return 0;
+}
+
+BARE_TEST(bench_spinlock_contention,
+	"Measure the throughput and fairness of a kernel spinlock hammered by\n"
+	"one thread per core, with preemption off, for the test-and-set Mutex\n"
+	"and the queued Spinlock. Fairness is the fewest acquisitions of a core\n"
+	"over the most.",
+	.timeout = 600
+	)
+{
+	for(uint c=0; c<BENCH_CONFIGS; c++) {
+		boot(bench_cores[c], 0, spinlock_contention_boot, 0, NULL);
+		MSG("cores=%2u   Mutex: locks/sec=%10.0f fairness=%4.2f   Spinlock: locks/sec=%10.0f fairness=%4.2f\n",
+			bench_cores[c], sc.rate[0], sc.fairness[0], sc.rate[1], sc.fairness[1]);
+	}
+}
+
+
+
+TEST_SUITE(all_tests,
+	"All tests")
+{
+	&test_affinity_cores,
+	&test_kernel_lock_modes,
+	&test_spinlock_mcs,
+	NULL
+};
+
+
+TEST_SUITE(benchmarks,
+	"A suite of benchmarks of kernel internals. These always succeed."
+	)
+{
+	&bench_yield_wakeup,
+	&bench_context_switch,
+	&bench_spinlock_contention,
+	&bench_kernel_lock_latency,
+	NULL
+};
+
+
+int main(int argc, char** argv)
+{
+	return register_test(&all_tests) ||
+		register_test(&benchmarks) ||
+		run_program(argc, argv, &all_tests);
+}
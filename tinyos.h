@@ -3,6 +3,7 @@
 #define __TINYOS_H__
 
 #include <stdint.h>
+#include <stddef.h>
 
 #define PIPE_BUFFER_SIZE 8192
 
@@ -37,6 +38,9 @@ typedef int Pid_t;		/* The PID type  */
 */
 typedef unsigned long timeout_t;
 
+/** @brief A @c timeout_t that never expires, for @c FutexWait */
+#define INFINITE_TIMEOUT ((timeout_t)-1)
+
 
 /** @brief The invalid PID */
 #define NOPROC (-1)
@@ -74,11 +78,14 @@ typedef uintptr_t Tid_t;
     mutexes are suitable for use in user-space, as well as in the implementation 
     of the kernel.
 
+    A locked mutex records its owner thread, so that threads waiting for
+    it can lend their scheduling priority to the owner.
+
     @see Mutex_Lock
     @see Mutex_Unlock
     @see MUTEX_INIT
 */
-typedef char Mutex;
+typedef uintptr_t Mutex;
 
 /**
   @brief This macro is used to initialize mutexes. 
@@ -204,6 +211,43 @@ void Cond_Signal(CondVar*);
 void Cond_Broadcast(CondVar*); 
 
 
+/** @brief Wait while an int has a given value.
+
+  This is the slow path of user-level synchronization: the fast path 
+  changes an int with atomic operations, and only a thread that has to
+  wait calls @c FutexWait. The call checks that `*addr == expected` and
+  puts the calling thread to sleep, atomically with respect to 
+  @c FutexWake on the same address. It does not take the kernel lock.
+
+  A thread may wake up if,
+  - another thread called @c FutexWake on @c addr
+  - the timeout expired
+  - other reasons, not specified
+  Therefore, the caller should check the value again.
+
+  @param addr the address of the int to wait on.
+  @param expected the value that @c *addr must have for the thread to sleep.
+  @param timeout the time in milliseconds to wait, or @c INFINITE_TIMEOUT
+    to wait for ever. A timeout of 0 does not block.
+  @returns 0 if the thread was woken by @c FutexWake, -1 if @c *addr was 
+    not @c expected, or on timeout.
+  @see FutexWake
+  */
+int FutexWait(int* addr, int expected, timeout_t timeout);
+
+/** @brief Wake threads waiting on an int.
+
+  Wake up to @c n threads sleeping in @c FutexWait on @c addr, in the
+  order in which they went to sleep. Call this after changing @c *addr.
+
+  @param addr the address that threads wait on.
+  @param n the most threads to wake.
+  @returns the number of threads woken, or -1 on error.
+  @see FutexWait
+  */
+int FutexWake(int* addr, int n);
+
+
 /*******************************************
  *
  * Process creation
@@ -321,10 +365,30 @@ Pid_t GetPPid(void);
   */
 Tid_t CreateThread(Task task, int argl, void* args);
 
+/** 
+  @brief Create a new thread with the given stack size.
+
+  This is like `CreateThread`, except for the stack size of the
+  new thread. The stack is rounded up to whole pages, and to at least
+  16 kbytes. Stack memory is only committed when it is first used, so 
+  a thread with a large stack only costs the memory it touches. 
+  A stack overflow crashes the program. Use `GetStackUsage` to see 
+  how much stack a thread really needs.
+
+  @param task a function to execute
+  @param stack_size the stack size in bytes, or 0 for the default of
+         128 kbytes
+  @returns the tid of the new thread, or NOTHREAD on error. Possible 
+     errors are:
+    - task is NULL
+    - the stack size is larger than 64 Mbytes.
+  */
+Tid_t CreateThreadEx(Task task, int argl, void* args, size_t stack_size);
+
 /**
   @brief Return the Tid of the current thread.
  */
-Tid_t ThreadSelf();
+Tid_t ThreadSelf(void);
 
 /**
   @brief Join the given thread.
@@ -377,6 +441,105 @@ int ThreadDetach(Tid_t tid);
 void ThreadExit(int exitval);
 
 
+/** 
+  @brief A set of cores, as a bit mask. 
+
+  Core @c c is in the set if bit @c c of the mask is set.
+  */
+typedef unsigned int coremask_t;
+
+/** @brief The set of all cores. */
+#define ALL_CORES ((coremask_t) ~0u)
+
+/**
+  @brief Set the cores a thread may run on.
+
+  The thread will only be scheduled on cores in the given mask. Bits
+  for cores that do not exist are ignored. If the thread is running 
+  on a core outside the mask, it moves at the end of its current 
+  time-slice. New threads inherit the affinity of their creator.
+
+  @param tid the tid of a thread in the current process
+  @param mask the set of allowed cores
+  @returns 0 on success and -1 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - the tid corresponds to an exited thread.
+    - the mask contains no existing core.
+  */
+int SetAffinity(Tid_t tid, coremask_t mask);
+
+/**
+  @brief Return the set of cores a thread may run on.
+
+  @param tid the tid of a thread in the current process
+  @returns the affinity mask of the thread, or 0 on error. Possible 
+  errors are:
+    - there is no thread with the given tid in this process.
+    - the tid corresponds to an exited thread.
+  */
+coremask_t GetAffinity(Tid_t tid);
+
+/**
+  @brief Return the stack size and stack high-water mark of a thread.
+
+  The high-water mark is the largest amount of its stack that the 
+  thread has used so far, or, for an exited thread that has not been
+  joined, during its lifetime. It is exact up to stack words that
+  were never written with a non-zero value.
+
+  @param tid the tid of a thread in the current process
+  @param size if not NULL, the stack size is returned here
+  @param used if not NULL, the high-water mark is returned here
+  @returns 0 on success and -1 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+  */
+int GetStackUsage(Tid_t tid, size_t* size, size_t* used);
+
+/**
+  @brief Make the current thread a real-time thread.
+
+  A real-time thread is scheduled earliest-deadline-first, ahead of all
+  other threads. Time is divided into periods; in each period the thread
+  may run for at most @c budget msec, and its deadline is the end of the
+  period. When the budget is used up, the thread waits for its next period.
+  
+  A thread is admitted only if the real-time threads of some core in its
+  affinity mask leave room for it. A real-time thread stays on the core
+  that admitted it.
+
+  @param period the period in msec, or 0 to return to normal scheduling
+  @param budget the run time per period in msec
+  @returns 0 on success and -1 on error. Possible errors are:
+    - the budget is 0 or larger than the period.
+    - no core can admit the thread.
+  */
+int SetDeadline(timeout_t period, timeout_t budget);
+
+
+/** @brief Scheduling classes of non-real-time threads. */
+typedef enum {
+	CLASS_NORMAL,	/**< @brief Scheduled by the policy selected at boot (the default) */
+	CLASS_BATCH		/**< @brief Background work, run when no normal thread is ready */
+} sched_class;
+
+/**
+  @brief Set the scheduling class of the current thread.
+
+  A batch thread runs only when no normal thread is ready on its core.
+  It then runs for a quantum many times longer than that of normal 
+  threads, and normal threads that wake up do not preempt it. Batch 
+  threads take turns in FIFO order; their priority never changes.
+
+  New threads inherit the class of their creator. A real-time thread
+  returns to its class when it leaves the real-time class.
+
+  @param cls the new class
+  @returns 0 on success and -1 on error. Possible errors are:
+    - the class is invalid.
+  */
+int SetSchedClass(sched_class cls);
+
+
 
 /*******************************************
  *
@@ -388,7 +551,7 @@ void ThreadExit(int exitval);
 
   Terminals are numbered starting from 0. 
  */
-unsigned int GetTerminalDevices();
+unsigned int GetTerminalDevices(void);
 
 /** @brief Open a stream on terminal device 'termno'.
 
@@ -413,7 +576,7 @@ Fid_t OpenTerminal(unsigned int termno);
   terminal. On error, it returns NOFILE. Possible errors are:
    - The maximum number of file descriptors has been reached.
 */
-Fid_t OpenNull();
+Fid_t OpenNull(void);
 
 
 /** 
@@ -517,6 +680,10 @@ typedef struct pipe_s {
 
 typedef struct pipe_control_block{
 
+  Mutex lock;   /* protects the rest; Read and Write do not take the kernel lock */
+
+  int refcount; /* one for each open end, plus one for each socket call in progress */
+
   FCB *reader, *writer;
 
   CondVar has_space;
@@ -534,6 +701,9 @@ int pipe_read(void* reader, char * buf, unsigned int size);
 int pipe_writer_close(void* fid);
 int pipe_reader_close(void* fid);
 
+void pipe_incref(Pipe_cb* pipe_cb);
+void pipe_decref(Pipe_cb* pipe_cb);
+
 /**
 	@brief Construct and return a pipe.
 
@@ -787,7 +957,90 @@ typedef struct procinfo_control_block{
 		for error are:
 		- the available file ids for the process are exhausted.
  */
-Fid_t OpenInfo();
+Fid_t OpenInfo(void);
+
+
+
+/*******************************************
+ *
+ * System call batches
+ *
+ *******************************************/
+
+/** @brief The maximum number of arguments of a system call */
+#define SYSCALL_MAX_ARGS 4
+
+/**
+	@brief A system call in a batch.
+
+	An entry is made by @c Batch_<name>(), which takes the arguments of 
+	system call @c <name>. For example, @c Batch_Write(fd, buf, size).
+	@c SyscallBatch() stores the return value in @c ret, as an @c intptr_t.
+	The other fields are private to the kernel.
+ */
+typedef struct syscall_entry {
+	unsigned int no;					/**< @brief The call */
+	intptr_t ret;						/**< @brief Its return value */
+	uintptr_t args[SYSCALL_MAX_ARGS];	/**< @brief Its arguments */
+} syscall_entry;
+
+/** @brief Flag for @c SyscallBatch(): stop after the first call that fails. */
+#define BATCH_STOP_ON_ERROR 1
+
+/**
+	@brief Execute a sequence of system calls with one kernel entry.
+
+	The calls in @c entries are executed in order, as if made one by one,
+	and the return value of each is stored in its entry. Consecutive calls
+	that need the kernel lock are made without releasing it in between.
+
+	A call fails when it returns -1, or @c NOTHREAD if it returns a 
+	@c Tid_t, or 0 for @c GetAffinity. With @c BATCH_STOP_ON_ERROR in @c flags, the batch stops 
+	after the first call that fails.
+
+	Calls that do not return (@c Exit, @c ThreadExit) cannot be batched.
+
+	@param entries the calls, made with the @c Batch_<name>() constructors
+	@param n the number of entries
+	@param flags 0 or @c BATCH_STOP_ON_ERROR
+	@returns the number of calls executed, or -1 if an entry is not valid
+ */
+int SyscallBatch(syscall_entry* entries, unsigned int n, int flags);
+
+/** @name Batch entry constructors
+	Each takes the arguments of the system call of the same name.
+	@{ */
+syscall_entry Batch_Exec(Task task, int argl, void* args);
+syscall_entry Batch_GetPid(void);
+syscall_entry Batch_GetPPid(void);
+syscall_entry Batch_WaitChild(Pid_t pid, int* exitval);
+syscall_entry Batch_CreateThread(Task task, int argl, void* args);
+syscall_entry Batch_CreateThreadEx(Task task, int argl, void* args, size_t stack_size);
+syscall_entry Batch_ThreadSelf(void);
+syscall_entry Batch_ThreadJoin(Tid_t tid, int* exitval);
+syscall_entry Batch_ThreadDetach(Tid_t tid);
+syscall_entry Batch_SetAffinity(Tid_t tid, coremask_t mask);
+syscall_entry Batch_GetAffinity(Tid_t tid);
+syscall_entry Batch_GetStackUsage(Tid_t tid, size_t* size, size_t* used);
+syscall_entry Batch_SetDeadline(timeout_t period, timeout_t budget);
+syscall_entry Batch_SetSchedClass(sched_class cls);
+syscall_entry Batch_FutexWait(int* addr, int expected, timeout_t timeout);
+syscall_entry Batch_FutexWake(int* addr, int n);
+syscall_entry Batch_GetTerminalDevices(void);
+syscall_entry Batch_OpenTerminal(unsigned int termno);
+syscall_entry Batch_OpenNull(void);
+syscall_entry Batch_Read(Fid_t fd, char* buf, unsigned int size);
+syscall_entry Batch_Write(Fid_t fd, const char* buf, unsigned int size);
+syscall_entry Batch_Close(Fid_t fd);
+syscall_entry Batch_Dup2(Fid_t oldfd, Fid_t newfd);
+syscall_entry Batch_Pipe(pipe_t* pipe);
+syscall_entry Batch_Socket(port_t port);
+syscall_entry Batch_Listen(Fid_t sock);
+syscall_entry Batch_Accept(Fid_t lsock);
+syscall_entry Batch_Connect(Fid_t sock, port_t port, timeout_t timeout);
+syscall_entry Batch_ShutDown(Fid_t sock, shutdown_mode how);
+syscall_entry Batch_OpenInfo(void);
+/** @} */
 
 
 
@@ -811,6 +1064,34 @@ Fid_t OpenInfo();
 void boot(unsigned int ncores, unsigned int terminals, Task boot_task, int argl, void* args);
 
 
+/** @brief Scheduling policies, selected at boot. */
+typedef enum {
+	POLICY_MLFQ,	/**< @brief Multi-level feedback queues (the default) */
+	POLICY_FAIR,	/**< @brief Fair share, by weighted virtual runtime */
+	POLICY_RR		/**< @brief Round-robin, with a fixed quantum */
+} sched_policy;
+
+/** @brief Boot tinyos3 with the given scheduling policy.
+
+   @c boot() uses the policy named by the environment variable 
+   @c TINYOS_POLICY (one of @c mlfq, @c fair or @c rr), or @c POLICY_MLFQ
+   if it is not set. Thus, the policies can be compared on the same program.
+
+   With @c POLICY_FAIR, each core runs the ready thread with the 
+   least virtual runtime. A thread's virtual runtime grows by the time 
+   it runs, multiplied by the number of threads of its process. 
+   Therefore, each process receives an equal share of the CPU,
+   which its threads split equally.
+
+   With @c POLICY_RR, each core serves its ready threads in FIFO order,
+   each for the same quantum; the priority of a thread never changes.
+
+   @see boot
+   */
+void boot_policy(sched_policy policy, unsigned int ncores, unsigned int terminals, 
+	Task boot_task, int argl, void* args);
+
+
 /** @} */
 
 #endif
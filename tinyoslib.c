@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <limits.h>
 #include <stdio_ext.h>
 
 #include "util.h"
@@ -172,22 +173,77 @@ int Execute(Program prog, size_t argc, const char** argv)
 void BarrierSync(barrier* bar, unsigned int n)
 {
 	assert(n>0);
-	Mutex_Lock(& bar->mx);
 
-	int epoch = bar->epoch;
-	assert(bar->count < n);
+	unsigned int epoch = __atomic_load_n(&bar->epoch, __ATOMIC_ACQUIRE);
+	unsigned int count = __atomic_add_fetch(&bar->count, 1, __ATOMIC_ACQ_REL);
+	assert(count <= n);
 
-	bar->count ++;
-	if(bar->count == n) {
-		bar->epoch ++;
-		bar->count = 0;
-		Cond_Broadcast(&bar->cv);
+	if(count == n) {
+		/* Nobody leaves before the epoch changes, so no one arrives early */
+		__atomic_store_n(&bar->count, 0, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&bar->epoch, 1, __ATOMIC_RELEASE);
+		FutexWake((int*)&bar->epoch, INT_MAX);
+		return;
 	}
 
-	while(epoch == bar->epoch)
-		Cond_Wait(&bar->mx, &bar->cv);
+	while(__atomic_load_n(&bar->epoch, __ATOMIC_ACQUIRE) == epoch)
+		FutexWait((int*)&bar->epoch, (int)epoch, INFINITE_TIMEOUT);
+}
+
+
+/*
+	This is the mutex of "Futexes are tricky" by U. Drepper.
+ */
+void FMutexLock(fmutex* mx)
+{
+	int c = 0;
+	if(__atomic_compare_exchange_n(&mx->state, &c, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+
+	/* Mark the mutex contended, and sleep until we lock it */
+	if(c != 2)
+		c = __atomic_exchange_n(&mx->state, 2, __ATOMIC_ACQUIRE);
+	while(c != 0) {
+		FutexWait(&mx->state, 2, INFINITE_TIMEOUT);
+		c = __atomic_exchange_n(&mx->state, 2, __ATOMIC_ACQUIRE);
+	}
+}
 
-	Mutex_Unlock(& bar->mx);
+int FMutexTryLock(fmutex* mx)
+{
+	int c = 0;
+	return __atomic_compare_exchange_n(&mx->state, &c, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+void FMutexUnlock(fmutex* mx)
+{
+	if(__atomic_fetch_sub(&mx->state, 1, __ATOMIC_RELEASE) != 1) {
+		__atomic_store_n(&mx->state, 0, __ATOMIC_RELEASE);
+		FutexWake(&mx->state, 1);
+	}
+}
+
+
+void SemWait(semaphore* sem)
+{
+	while(1) {
+		int c = __atomic_load_n(&sem->count, __ATOMIC_RELAXED);
+		while(c > 0)
+			if(__atomic_compare_exchange_n(&sem->count, &c, c-1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+				return;
+
+		/* SemPost sees us, or FutexWait sees its increment */
+		__atomic_add_fetch(&sem->waiters, 1, __ATOMIC_SEQ_CST);
+		FutexWait(&sem->count, 0, INFINITE_TIMEOUT);
+		__atomic_sub_fetch(&sem->waiters, 1, __ATOMIC_RELAXED);
+	}
+}
+
+void SemPost(semaphore* sem)
+{
+	__atomic_add_fetch(&sem->count, 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&sem->waiters, __ATOMIC_SEQ_CST) > 0)
+		FutexWake(&sem->count, 1);
 }
 
 
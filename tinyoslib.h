@@ -74,16 +74,73 @@ int ParseProcInfo(procinfo* pinfo, Program* prog, int argc, const char** argv );
 
 
 
+/*
+	User-level synchronization on futexes. The uncontended paths are 
+	atomic operations on an int; only a thread that has to wait, or to
+	wake a waiter, makes a system call.
+ */
+
+/**
+	@brief A barrier for @c n threads.
+
+	@see BarrierSync
+  */
 typedef struct barrier {
-	Mutex mx;
-	CondVar cv;
 	unsigned int count, epoch;
 } barrier;
 
-#define BARRIER_INIT  ((barrier){ MUTEX_INIT, COND_INIT, 0, 0})
+#define BARRIER_INIT  ((barrier){ 0, 0 })
 
+/**
+	@brief Wait until @c n threads have called @c BarrierSync on @c bar.
 
+	The barrier can be used again, by the same number of threads.
+  */
 void BarrierSync(barrier* bar, unsigned int n);
 
 
+/**
+	@brief A mutex on a futex.
+
+	Unlike @c Mutex, a waiter sleeps in the kernel, instead of yielding.
+	The state is 0 when unlocked, 1 when locked and 2 when locked with
+	possible waiters.
+
+	@see FMutexLock
+  */
+typedef struct fmutex {
+	int state;
+} fmutex;
+
+#define FMUTEX_INIT  ((fmutex){ 0 })
+
+/** @brief Lock a @c fmutex, sleeping as long as it takes. */
+void FMutexLock(fmutex* mx);
+
+/** @brief Lock a @c fmutex if it is unlocked. Return 1 on success. */
+int FMutexTryLock(fmutex* mx);
+
+/** @brief Unlock a @c fmutex that you locked. */
+void FMutexUnlock(fmutex* mx);
+
+
+/**
+	@brief A counting semaphore on a futex.
+
+	@see SemWait
+  */
+typedef struct semaphore {
+	int count;		/**< @brief The value of the semaphore */
+	int waiters;	/**< @brief The threads that may sleep in @c SemWait */
+} semaphore;
+
+#define SEMAPHORE_INIT(n)  ((semaphore){ (n), 0 })
+
+/** @brief Decrement the semaphore, waiting while it is 0. */
+void SemWait(semaphore* sem);
+
+/** @brief Increment the semaphore, waking up a waiter. */
+void SemPost(semaphore* sem);
+
+
 #endif
@@ -1,6 +1,7 @@
 
 #include <assert.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/time.h>
 #include <time.h>
 #include <math.h>
@@ -546,7 +547,7 @@ BOOT_TEST(test_dup2_error_on_invalid_fid,
 {
 	ASSERT(Dup2(NOFILE, 3)==-1);
 	ASSERT(Dup2(MAX_FILEID, 3)==-1);
-	Fid_t fid = OpenNull(0);
+	Fid_t fid = OpenNull();
 	assert(fid!=NOFILE);
 	ASSERT(Dup2(fid, NOFILE)==-1);
 	ASSERT(Dup2(fid, MAX_FILEID)==-1);		
@@ -691,6 +692,66 @@ BOOT_TEST(test_dup2_copies_file,
 }
 
 
+BOOT_TEST(test_syscall_batch,
+	"Test that SyscallBatch executes its calls in order, returns their\n"
+	"values, and stops at the first failure when asked to."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+
+	syscall_entry burst[] = {
+		Batch_Dup2(pipe.write, 5),
+		Batch_Close(pipe.write),
+		Batch_Write(5, "hello", 5),
+		Batch_Write(5, " world", 6),
+		Batch_Close(5),
+		Batch_GetPid()
+	};
+	ASSERT(SyscallBatch(burst, 6, BATCH_STOP_ON_ERROR) == 6);
+	ASSERT(burst[0].ret == 0 && burst[1].ret == 0);
+	ASSERT(burst[2].ret == 5 && burst[3].ret == 6);
+	ASSERT(burst[4].ret == 0 && burst[5].ret == 1);
+
+	/* The writers are closed, so we get what was written */
+	char buf[12] = { 0 };
+	ASSERT(Read(pipe.read, buf, 11) == 11);
+	ASSERT(strcmp(buf, "hello world") == 0);
+
+	/* Closing a bad fid fails */
+	syscall_entry fails[] = {
+		Batch_Close(pipe.read),
+		Batch_Close(MAX_FILEID),
+		Batch_GetPid()
+	};
+	fails[2].ret = 42;
+	ASSERT(SyscallBatch(fails, 3, BATCH_STOP_ON_ERROR) == 2);
+	ASSERT(fails[0].ret == 0 && fails[1].ret == -1 && fails[2].ret == 42);
+	ASSERT(SyscallBatch(fails, 3, 0) == 3);
+	ASSERT(fails[2].ret == 1);
+
+	/* Calls on an invalid Tid fail, whatever their return type */
+	syscall_entry notid[] = {
+		Batch_GetAffinity(ThreadSelf()),
+		Batch_GetAffinity(NOTHREAD),
+		Batch_ThreadDetach(NOTHREAD),
+	};
+	ASSERT(SyscallBatch(notid, 3, BATCH_STOP_ON_ERROR) == 2);
+	ASSERT(notid[0].ret == (intptr_t) GetAffinity(ThreadSelf()));
+	ASSERT(notid[1].ret == 0);
+	ASSERT(SyscallBatch(notid, 3, 0) == 3);
+	ASSERT(notid[2].ret == -1);
+
+	/* A bad entry makes the whole batch fail */
+	syscall_entry bad[] = { Batch_GetPid(), Batch_GetPid() };
+	bad[1].no = ~0u;
+	ASSERT(SyscallBatch(bad, 2, 0) == -1);
+	ASSERT(SyscallBatch(NULL, 0, 0) == 0);
+
+	return 0;
+}
+
+
 BOOT_TEST(test_read_error_on_bad_fid,
 	"Test that Read will return an error when called on a bad fid"
 	)
@@ -902,6 +963,64 @@ BOOT_TEST(test_write_to_many_terminals,
 
 
 
+static int spawn_grandchild(int argl, void* args) { return 1; }
+
+static int spawn_worker(int argl, void* args) { return argl; }
+
+static int spawn_child(int argl, void* args)
+{
+	Tid_t tid[4];
+	int sum = 0;
+
+	/* Left to be adopted by init */
+	ASSERT(Exec(spawn_grandchild, 0, NULL) != NOPROC);
+
+	for(int j=0; j<4; j++)
+		tid[j] = CreateThread(spawn_worker, j, NULL);
+	for(int j=0; j<4; j++) {
+		int val;
+		ASSERT(ThreadJoin(tid[j], &val) == 0);
+		sum += val;
+	}
+	return sum;
+}
+
+static int spawn_spawner(int argl, void* args)
+{
+	int sum = 0;
+	for(int i=0; i<20; i++)
+		ASSERT(Exec(spawn_child, 0, NULL) != NOPROC);
+	for(int i=0; i<20; i++) {
+		int status;
+		ASSERT(WaitChild(NOPROC, &status) != NOPROC);
+		sum += status;
+	}
+	ASSERT(WaitChild(NOPROC, NULL) == NOPROC);
+	return sum;
+}
+
+BOOT_TEST(test_concurrent_spawn_join,
+	"Test process and thread creation, exit and reaping in many processes\n"
+	"at once, while orphans are adopted by init as their parents exit."
+	)
+{
+	for(int i=0; i<4; i++)
+		ASSERT(Exec(spawn_spawner, 0, NULL) != NOPROC);
+
+	/* 4 spawners and 80 grandchildren */
+	int sum = 0, status;
+	for(int i=0; i<84; i++) {
+		ASSERT(WaitChild(NOPROC, &status) != NOPROC);
+		sum += status;
+	}
+	ASSERT(WaitChild(NOPROC, NULL) == NOPROC);
+	ASSERT(sum == 4*20*6 + 80);
+
+	return 0;
+}
+
+
+
 TEST_SUITE(basic_tests, 
 	"A suite of basic tests, focusing on the functional behaviour of the\n"
 	"tinyos3 API, but not the operational (concurrency and I/O multiplexing)."
@@ -917,6 +1036,7 @@ TEST_SUITE(basic_tests,
 	&test_main_return_returns_status,
 	&test_wait_for_any_child,
 	&test_orphans_adopted_by_init,
+	&test_concurrent_spawn_join,
 	&test_cond_timedwait_timeout,
 	&test_cond_timedwait_signal,
 	&test_cond_timedwait_broadcast,
@@ -926,6 +1046,7 @@ TEST_SUITE(basic_tests,
 	&test_dup2_error_on_nonfile,
 	&test_dup2_error_on_invalid_fid,
 	&test_dup2_copies_file,
+	&test_syscall_batch,
 	&test_close_error_on_invalid_fid,
 	&test_close_success_on_valid_nonfile_fid,
 	&test_close_terminals,
@@ -954,6 +1075,18 @@ TEST_SUITE(basic_tests,
  *********************************************/
 
 
+void mark_time(struct timeval* t)
+{
+	CHECK(gettimeofday(t, NULL));
+}
+double time_since(struct timeval* t0)
+{
+	struct timeval t1;
+	mark_time(&t1);
+
+	return ((double)(t1.tv_sec-t0->tv_sec)) + 1E-6* (t1.tv_usec - t0->tv_usec);
+}
+
 void sleep_thread(int sec) {
 	Mutex mx = MUTEX_INIT;
 	CondVar cond = COND_INIT;
@@ -962,6 +1095,16 @@ void sleep_thread(int sec) {
 	ASSERT(Cond_TimedWait(&mx,&cond,1000*sec)==0);
 }
 
+/* Sleep for a few milliseconds, to let other threads run */
+void sleep_msec(timeout_t msec) {
+	Mutex mx = MUTEX_INIT;
+	CondVar cond = COND_INIT;
+
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx,&cond,msec);
+	Mutex_Unlock(&mx);
+}
+
 /* 
 	Helper that spawns a process, waits for its completion
 	and returns its status.
@@ -1398,661 +1541,874 @@ BOOT_TEST(test_cyclic_joins,
 }
 
 
-TEST_SUITE(thread_tests, 
-	"A suite of tests for threads."
-	)
-{
-	&test_join_illegal_tid_gives_error,
-	&test_detach_illegal_tid_gives_error,
-	&test_detach_self,
-	&test_detach_other,
-	&test_multiple_detach,
-	&test_join_main_thread,
-	&test_detach_main_thread,
-	&test_detach_after_join,
-	&test_create_join_thread,
-	&test_join_many_threads,
-	&test_exit_many_threads,
-	&test_main_exit_cleanup,
-	&test_noexit_cleanup,
-	&test_cyclic_joins,
-	NULL
-};
-
+/* Waiters on the futex word in args, counted in futex_ready */
+static int futex_ready;
 
+static int futex_waiter(int argl, void* args)
+{
+	int* w = args;
+	__atomic_add_fetch(&futex_ready, 1, __ATOMIC_SEQ_CST);
+	while(__atomic_load_n(w, __ATOMIC_SEQ_CST) == 0)
+		FutexWait(w, 0, INFINITE_TIMEOUT);
+	return *w;
+}
 
+BOOT_TEST(test_futex_wait_wake,
+	"Test that FutexWait sleeps only while the word has the expected value,\n"
+	"and that FutexWake wakes up waiters on that word only."
+	)
+{
+	int word = 0, other = 0;
+	futex_ready = 0;
 
+	ASSERT(FutexWait(NULL, 0, INFINITE_TIMEOUT)==-1);
+	ASSERT(FutexWait(&word, 1, INFINITE_TIMEOUT)==-1);
+	ASSERT(FutexWait(&word, 0, 20)==-1);	/* times out */
 
+	/* A zero timeout does not block */
+	struct timeval t0;
+	mark_time(&t0);
+	ASSERT(FutexWait(&word, 0, 0)==-1);
+	ASSERT_MSG(time_since(&t0) < 5E-3, "waited %.1f msec\n", 1E3*time_since(&t0));
+	ASSERT(FutexWake(&word, 1)==0);
+
+	Tid_t t[4];
+	for(int i=0; i<3; i++)
+		t[i] = CreateThread(futex_waiter, 0, &word);
+	t[3] = CreateThread(futex_waiter, 0, &other);
+	while(__atomic_load_n(&futex_ready, __ATOMIC_SEQ_CST) < 4)
+		sleep_msec(1);
+	sleep_thread(1);
 
+	/* Wake two of the three waiters on word; the third is woken below */
+	__atomic_store_n(&word, 7, __ATOMIC_SEQ_CST);
+	ASSERT(FutexWake(&word, 2)==2);
+	ASSERT(FutexWake(&word, 5)==1);
+	for(int i=0; i<3; i++) {
+		int val;
+		ASSERT(ThreadJoin(t[i], &val)==0);
+		ASSERT(val == 7);
+	}
 
-/*********************************************
- *
- *
- *
- *  Pipe tests
- *
- *
- *
- *********************************************/
+	__atomic_store_n(&other, 3, __ATOMIC_SEQ_CST);
+	ASSERT(FutexWake(&other, 1)==1);
+	ASSERT(ThreadJoin(t[3], NULL)==0);
+	return 0;
+}
 
 
+/* State of test_futex_primitives */
+#define FP_THREADS 6
+#define FP_ROUNDS 2000
+static struct {
+	fmutex mx;
+	semaphore items, slots;
+	barrier bar;
+	long counter;
+	int buffer[4], in, out, sum;
+} fp;
 
-BOOT_TEST(test_pipe_open,
-	"Open a pipe and put just a little data in it"
-	)
+static int fp_incr(int argl, void* args)
 {
-	pipe_t pipe;
-	ASSERT(Pipe(&pipe)==0);	
-	int rc;
-
-	for(int i=0;i<3;i++) {
-		ASSERT((rc=Write(pipe.write, "Hello world", 12))==12);
+	for(int i=0; i<FP_ROUNDS; i++) {
+		FMutexLock(&fp.mx);
+		long c = fp.counter;
+		if(i % 100 == 0) sleep_msec(1);
+		fp.counter = c+1;
+		FMutexUnlock(&fp.mx);
+		if(i % 500 == 0) BarrierSync(&fp.bar, FP_THREADS);
 	}
-	char buffer[12] = { [0] = 0 };
-	for(int i=0;i<3;i++) {
-		ASSERT((rc=Read(pipe.read, buffer, 12))==12);
-		ASSERT(strcmp(buffer, "Hello world")==0);
+	return 0;
+}
+
+static int fp_producer(int argl, void* args)
+{
+	for(int i=1; i<=FP_ROUNDS; i++) {
+		SemWait(&fp.slots);
+		FMutexLock(&fp.mx);
+		fp.buffer[fp.in++ % 4] = i;
+		FMutexUnlock(&fp.mx);
+		SemPost(&fp.items);
 	}
 	return 0;
 }
 
+static int fp_consumer(int argl, void* args)
+{
+	for(int i=1; i<=FP_ROUNDS; i++) {
+		SemWait(&fp.items);
+		FMutexLock(&fp.mx);
+		fp.sum += fp.buffer[fp.out++ % 4];
+		FMutexUnlock(&fp.mx);
+		SemPost(&fp.slots);
+	}
+	return 0;
+}
 
-BOOT_TEST(test_pipe_fails_on_exhausted_fid,
-	"Test that Pipe will fail if the fids are exhausted."
+BOOT_TEST(test_futex_primitives,
+	"Test the fmutex, semaphore and barrier of tinyoslib with many threads."
 	)
 {
-	pipe_t pipe;
-	for(uint i=0; i< (MAX_FILEID/2); i++ )
-		ASSERT(Pipe(&pipe)==0);
-	for(uint i=0; i< (MAX_FILEID/2); i++ )
-		ASSERT(Pipe(&pipe)==-1);	
+	const int N = FP_THREADS, ROUNDS = FP_ROUNDS;
+
+	fp.mx = FMUTEX_INIT;
+	fp.items = SEMAPHORE_INIT(0);
+	fp.slots = SEMAPHORE_INIT(4);
+	fp.bar = BARRIER_INIT;
+	fp.counter = fp.in = fp.out = fp.sum = 0;
+
+	Tid_t t[N];
+	for(int i=0; i<N; i++) t[i] = CreateThread(fp_incr, 0, NULL);
+	for(int i=0; i<N; i++) ThreadJoin(t[i], NULL);
+	ASSERT(fp.counter == N*ROUNDS);
+	ASSERT(FMutexTryLock(&fp.mx));
+	ASSERT(! FMutexTryLock(&fp.mx));
+	FMutexUnlock(&fp.mx);
+
+	/* Producers and consumers on a bounded buffer */
+	for(int i=0; i<N; i+=2) {
+		t[i] = CreateThread(fp_producer, 0, NULL);
+		t[i+1] = CreateThread(fp_consumer, 0, NULL);
+	}
+	for(int i=0; i<N; i++) ThreadJoin(t[i], NULL);
+	ASSERT(fp.sum == (N/2) * ROUNDS*(ROUNDS+1)/2);
+	ASSERT(fp.items.count == 0 && fp.slots.count == 4);
 	return 0;
 }
 
 
+static int affinity_child(int argl, void* args)
+{
+	return GetAffinity(ThreadSelf());
+}
 
-BOOT_TEST(test_pipe_close_reader,
-	"Open a pipe and put just a little data in it"
-	)
+static int affinity_thread(int argl, void* args)
 {
-	pipe_t pipe;
-	ASSERT(Pipe(&pipe)==0);	
-	int rc;
+	coremask_t mask = argl;
+	ASSERT(SetAffinity(ThreadSelf(), mask)==0);
+	ASSERT(GetAffinity(ThreadSelf())==mask);
 
-	for(int i=0;i<3;i++) {
-		ASSERT((rc=Write(pipe.write, "Hello world", 12))==12);
-	}
-	Close(pipe.read);
-	for(int i=0;i<3;i++) {
-		ASSERT((rc=Write(pipe.write, "Hello world", 12))==-1);
+	/* The mask is kept as the thread sleeps and wakes up */
+	for(int i=0; i<100; i++) {
+		sleep_msec(1);
+		ASSERT(GetAffinity(ThreadSelf())==mask);
 	}
+
+	/* Children inherit the affinity */
+	int exitval;
+	Tid_t t = CreateThread(affinity_child, 0, NULL);
+	ASSERT(ThreadJoin(t, &exitval)==0);
+	ASSERT(exitval == mask);
 	return 0;
 }
 
-BOOT_TEST(test_pipe_close_writer,
-	"Open a pipe and put just a little data in it"
+BOOT_TEST(test_affinity,
+	"Test that threads run only on the cores in their affinity mask.",
+	.minimum_cores = 2
 	)
 {
-	pipe_t pipe;
-	ASSERT(Pipe(&pipe)==0);	
-	int rc;
-
-	for(int i=0;i<3;i++) {
-		ASSERT((rc=Write(pipe.write, "Hello world", 12))==12);
+	uint ncores = cpu_cores();
+	coremask_t all = (ncores < 32) ? (1u << ncores)-1 : ALL_CORES;
+
+	ASSERT(GetAffinity(ThreadSelf())==all);
+	ASSERT(GetAffinity(NOTHREAD)==0);
+	ASSERT(SetAffinity(NOTHREAD, all)==-1);
+	ASSERT(SetAffinity(ThreadSelf(), 0)==-1);
+
+	/* Pin each thread to one core, or to a pair of cores */
+	Tid_t tids[2*ncores];
+	for(uint c=0; c<ncores; c++) {
+		tids[2*c] = CreateThread(affinity_thread, 1u << c, NULL);
+		tids[2*c+1] = CreateThread(affinity_thread, (1u << c) | (1u << ((c+1)%ncores)), NULL);
 	}
+	for(uint i=0; i<2*ncores; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
 
-	char buffer[12] = { [0] = 0 };
-	for(int i=0;i<3;i++) {
-		ASSERT((rc=Read(pipe.read, buffer, 12))==12);
-		ASSERT(strcmp(buffer, "Hello world")==0);
-	}
-	Close(pipe.write);
-	for(int i=0;i<3;i++) {
-		ASSERT((rc=Read(pipe.read, buffer, 12))==0);
-	}
 	return 0;
 }
 
 
-/* Takes one integer argument, writes that many bytes to stdout.
- */
-int data_producer(int argl, void* args)
+/* Use about argl kbytes of stack, and return the stack usage seen */
+static int stack_user(int argl, void* args)
 {
-	assert(argl == sizeof(int));
-	int nbytes = *(int*)args;
-
-	Close(0);
+	volatile char buf[1024];
+	buf[0] = 1;
+	if(argl > 1)
+		return stack_user(argl-1, args) + buf[0] - 1;
 
-	char buffer[32768];
+	size_t used;
+	ASSERT(GetStackUsage(ThreadSelf(), NULL, &used)==0);
+	return used / 1024;
+}
 
-	while(nbytes>0) {
-		unsigned int n = (nbytes<32768) ? nbytes : 32768;
-		int rc = Write(1, buffer, n);
-		assert(rc>0);
-		nbytes -= rc;
+BOOT_TEST(test_create_thread_ex,
+	"Test that threads can be created with a given stack size, and that\n"
+	"their stack high-water mark is reported."
+	)
+{
+	size_t size, used;
+
+	ASSERT(CreateThreadEx(NULL, 0, NULL, 0)==NOTHREAD);
+	ASSERT(CreateThreadEx(stack_user, 1, NULL, (size_t)1 << 40)==NOTHREAD);
+	ASSERT(GetStackUsage(NOTHREAD, &size, &used)==-1);
+
+	/* Stack sizes are rounded up to pages, and to at least 16 kbytes */
+	Tid_t t = CreateThreadEx(stack_user, 1, NULL, 1);
+	ASSERT(t != NOTHREAD);
+	ASSERT(GetStackUsage(t, &size, NULL)==0);
+	ASSERT(size == 16*1024);
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	t = CreateThreadEx(stack_user, 1, NULL, 70000);
+	ASSERT(GetStackUsage(t, &size, NULL)==0);
+	ASSERT(size == 18*4096);
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	t = CreateThread(stack_user, 1, NULL);
+	ASSERT(GetStackUsage(t, &size, NULL)==0);
+	ASSERT(size == 128*1024);
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	/* The usage is seen by the thread, and after it exits */
+	int seen;
+	t = CreateThreadEx(stack_user, 40, NULL, 64*1024);
+	while(GetStackUsage(t, NULL, &used)==0 && used < 40*1024)
+		sleep_msec(1);
+	ASSERT_MSG(used >= 40*1024 && used < 64*1024, "used=%zu\n", used);
+	ASSERT(ThreadJoin(t, &seen)==0);
+	ASSERT_MSG(seen >= 40 && seen < 64, "seen=%d\n", seen);
+
+	/* A recycled stack does not report the usage of its previous thread */
+	for(int i=0; i<50; i++) {
+		t = CreateThread(stack_user, 1, NULL);
+		ASSERT(ThreadJoin(t, &seen)==0);
+		ASSERT_MSG(seen < 8, "seen=%d\n", seen);
+		t = CreateThread(stack_user, 100, NULL);
+		ASSERT(ThreadJoin(t, &seen)==0);
+		ASSERT_MSG(seen >= 100, "seen=%d\n", seen);
 	}
-	Close(1);
+
 	return 0;
 }
 
-/* Takes one integer argument. Reads its standard input to exhaustion,
-   asserts it read that many bytes. */
-int data_consumer(int argl, void* args) 
-{
-	assert(argl == sizeof(int));
-	int nbytes = *(int*)args;
-	Close(1);
 
-	char buffer[16384];
-	int count = 0;
+struct fair_share {
+	volatile int stop;
+	unsigned long count[2];
+};
 
-	int rc = 1;
-	while(rc) {
-		rc = Read(0, buffer, 16384);
-		assert(rc>=0);
-		count += rc;
-	}
-	ASSERT(count == nbytes);
+struct fair_share_args {
+	struct fair_share* F;
+	int proc;
+};
+
+static int fair_share_spinner(int argl, void* args)
+{
+	struct fair_share* F = args;
+	while(! F->stop)
+		__atomic_fetch_add(&F->count[argl], 1, __ATOMIC_RELAXED);
 	return 0;
 }
 
+static int fair_share_process(int argl, void* args)
+{
+	/* Process 0 has one thread, process 1 has three */
+	struct fair_share_args* A = args;
+	int nthreads = (A->proc == 0) ? 1 : 3;
+	Tid_t t[nthreads];
+
+	for(int i=1; i<nthreads; i++)
+		t[i] = CreateThread(fair_share_spinner, A->proc, A->F);
+	fair_share_spinner(A->proc, A->F);
+	for(int i=1; i<nthreads; i++)
+		ThreadJoin(t[i], NULL);
+	return 0;
+}
 
-BOOT_TEST(test_pipe_single_producer,
-	"Test blocking in the pipe by a single producer single consumer sending 10Mbytes of data."
-	)
+static int fair_share_init(int argl, void* args)
 {
-	pipe_t pipe;
-	ASSERT(Pipe(&pipe)==0);	
+	struct fair_share* F = *(struct fair_share**) args;
 
-	/* First, make pipe.read be zero. We cannot just Dup, because we may close pipe.write */
-	if(pipe.read != 0) {
-		if(pipe.write==0) {
-			/* Get a null stream! */
-			Fid_t fid = OpenNull();
-			assert(fid!=NOFILE);
-			Dup2(0, fid);
-			pipe.write = fid;
-		}
-		Dup2(pipe.read, 0);
-		Close(pipe.read);
-	}
-	if(pipe.write!=1)  {
-		Dup2(pipe.write, 1);
-		Close(pipe.write);
+	for(int p=0; p<2; p++) {
+		struct fair_share_args A = { .F = F, .proc = p };
+		Exec(fair_share_process, sizeof(A), &A);
 	}
 
-	int N = 10000000;
-	ASSERT(Exec(data_consumer, sizeof(N), &N)!=NOPROC);
-	ASSERT(Exec(data_producer, sizeof(N), &N)!=NOPROC);
-
-	Close(0);
-	Close(1);
+	sleep_thread(1);
+	F->stop = 1;
 
-	WaitChild(NOPROC,NULL);
-	WaitChild(NOPROC,NULL);
+	WaitChild(NOPROC, NULL);
+	WaitChild(NOPROC, NULL);
 	return 0;
 }
 
-BOOT_TEST(test_pipe_multi_producer,
-	"Test blocking in the pipe by 10 producers and single consumer sending 10Mbytes of data."
+BARE_TEST(test_fair_policy_shares_by_process,
+	"Test that with POLICY_FAIR, two CPU-bound processes get equal shares\n"
+	"of a core, although one has one thread and the other has three."
 	)
 {
-	pipe_t pipe;
-	ASSERT(Pipe(&pipe)==0);	
+	struct fair_share fs = { .stop = 0, .count = {0, 0} };
+	struct fair_share* F = &fs;
 
-	/* First, make pipe.read be zero. We cannot just Dup, because we may close pipe.write */
-	if(pipe.read != 0) {
-		if(pipe.write==0) {
-			/* Get a null stream! */
-			Fid_t fid = OpenNull();
-			assert(fid!=NOFILE);
-			Dup2(0, fid);
-			pipe.write = fid;
-		}
-		Dup2(pipe.read, 0);
-		Close(pipe.read);
-	}
-	if(pipe.write!=1)  {
-		Dup2(pipe.write, 1);
-		Close(pipe.write);
-	}
+	boot_policy(POLICY_FAIR, 1, 0, fair_share_init, sizeof(F), &F);
 
-	int N = 1000000;
-	for(int i=0;i<10;i++)
-		ASSERT(Exec(data_producer, sizeof(N), &N)!=NOPROC);
-	N = 10*N;
-	ASSERT(Exec(data_consumer, sizeof(N), &N)!=NOPROC);
+	double share = (double)fs.count[0] / (fs.count[0] + fs.count[1]);
+	ASSERT_MSG(share > 0.35 && share < 0.65, "share of the single thread=%.2f\n", share);
+}
 
-	Close(0);
-	Close(1);
 
-	for(int i=0;i<10;i++)
-		WaitChild(NOPROC,NULL);
-	WaitChild(NOPROC,NULL);
+struct rr_share {
+	volatile int stop;
+	unsigned long count[3];
+};
+
+static int rr_share_spinner(int argl, void* args)
+{
+	struct rr_share* R = args;
+	while(! R->stop)
+		__atomic_fetch_add(&R->count[argl], 1, __ATOMIC_RELAXED);
 	return 0;
 }
 
+static int rr_share_init(int argl, void* args)
+{
+	struct rr_share* R = *(struct rr_share**) args;
+	Tid_t t[3];
 
-TEST_SUITE(pipe_tests,
-	"A suite of tests for pipes. We are focusing on correctness, not performance."
+	for(int i=0; i<3; i++)
+		t[i] = CreateThread(rr_share_spinner, i, R);
+
+	sleep_thread(1);
+	R->stop = 1;
+
+	for(int i=0; i<3; i++)
+		ThreadJoin(t[i], NULL);
+	return 0;
+}
+
+BARE_TEST(test_rr_policy_shares_equally,
+	"Test that with POLICY_RR, three CPU-bound threads get equal shares\n"
+	"of a core."
 	)
 {
-	&test_pipe_open,
-	&test_pipe_fails_on_exhausted_fid,
-	&test_pipe_close_reader,
-	&test_pipe_close_writer,
-	&test_pipe_single_producer,
-	&test_pipe_multi_producer,
-	NULL
-};
-
+	struct rr_share rs = { .stop = 0, .count = {0, 0, 0} };
+	struct rr_share* R = &rs;
 
+	boot_policy(POLICY_RR, 1, 0, rr_share_init, sizeof(R), &R);
 
+	unsigned long total = rs.count[0] + rs.count[1] + rs.count[2];
+	for(int i=0; i<3; i++) {
+		double share = (double)rs.count[i] / total;
+		ASSERT_MSG(share > 0.2 && share < 0.45, "share of thread %d=%.2f\n", i, share);
+	}
+}
 
-/*********************************************
- *
- *
- *
- *  Socket tests
- *
- *
- *
- *********************************************/
 
-struct connect_sockets
-{
-	Fid_t sock1, lsock, *sock2;
-	port_t port;
+struct batch_run {
+	volatile int stop;
+	volatile unsigned long count;
+	unsigned long while_busy, while_idle;
+	int invalid;
 };
 
-static int connect_sockets_connect_process(int argl, void* args) {
-	struct connect_sockets* A = args;
-	ASSERT(Connect(A->sock1, A->port, 1000)==0);
+static int batch_spinner(int argl, void* args)
+{
+	struct batch_run* B = args;
+	while(! B->stop)
+		B->count++;
 	return 0;
 }
 
-void connect_sockets(Fid_t sock1, Fid_t lsock, Fid_t* sock2, port_t port)
+static int batch_run_init(int argl, void* args)
 {
-	struct connect_sockets A = { 
-		.sock1=sock1, .lsock=lsock, .sock2=sock2, .port=port
-	};
+	struct batch_run* B = *(struct batch_run**) args;
+	struct timeval t0;
+	int word = 0;
 
-	/* Spawn a child to connect sock1 to port (where lsock must be listening) */
-	Pid_t pid = Exec(connect_sockets_connect_process, sizeof(A), &A);
-	ASSERT(pid != NOPROC);
+	B->invalid = SetSchedClass(42);
 
-	/* accept the child's connection here */
-	*sock2 = Accept(lsock);
-	ASSERT(*sock2 != NOFILE);
+	/* The new thread inherits the batch class */
+	SetSchedClass(CLASS_BATCH);
+	Tid_t t = CreateThread(batch_spinner, 0, B);
+	SetSchedClass(CLASS_NORMAL);
 
-	/* Clean up child */
-	ASSERT(WaitChild(pid, NULL)==pid);
-}
+	/* While we spin, the batch thread must not run */
+	mark_time(&t0);
+	while(time_since(&t0) < 0.2);
+	B->while_busy = B->count;
 
+	/* While we sleep, it must */
+	FutexWait(&word, 0, 100);
+	B->while_idle = B->count;
 
-void check_transfer(Fid_t from, Fid_t to)
+	B->stop = 1;
+	ThreadJoin(t, NULL);
+	return 0;
+}
+
+BARE_TEST(test_batch_class_runs_when_idle,
+	"Test that a batch thread does not run while a normal thread is ready\n"
+	"on its core, and runs when the core would be idle."
+	)
 {
-	char buffer[12] = {[0]=0};
-	int rc;
-	ASSERT((rc=Write(from,"Hello world", 12))==12);
-	ASSERT((rc=Read(to, buffer, 12))==12);
-	ASSERT((rc=strcmp("Hello world", buffer))==0);
+	struct batch_run br = { .stop = 0, .count = 0 };
+	struct batch_run* B = &br;
+
+	boot(1, 0, batch_run_init, sizeof(B), &B);
+
+	ASSERT(br.invalid == -1);
+	ASSERT_MSG(br.while_busy == 0, "the batch thread ran %lu times\n", br.while_busy);
+	ASSERT(br.while_idle > 0);
 }
 
 
-BOOT_TEST(test_socket_constructor_many_per_port,
-	"Test that Socket succeeds opening many sockets on the same port"
-	)
+struct starvation {
+	volatile int stop;
+	unsigned long spins;
+};
+
+static int starvation_chatty(int argl, void* args)
 {
-	for(Fid_t f=0; f<MAX_FILEID; f++) {
-		ASSERT(Socket(100)!=NOFILE);
+	struct starvation* S = args;
+	while(! S->stop) {
+		/* Run for less than a quantum, then sleep */
+		struct timeval t0;
+		mark_time(&t0);
+		while(time_since(&t0) < 2E-3)
+			;
+		sleep_msec(1);
 	}
 	return 0;
 }
 
-BOOT_TEST(test_socket_constructor_out_of_fids,
-	"Test that the socket constructor fails on running out of Fids"
-	)
+static int starvation_spinner(int argl, void* args)
 {
-	for(int i=0;i<MAX_FILEID;i++)
-		ASSERT(Socket(100)!=NOFILE);
-	for(int i=0;i<MAX_FILEID;i++)
-		ASSERT(Socket(100)==NOFILE);	
+	struct starvation* S = args;
+	while(! S->stop)
+		__atomic_fetch_add(&S->spins, 1, __ATOMIC_RELAXED);
 	return 0;
 }
 
-BOOT_TEST(test_socket_constructor_illegal_port,
-	"Test that the socket constructor fails on illegal port"
+BOOT_TEST(test_mlfq_no_starvation,
+	"Test that a CPU-bound thread makes progress, while interactive threads\n"
+	"keep every core busy at the top MLFQ level."
 	)
 {
-	ASSERT(Socket(NOPORT)!=NOFILE);
-	ASSERT(Socket(1)!=NOFILE);
-	ASSERT(Socket(MAX_PORT)!=NOFILE);
+	struct starvation S = { .stop = 0, .spins = 0 };
+	uint nchatty = 4*cpu_cores();
+	Tid_t chatty[nchatty];
 
-	ASSERT(Socket(NOPORT-1)==NOFILE);
-	ASSERT(Socket(MAX_PORT+1)==NOFILE);	
-	ASSERT(Socket(MAX_PORT+10)==NOFILE);
-	return 0;	
-}
+	Tid_t spinner = CreateThread(starvation_spinner, 0, &S);
+	/* Let the spinner sink to the lowest level */
+	sleep_thread(1);
 
-BOOT_TEST(test_listen_success,
-	"Test that Listen succeeds on an unbound socket"
-	)
-{
-	ASSERT(Listen(Socket(100))==0);
-	return 0;
-}
+	for(uint i=0; i<nchatty; i++)
+		chatty[i] = CreateThread(starvation_chatty, 0, &S);
+	unsigned long spins = S.spins;
+	sleep_thread(1);
+	ASSERT(S.spins > spins);
 
-BOOT_TEST(test_listen_fails_on_bad_fid,
-	"Test that Listen fails on an invalid fid"
-	)
-{
-	ASSERT(Listen(7)==-1);
-	ASSERT(Listen(OpenNull())==-1);
-	ASSERT(Listen(NOFILE)==-1);
-	ASSERT(Listen(MAX_FILEID)==-1);	
+	S.stop = 1;
+	ThreadJoin(spinner, NULL);
+	for(uint i=0; i<nchatty; i++)
+		ThreadJoin(chatty[i], NULL);
 	return 0;
 }
 
-BOOT_TEST(test_listen_fails_on_NOPORT,
-	"Test that Listen fails on a socket defined on NOPORT"
-	)
+
+struct mlfq_levels {
+	volatile int stop;
+	struct timeval origin;
+	double longest[2];		/* the longest run of each spinner, in sec */
+	double late;			/* the mean lateness of the interactive thread */
+};
+
+/* Spin, and record the longest time we ran without being descheduled */
+static int mlfq_level_spinner(int argl, void* args)
 {
-	ASSERT(Listen(Socket(NOPORT))==-1);
+	struct mlfq_levels* L = args;
+	double start = time_since(&L->origin), prev = start;
+	while(! L->stop) {
+		double t = time_since(&L->origin);
+		if(t - prev > 2E-3) {
+			if(prev - start > L->longest[argl])
+				L->longest[argl] = prev - start;
+			start = t;
+		}
+		prev = t;
+	}
 	return 0;
 }
 
-BOOT_TEST(test_listen_fails_on_occupied_port,
-	"Test that Listen fails on an occupied port"
-	)
+static int mlfq_level_interactive(int argl, void* args)
 {
-	Fid_t f = Socket(100);
-	ASSERT(Listen(f)==0);
-	ASSERT(Listen(Socket(100))==-1);
-	Close(f);
-	ASSERT(Listen(Socket(100))==0);	
+	struct mlfq_levels* L = args;
+	const int N = 50;
+	double late = 0.0;
+	for(int i=0; i<N; i++) {
+		struct timeval t0;
+		mark_time(&t0);
+		sleep_msec(2);
+		late += time_since(&t0) - 2E-3;
+	}
+	L->late = late / N;
 	return 0;
 }
 
-BOOT_TEST(test_listen_fails_on_initialized_socket,
-	"Test that Listen fails on a socket that has been previously initialized by Listen"
-	)
+static int mlfq_levels_boot(int argl, void* args)
 {
-	Fid_t lsock = Socket(100);
-	ASSERT(Listen(lsock)==0);	
-	ASSERT(Listen(lsock)==-1);	
-	Fid_t sock[2];
-	sock[0] = Socket(200);
-	connect_sockets(sock[0], lsock, sock+1, 100);
-	ASSERT(Listen(sock[0])==-1);
-	ASSERT(Listen(sock[1])==-1);
-	return 0;
-}
+	struct mlfq_levels* L = *(struct mlfq_levels**) args;
+	mark_time(&L->origin);
 
+	/* Let two CPU-bound threads sink to the low levels */
+	Tid_t spinner[2];
+	for(int i=0; i<2; i++)
+		spinner[i] = CreateThread(mlfq_level_spinner, i, L);
+	sleep_thread(1);
 
-BOOT_TEST(test_accept_succeds,
-	"Test that accept succeeds on a legal connection"
-	)
-{
-	Fid_t lsock = Socket(100);
-	ASSERT(Listen(lsock)==0);
-	Fid_t cli = Socket(NOPORT);
-	Fid_t srv;
-	connect_sockets(cli, lsock, &srv, 100);
-	return 0;
-}
+	Tid_t t = CreateThread(mlfq_level_interactive, 0, L);
+	ThreadJoin(t, NULL);
 
-BOOT_TEST(test_accept_fails_on_bad_fid,
-	"Test that Accept fails on an invalid fid"
-	)
-{
-	ASSERT(Accept(7)==-1);
-	ASSERT(Accept(OpenNull())==-1);
-	ASSERT(Accept(NOFILE)==-1);
-	ASSERT(Accept(MAX_FILEID)==-1);
-	
+	L->stop = 1;
+	for(int i=0; i<2; i++)
+		ThreadJoin(spinner[i], NULL);
 	return 0;
 }
 
-BOOT_TEST(test_accept_fails_on_unbound_socket,
-	"Test that Accept fails on an uninitialized socket"
+BARE_TEST(test_mlfq_levels,
+	"Test that CPU-bound threads sink to the MLFQ levels with long quanta,\n"
+	"and that an interactive thread still runs ahead of them."
 	)
 {
-	ASSERT(Accept(Socket(100))==-1);
-	return 0;
+	struct mlfq_levels lv = { .stop = 0, .longest = { 0.0, 0.0 }, .late = 0.0 };
+	struct mlfq_levels* L = &lv;
+
+	boot_policy(POLICY_MLFQ, 1, 0, mlfq_levels_boot, sizeof(L), &L);
+
+	/* The top level quantum is 10 msec, the lowest is 80 msec */
+	for(int i=0; i<2; i++)
+		ASSERT_MSG(lv.longest[i] > 30E-3, "spinner %d ran at most %.1f msec\n", i, 1E3*lv.longest[i]);
+	ASSERT_MSG(lv.late < 10E-3, "the interactive thread was late by %.1f msec\n", 1E3*lv.late);
 }
 
-BOOT_TEST(test_accept_fails_on_connected_socket,
-	"Test that Accept fails on a connected socket"
-	)
+
+static int edf_spinner(int argl, void* args)
 {
-	Fid_t lsock = Socket(100);
-	ASSERT(Listen(lsock)==0);
-	Fid_t cli = Socket(NOPORT);
-	Fid_t srv;
-	connect_sockets(cli, lsock, &srv, 100);
-	ASSERT(Accept(srv)==-1);		
+	struct starvation* S = args;
+	if(SetDeadline(100, 50) != 0)
+		return -1;
+	while(! S->stop)
+		;
 	return 0;
 }
 
-BOOT_TEST(test_accept_reusable,
-	"Test that Accept can be called on the same socket many times to create different connections."
+BOOT_TEST(test_edf_admission,
+	"Test that SetDeadline checks its arguments, admits real-time threads up\n"
+	"to the utilization bound of each core, and that budgets leave time for\n"
+	"normal threads."
 	)
 {
-	Fid_t lsock = Socket(100);
-	ASSERT(lsock!=NOFILE);
-	ASSERT(Listen(lsock)==0);
-	uint n = MAX_FILEID/2 - 1;
-	Fid_t cli[n], srv[n];
+	ASSERT(SetDeadline(10, 0)==-1);
+	ASSERT(SetDeadline(10, 20)==-1);
+
+	/* Each spinner takes half a core */
+	struct starvation S = { .stop = 0, .spins = 0 };
+	uint nrt = cpu_cores();
+	Tid_t rt[nrt];
+	for(uint i=0; i<nrt; i++)
+		rt[i] = CreateThread(edf_spinner, 0, &S);
+	Tid_t spinner = CreateThread(starvation_spinner, 0, &S);
+	sleep_thread(1);
 
-	for(uint i=0;i<n;i++) {
-		cli[i] = Socket(NOPORT);
-		connect_sockets(cli[i], lsock, srv+i, 100);
-	}
-	for(uint i=0;i<n;i++)
-		for(uint j=0;j<n;j++)  {
-			ASSERT(cli[i]!=srv[j]);
-			if(i==j) continue;
-			ASSERT(srv[i]!=srv[j]);
-			ASSERT(cli[i]!=cli[j]);
-		}
+	/* No core has room for another half */
+	ASSERT(SetDeadline(100, 50)==-1);
+	ASSERT(SetDeadline(100, 10)==0);
+	ASSERT(SetDeadline(0, 0)==0);
+
+	/* The normal thread was not starved by the real-time ones */
+	unsigned long spins = S.spins;
+	sleep_thread(1);
+	ASSERT(S.spins > spins);
 
+	S.stop = 1;
+	int exitval;
+	for(uint i=0; i<nrt; i++) {
+		ASSERT(ThreadJoin(rt[i], &exitval)==0);
+		ASSERT(exitval==0);
+	}
+	ThreadJoin(spinner, NULL);
 	return 0;
 }
 
 
-/* Helper for test_accept_fails_on_exhausted_fid */
-static int accept_connection_assert_fail(int argl, void* args) 
+struct inversion {
+	Mutex mx;
+	volatile int stop, locked;
+	unsigned long work;
+	double latency;
+};
+
+static void inversion_spin(unsigned long n) { for(volatile unsigned long i=0; i<n; i++); }
+
+static int inversion_low(int argl, void* args)
 {
-	ASSERT(argl==sizeof(Fid_t));
-	Fid_t lsock = * (Fid_t*) args;
-	ASSERT(Accept(lsock)==NOFILE);
+	struct inversion* I = args;
+	/* Sink to the lowest level, then hold the mutex for a while */
+	inversion_spin(10*I->work);
+	Mutex_Lock(&I->mx);
+	I->locked = 1;
+	inversion_spin(I->work);
+	Mutex_Unlock(&I->mx);
 	return 0;
 }
 
+static int inversion_high(int argl, void* args)
+{
+	struct inversion* I = args;
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	struct timeval t0;
 
-BOOT_TEST(test_accept_fails_on_exhausted_fid,
-	"Test that Accept will fail if the fids of the process are exhausted."
+	Mutex_Lock(&mx);
+	while(! I->locked)
+		Cond_TimedWait(&mx, &cv, 1);
+	Mutex_Unlock(&mx);
+
+	mark_time(&t0);
+	Mutex_Lock(&I->mx);
+	I->latency = time_since(&t0);
+	Mutex_Unlock(&I->mx);
+	return 0;
+}
+
+BOOT_TEST(test_mutex_priority_inheritance,
+	"Test that a top-level thread waiting for a mutex held by a low-priority\n"
+	"thread is not delayed by CPU-bound threads of medium priority. All the\n"
+	"threads run on core 0."
 	)
 {
-	Fid_t lsock = Socket(100);
-	ASSERT(lsock!=NOFILE);
-	ASSERT(Listen(lsock)==0);
+	struct inversion I = { .mx = MUTEX_INIT, .stop = 0, .locked = 0 };
+	struct starvation S = { .stop = 0, .spins = 0 };
+	const uint NSPIN = 4;
+	Tid_t spinner[NSPIN];
+	struct timeval t0;
 
-	/* If MAX_FILEID is odd, allocate an extra fid */
-	if( (MAX_FILEID & 1) == 1 )  OpenNull();
+	ASSERT(SetAffinity(ThreadSelf(), 1)==0);
 
-	/* Allocate pairs of fids */
-	for(uint i=0;i< (MAX_FILEID-1)/2 ; i++) {		
-		Fid_t cli = Socket(NOPORT);
-		Fid_t srv;
-		ASSERT(cli != NOFILE);
-		connect_sockets(cli,lsock,&srv,100);
-	}
+	/* Calibrate 20 msec of work */
+	mark_time(&t0);
+	inversion_spin(1000000);
+	I.work = (unsigned long)(1000000 * 20E-3 / time_since(&t0));
 
-	/* Ok, we should be able to get another client */
-	Fid_t cli = Socket(NOPORT); ASSERT(cli!=NOFILE);
+	for(uint i=0; i<NSPIN; i++)
+		spinner[i] = CreateThread(starvation_spinner, 0, &S);
+	Tid_t low = CreateThread(inversion_low, 0, &I);
+	Tid_t high = CreateThread(inversion_high, 0, &I);
 
-	/* Call accept on another process and verify it fails */
-	Pid_t pid = Exec(accept_connection_assert_fail, sizeof(lsock), &lsock);
-	ASSERT(pid!=NOPROC);
+	ThreadJoin(high, NULL);
+	ThreadJoin(low, NULL);
+	S.stop = 1;
+	for(uint i=0; i<NSPIN; i++)
+		ThreadJoin(spinner[i], NULL);
 
-	/* Now, if we try a connection we should fail! */
-	ASSERT(Connect(cli, 100, 1000)==-1);
-	ASSERT(WaitChild(pid, NULL)==pid);
+	/* The low thread needs 20 msec to unlock, when it gets the core */
+	ASSERT_MSG(I.latency < 60E-3, "latency=%.1f msec\n", 1E3*I.latency);
 	return 0;
 }
 
 
-static int unblocking_accept_connection(int argl, void* args) 
+TEST_SUITE(thread_tests, 
+	"A suite of tests for threads."
+	)
 {
-	Fid_t lsock = argl;
-	ASSERT(Accept(lsock)==NOFILE);
-	return 0;
-}
+	&test_join_illegal_tid_gives_error,
+	&test_detach_illegal_tid_gives_error,
+	&test_detach_self,
+	&test_detach_other,
+	&test_multiple_detach,
+	&test_join_main_thread,
+	&test_detach_main_thread,
+	&test_detach_after_join,
+	&test_create_join_thread,
+	&test_join_many_threads,
+	&test_exit_many_threads,
+	&test_main_exit_cleanup,
+	&test_noexit_cleanup,
+	&test_cyclic_joins,
+	&test_affinity,
+	&test_create_thread_ex,
+	&test_futex_wait_wake,
+	&test_futex_primitives,
+	&test_fair_policy_shares_by_process,
+	&test_rr_policy_shares_equally,
+	&test_batch_class_runs_when_idle,
+	&test_mlfq_no_starvation,
+	&test_mlfq_levels,
+	&test_edf_admission,
+	&test_mutex_priority_inheritance,
+	NULL
+};
 
 
 
-BOOT_TEST(test_accept_unblocks_on_close,
-	"Test that Accept will unblock if the listening socket is closed."
-	)
-{
-	Fid_t lsock = Socket(100);
-	ASSERT(lsock!=NOFILE);
-	ASSERT(Listen(lsock)==0);
 
-	Tid_t t = CreateThread(unblocking_accept_connection, lsock, NULL);
 
-	/* Here, we just wait some time, (of course, this is technically a race condition :-( */
-	fibo(30);
-	Close(lsock);
 
-	ThreadJoin(t,NULL);
-	return 0;
-}
+
+/*********************************************
+ *
+ *
+ *
+ *  Pipe tests
+ *
+ *
+ *
+ *********************************************/
 
 
 
-BOOT_TEST(test_connect_fails_on_bad_fid,
-	"Test that Connect will fail if given a bad fid."
+BOOT_TEST(test_pipe_open,
+	"Open a pipe and put just a little data in it"
 	)
 {
-	ASSERT(Accept(7)==-1);
-	ASSERT(Accept(OpenNull())==-1);
-	ASSERT(Accept(NOFILE)==-1);
-	ASSERT(Accept(MAX_FILEID)==-1);
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);	
+	int rc;
 
+	for(int i=0;i<3;i++) {
+		ASSERT((rc=Write(pipe.write, "Hello world", 12))==12);
+	}
+	char buffer[12] = { [0] = 0 };
+	for(int i=0;i<3;i++) {
+		ASSERT((rc=Read(pipe.read, buffer, 12))==12);
+		ASSERT(strcmp(buffer, "Hello world")==0);
+	}
 	return 0;
 }
 
-BOOT_TEST(test_connect_fails_on_bad_socket,
-	"Test that Connect will fail if given a listening or connected socket."
+
+BOOT_TEST(test_pipe_fails_on_exhausted_fid,
+	"Test that Pipe will fail if the fids are exhausted."
 	)
 {
-	Fid_t lsock = Socket(100);
-	ASSERT(lsock!=NOFILE);
-	ASSERT(Listen(lsock)==0);
-
-	ASSERT(Connect(lsock, 100, 1000)==-1);
-	Fid_t cli, srv;
-	cli = Socket(NOPORT);
-	ASSERT(cli!=NOFILE);
-	connect_sockets(cli, lsock, &srv, 100);
-
-	ASSERT(Connect(cli, 100, 1000)==-1);
-	ASSERT(Connect(srv, 100, 1000)==-1);
-
+	pipe_t pipe;
+	for(uint i=0; i< (MAX_FILEID/2); i++ )
+		ASSERT(Pipe(&pipe)==0);
+	for(uint i=0; i< (MAX_FILEID/2); i++ )
+		ASSERT(Pipe(&pipe)==-1);	
 	return 0;
 }
 
-BOOT_TEST(test_connect_fails_on_illegal_port,
-	"Test that connect fails if given an illegal port."
-	)
-{
-	Fid_t cli = Socket(10);
-	ASSERT(Connect(cli, NOPORT, 100)==-1);
-	ASSERT(Connect(cli, MAX_PORT+1, 100)==-1);
 
-	return 0;
-}
 
-BOOT_TEST(test_connect_fails_on_non_listened_port,
-	"Test that Connect fails on a port that has no listener."
+BOOT_TEST(test_pipe_close_reader,
+	"Open a pipe and put just a little data in it"
 	)
 {
-	Fid_t cli = Socket(10);
-	ASSERT(Connect(cli, 100, 100)==-1);
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);	
+	int rc;
 
+	for(int i=0;i<3;i++) {
+		ASSERT((rc=Write(pipe.write, "Hello world", 12))==12);
+	}
+	Close(pipe.read);
+	for(int i=0;i<3;i++) {
+		ASSERT((rc=Write(pipe.write, "Hello world", 12))==-1);
+	}
 	return 0;
 }
 
-BOOT_TEST(test_connect_fails_on_timeout,
-	"Test that connect fails on timeout.",
-	.timeout = 2
+BOOT_TEST(test_pipe_close_writer,
+	"Open a pipe and put just a little data in it"
 	)
 {
-	Fid_t lsock = Socket(100);
-	ASSERT(lsock!=NOFILE);
-	ASSERT(Listen(lsock)==0);
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);	
+	int rc;
 
-	Fid_t cli = Socket(10);
-	/* Give it a short timeout */
-	ASSERT(Connect(cli, 100, 100)==-1);
+	for(int i=0;i<3;i++) {
+		ASSERT((rc=Write(pipe.write, "Hello world", 12))==12);
+	}
 
+	char buffer[12] = { [0] = 0 };
+	for(int i=0;i<3;i++) {
+		ASSERT((rc=Read(pipe.read, buffer, 12))==12);
+		ASSERT(strcmp(buffer, "Hello world")==0);
+	}
+	Close(pipe.write);
+	for(int i=0;i<3;i++) {
+		ASSERT((rc=Read(pipe.read, buffer, 12))==0);
+	}
 	return 0;
 }
 
 
-
-BOOT_TEST(test_socket_small_transfer,
-	"Open a socket and put just a little data in it, in both directions, for many times."
-	)
+/* Takes one integer argument, writes that many bytes to stdout.
+ */
+int data_producer(int argl, void* args)
 {
-	Fid_t sock[2], lsock;
-
-	lsock = Socket(100);   ASSERT(lsock!=NOFILE);
-	if(lsock!=0) { Dup2(lsock,0); Close(lsock); }
+	assert(argl == sizeof(int));
+	int nbytes = *(int*)args;
 
-	sock[0] = Socket(NOPORT); ASSERT(sock[0]!=NOFILE);
+	Close(0);
 
-	ASSERT(Listen(lsock)==0);
+	char buffer[32768];
 
-	connect_sockets(sock[0], lsock, sock+1, 100);
-	for(uint i=0; i< 32768; i++) {
-		check_transfer(sock[0], sock[1]);
-		check_transfer(sock[1], sock[0]);		
+	while(nbytes>0) {
+		unsigned int n = (nbytes<32768) ? nbytes : 32768;
+		int rc = Write(1, buffer, n);
+		assert(rc>0);
+		nbytes -= rc;
 	}
-
+	Close(1);
 	return 0;
 }
 
-
-BOOT_TEST(test_socket_single_producer,
-	"Test blocking in the socket by a single producer single consumer sending 10Mbytes of data."
-	)
+/* Takes one integer argument. Reads its standard input to exhaustion,
+   asserts it read that many bytes. */
+int data_consumer(int argl, void* args) 
 {
-	Fid_t fid = Socket(NOPORT);
-	ASSERT(fid!=NOFILE);
-	if(fid!=0) {
-		ASSERT(Dup2(fid,0)==0);
-		ASSERT(Close(fid)==0);
-	}
+	assert(argl == sizeof(int));
+	int nbytes = *(int*)args;
+	Close(1);
 
-	Fid_t lsock = Socket(100);
-	ASSERT(lsock!=NOFILE);
-	if(lsock!=2) {
-		ASSERT(Dup2(lsock,2)==0);
-		ASSERT(Close(lsock)==0);
+	char buffer[16384];
+	int count = 0;
+
+	int rc = 1;
+	while(rc) {
+		rc = Read(0, buffer, 16384);
+		assert(rc>=0);
+		count += rc;
 	}
+	ASSERT(count == nbytes);
+	return 0;
+}
 
-	ASSERT(Listen(2)==0);
 
-	Fid_t srv;
-	connect_sockets(0, 2, &srv, 100);
+BOOT_TEST(test_pipe_single_producer,
+	"Test blocking in the pipe by a single producer single consumer sending 10Mbytes of data."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);	
 
-	if(srv!=1) {
-		ASSERT(Dup2(srv,1)==0);
-		ASSERT(Close(srv)==0);
+	/* First, make pipe.read be zero. We cannot just Dup, because we may close pipe.write */
+	if(pipe.read != 0) {
+		if(pipe.write==0) {
+			/* Get a null stream! */
+			Fid_t fid = OpenNull();
+			assert(fid!=NOFILE);
+			Dup2(0, fid);
+			pipe.write = fid;
+		}
+		Dup2(pipe.read, 0);
+		Close(pipe.read);
+	}
+	if(pipe.write!=1)  {
+		Dup2(pipe.write, 1);
+		Close(pipe.write);
 	}
 
 	int N = 10000000;
@@ -2067,484 +2423,2123 @@ BOOT_TEST(test_socket_single_producer,
 	return 0;
 }
 
-BOOT_TEST(test_socket_multi_producer,
-	"Test blocking in the pipe by 10 producers and single consumer sending 10Mbytes of data."
-	)
-{
-	Fid_t fid = Socket(NOPORT);
+BOOT_TEST(test_pipe_multi_producer,
+	"Test blocking in the pipe by 10 producers and single consumer sending 10Mbytes of data."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);	
+
+	/* First, make pipe.read be zero. We cannot just Dup, because we may close pipe.write */
+	if(pipe.read != 0) {
+		if(pipe.write==0) {
+			/* Get a null stream! */
+			Fid_t fid = OpenNull();
+			assert(fid!=NOFILE);
+			Dup2(0, fid);
+			pipe.write = fid;
+		}
+		Dup2(pipe.read, 0);
+		Close(pipe.read);
+	}
+	if(pipe.write!=1)  {
+		Dup2(pipe.write, 1);
+		Close(pipe.write);
+	}
+
+	int N = 1000000;
+	for(int i=0;i<10;i++)
+		ASSERT(Exec(data_producer, sizeof(N), &N)!=NOPROC);
+	N = 10*N;
+	ASSERT(Exec(data_consumer, sizeof(N), &N)!=NOPROC);
+
+	Close(0);
+	Close(1);
+
+	for(int i=0;i<10;i++)
+		WaitChild(NOPROC,NULL);
+	WaitChild(NOPROC,NULL);
+	return 0;
+}
+
+static int read_six(int fid, void* args)
+{
+	char buf[16];
+	return Read(fid, buf, 6);
+}
+
+BOOT_TEST(test_pipe_close_during_read,
+	"Test that closing the read end while another thread reads from it\n"
+	"lets the read finish, and closes the read end after it."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+
+	int rc = 0, word = 0;
+	Tid_t t = CreateThread(read_six, pipe.read, NULL);
+	/* Let the reader block */
+	FutexWait(&word, 0, 50);
+
+	ASSERT(Close(pipe.read)==0);
+	ASSERT(Write(pipe.write, "Hello", 6)==6);
+	ThreadJoin(t, &rc);
+	ASSERT(rc==6);
+
+	/* The reader dropped the last reference */
+	ASSERT(Write(pipe.write, "Hello", 6)==-1);
+	return 0;
+}
+
+
+TEST_SUITE(pipe_tests,
+	"A suite of tests for pipes. We are focusing on correctness, not performance."
+	)
+{
+	&test_pipe_open,
+	&test_pipe_fails_on_exhausted_fid,
+	&test_pipe_close_reader,
+	&test_pipe_close_writer,
+	&test_pipe_single_producer,
+	&test_pipe_multi_producer,
+	&test_pipe_close_during_read,
+	NULL
+};
+
+
+
+
+/*********************************************
+ *
+ *
+ *
+ *  Socket tests
+ *
+ *
+ *
+ *********************************************/
+
+struct connect_sockets
+{
+	Fid_t sock1, lsock, *sock2;
+	port_t port;
+};
+
+static int connect_sockets_connect_process(int argl, void* args) {
+	struct connect_sockets* A = args;
+	ASSERT(Connect(A->sock1, A->port, 1000)==0);
+	return 0;
+}
+
+void connect_sockets(Fid_t sock1, Fid_t lsock, Fid_t* sock2, port_t port)
+{
+	struct connect_sockets A = { 
+		.sock1=sock1, .lsock=lsock, .sock2=sock2, .port=port
+	};
+
+	/* Spawn a child to connect sock1 to port (where lsock must be listening) */
+	Pid_t pid = Exec(connect_sockets_connect_process, sizeof(A), &A);
+	ASSERT(pid != NOPROC);
+
+	/* accept the child's connection here */
+	*sock2 = Accept(lsock);
+	ASSERT(*sock2 != NOFILE);
+
+	/* Clean up child */
+	ASSERT(WaitChild(pid, NULL)==pid);
+}
+
+
+void check_transfer(Fid_t from, Fid_t to)
+{
+	char buffer[12] = {[0]=0};
+	int rc;
+	ASSERT((rc=Write(from,"Hello world", 12))==12);
+	ASSERT((rc=Read(to, buffer, 12))==12);
+	ASSERT((rc=strcmp("Hello world", buffer))==0);
+}
+
+
+BOOT_TEST(test_socket_constructor_many_per_port,
+	"Test that Socket succeeds opening many sockets on the same port"
+	)
+{
+	for(Fid_t f=0; f<MAX_FILEID; f++) {
+		ASSERT(Socket(100)!=NOFILE);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_socket_constructor_out_of_fids,
+	"Test that the socket constructor fails on running out of Fids"
+	)
+{
+	for(int i=0;i<MAX_FILEID;i++)
+		ASSERT(Socket(100)!=NOFILE);
+	for(int i=0;i<MAX_FILEID;i++)
+		ASSERT(Socket(100)==NOFILE);	
+	return 0;
+}
+
+BOOT_TEST(test_socket_constructor_illegal_port,
+	"Test that the socket constructor fails on illegal port"
+	)
+{
+	ASSERT(Socket(NOPORT)!=NOFILE);
+	ASSERT(Socket(1)!=NOFILE);
+	ASSERT(Socket(MAX_PORT)!=NOFILE);
+
+	ASSERT(Socket(NOPORT-1)==NOFILE);
+	ASSERT(Socket(MAX_PORT+1)==NOFILE);	
+	ASSERT(Socket(MAX_PORT+10)==NOFILE);
+	return 0;	
+}
+
+BOOT_TEST(test_listen_success,
+	"Test that Listen succeeds on an unbound socket"
+	)
+{
+	ASSERT(Listen(Socket(100))==0);
+	return 0;
+}
+
+BOOT_TEST(test_listen_fails_on_bad_fid,
+	"Test that Listen fails on an invalid fid"
+	)
+{
+	ASSERT(Listen(7)==-1);
+	ASSERT(Listen(OpenNull())==-1);
+	ASSERT(Listen(NOFILE)==-1);
+	ASSERT(Listen(MAX_FILEID)==-1);	
+	return 0;
+}
+
+BOOT_TEST(test_listen_fails_on_NOPORT,
+	"Test that Listen fails on a socket defined on NOPORT"
+	)
+{
+	ASSERT(Listen(Socket(NOPORT))==-1);
+	return 0;
+}
+
+BOOT_TEST(test_listen_fails_on_occupied_port,
+	"Test that Listen fails on an occupied port"
+	)
+{
+	Fid_t f = Socket(100);
+	ASSERT(Listen(f)==0);
+	ASSERT(Listen(Socket(100))==-1);
+	Close(f);
+	ASSERT(Listen(Socket(100))==0);	
+	return 0;
+}
+
+BOOT_TEST(test_listen_fails_on_initialized_socket,
+	"Test that Listen fails on a socket that has been previously initialized by Listen"
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(Listen(lsock)==0);	
+	ASSERT(Listen(lsock)==-1);	
+	Fid_t sock[2];
+	sock[0] = Socket(200);
+	connect_sockets(sock[0], lsock, sock+1, 100);
+	ASSERT(Listen(sock[0])==-1);
+	ASSERT(Listen(sock[1])==-1);
+	return 0;
+}
+
+
+BOOT_TEST(test_accept_succeds,
+	"Test that accept succeeds on a legal connection"
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(Listen(lsock)==0);
+	Fid_t cli = Socket(NOPORT);
+	Fid_t srv;
+	connect_sockets(cli, lsock, &srv, 100);
+	return 0;
+}
+
+BOOT_TEST(test_accept_fails_on_bad_fid,
+	"Test that Accept fails on an invalid fid"
+	)
+{
+	ASSERT(Accept(7)==-1);
+	ASSERT(Accept(OpenNull())==-1);
+	ASSERT(Accept(NOFILE)==-1);
+	ASSERT(Accept(MAX_FILEID)==-1);
+	
+	return 0;
+}
+
+BOOT_TEST(test_accept_fails_on_unbound_socket,
+	"Test that Accept fails on an uninitialized socket"
+	)
+{
+	ASSERT(Accept(Socket(100))==-1);
+	return 0;
+}
+
+BOOT_TEST(test_accept_fails_on_connected_socket,
+	"Test that Accept fails on a connected socket"
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(Listen(lsock)==0);
+	Fid_t cli = Socket(NOPORT);
+	Fid_t srv;
+	connect_sockets(cli, lsock, &srv, 100);
+	ASSERT(Accept(srv)==-1);		
+	return 0;
+}
+
+BOOT_TEST(test_accept_reusable,
+	"Test that Accept can be called on the same socket many times to create different connections."
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(lsock!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+	uint n = MAX_FILEID/2 - 1;
+	Fid_t cli[n], srv[n];
+
+	for(uint i=0;i<n;i++) {
+		cli[i] = Socket(NOPORT);
+		connect_sockets(cli[i], lsock, srv+i, 100);
+	}
+	for(uint i=0;i<n;i++)
+		for(uint j=0;j<n;j++)  {
+			ASSERT(cli[i]!=srv[j]);
+			if(i==j) continue;
+			ASSERT(srv[i]!=srv[j]);
+			ASSERT(cli[i]!=cli[j]);
+		}
+
+	return 0;
+}
+
+
+/* Helper for test_accept_fails_on_exhausted_fid */
+static int accept_connection_assert_fail(int argl, void* args) 
+{
+	ASSERT(argl==sizeof(Fid_t));
+	Fid_t lsock = * (Fid_t*) args;
+	ASSERT(Accept(lsock)==NOFILE);
+	return 0;
+}
+
+
+BOOT_TEST(test_accept_fails_on_exhausted_fid,
+	"Test that Accept will fail if the fids of the process are exhausted."
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(lsock!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+
+	/* If MAX_FILEID is odd, allocate an extra fid */
+	if( (MAX_FILEID & 1) == 1 )  OpenNull();
+
+	/* Allocate pairs of fids */
+	for(uint i=0;i< (MAX_FILEID-1)/2 ; i++) {		
+		Fid_t cli = Socket(NOPORT);
+		Fid_t srv;
+		ASSERT(cli != NOFILE);
+		connect_sockets(cli,lsock,&srv,100);
+	}
+
+	/* Ok, we should be able to get another client */
+	Fid_t cli = Socket(NOPORT); ASSERT(cli!=NOFILE);
+
+	/* Call accept on another process and verify it fails */
+	Pid_t pid = Exec(accept_connection_assert_fail, sizeof(lsock), &lsock);
+	ASSERT(pid!=NOPROC);
+
+	/* Now, if we try a connection we should fail! */
+	ASSERT(Connect(cli, 100, 1000)==-1);
+	ASSERT(WaitChild(pid, NULL)==pid);
+	return 0;
+}
+
+
+static int unblocking_accept_connection(int argl, void* args) 
+{
+	Fid_t lsock = argl;
+	ASSERT(Accept(lsock)==NOFILE);
+	return 0;
+}
+
+
+
+BOOT_TEST(test_accept_unblocks_on_close,
+	"Test that Accept will unblock if the listening socket is closed."
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(lsock!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+
+	Tid_t t = CreateThread(unblocking_accept_connection, lsock, NULL);
+
+	/* Here, we just wait some time, (of course, this is technically a race condition :-( */
+	fibo(30);
+	Close(lsock);
+
+	ThreadJoin(t,NULL);
+	return 0;
+}
+
+
+
+BOOT_TEST(test_connect_fails_on_bad_fid,
+	"Test that Connect will fail if given a bad fid."
+	)
+{
+	ASSERT(Accept(7)==-1);
+	ASSERT(Accept(OpenNull())==-1);
+	ASSERT(Accept(NOFILE)==-1);
+	ASSERT(Accept(MAX_FILEID)==-1);
+
+	return 0;
+}
+
+BOOT_TEST(test_connect_fails_on_bad_socket,
+	"Test that Connect will fail if given a listening or connected socket."
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(lsock!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+
+	ASSERT(Connect(lsock, 100, 1000)==-1);
+	Fid_t cli, srv;
+	cli = Socket(NOPORT);
+	ASSERT(cli!=NOFILE);
+	connect_sockets(cli, lsock, &srv, 100);
+
+	ASSERT(Connect(cli, 100, 1000)==-1);
+	ASSERT(Connect(srv, 100, 1000)==-1);
+
+	return 0;
+}
+
+BOOT_TEST(test_connect_fails_on_illegal_port,
+	"Test that connect fails if given an illegal port."
+	)
+{
+	Fid_t cli = Socket(10);
+	ASSERT(Connect(cli, NOPORT, 100)==-1);
+	ASSERT(Connect(cli, MAX_PORT+1, 100)==-1);
+
+	return 0;
+}
+
+BOOT_TEST(test_connect_fails_on_non_listened_port,
+	"Test that Connect fails on a port that has no listener."
+	)
+{
+	Fid_t cli = Socket(10);
+	ASSERT(Connect(cli, 100, 100)==-1);
+
+	return 0;
+}
+
+BOOT_TEST(test_connect_fails_on_timeout,
+	"Test that connect fails on timeout.",
+	.timeout = 2
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(lsock!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+
+	Fid_t cli = Socket(10);
+	/* Give it a short timeout */
+	ASSERT(Connect(cli, 100, 100)==-1);
+
+	return 0;
+}
+
+
+
+BOOT_TEST(test_socket_small_transfer,
+	"Open a socket and put just a little data in it, in both directions, for many times."
+	)
+{
+	Fid_t sock[2], lsock;
+
+	lsock = Socket(100);   ASSERT(lsock!=NOFILE);
+	if(lsock!=0) { Dup2(lsock,0); Close(lsock); }
+
+	sock[0] = Socket(NOPORT); ASSERT(sock[0]!=NOFILE);
+
+	ASSERT(Listen(lsock)==0);
+
+	connect_sockets(sock[0], lsock, sock+1, 100);
+	for(uint i=0; i< 32768; i++) {
+		check_transfer(sock[0], sock[1]);
+		check_transfer(sock[1], sock[0]);		
+	}
+
+	return 0;
+}
+
+
+BOOT_TEST(test_socket_single_producer,
+	"Test blocking in the socket by a single producer single consumer sending 10Mbytes of data."
+	)
+{
+	Fid_t fid = Socket(NOPORT);
+	ASSERT(fid!=NOFILE);
+	if(fid!=0) {
+		ASSERT(Dup2(fid,0)==0);
+		ASSERT(Close(fid)==0);
+	}
+
+	Fid_t lsock = Socket(100);
+	ASSERT(lsock!=NOFILE);
+	if(lsock!=2) {
+		ASSERT(Dup2(lsock,2)==0);
+		ASSERT(Close(lsock)==0);
+	}
+
+	ASSERT(Listen(2)==0);
+
+	Fid_t srv;
+	connect_sockets(0, 2, &srv, 100);
+
+	if(srv!=1) {
+		ASSERT(Dup2(srv,1)==0);
+		ASSERT(Close(srv)==0);
+	}
+
+	int N = 10000000;
+	ASSERT(Exec(data_consumer, sizeof(N), &N)!=NOPROC);
+	ASSERT(Exec(data_producer, sizeof(N), &N)!=NOPROC);
+
+	Close(0);
+	Close(1);
+
+	WaitChild(NOPROC,NULL);
+	WaitChild(NOPROC,NULL);
+	return 0;
+}
+
+BOOT_TEST(test_socket_multi_producer,
+	"Test blocking in the pipe by 10 producers and single consumer sending 10Mbytes of data."
+	)
+{
+	Fid_t fid = Socket(NOPORT);
+	ASSERT(fid!=NOFILE);
+	if(fid!=0) {
+		ASSERT(Dup2(fid,0)==0);
+		ASSERT(Close(fid)==0);
+	}
+
+	Fid_t lsock = Socket(100);
+	ASSERT(lsock!=NOFILE);
+	if(lsock!=2) {
+		ASSERT(Dup2(lsock,2)==0);
+		ASSERT(Close(lsock)==0);
+	}
+
+	ASSERT(Listen(2)==0);
+
+	Fid_t srv;
+	connect_sockets(0, 2, &srv, 100);
+
+	if(srv!=1) {
+		ASSERT(Dup2(srv,1)==0);
+		ASSERT(Close(srv)==0);
+	}
+
+	int N = 1000000;
+	for(int i=0;i<10;i++)
+		ASSERT(Exec(data_producer, sizeof(N), &N)!=NOPROC);
+	N = 10*N;
+	ASSERT(Exec(data_consumer, sizeof(N), &N)!=NOPROC);
+
+	Close(0);
+	Close(1);
+
+	for(int i=0;i<10;i++)
+		WaitChild(NOPROC,NULL);
+	WaitChild(NOPROC,NULL);
+	return 0;
+}
+
+
+
+BOOT_TEST(test_shudown_read,
+	"Test that ShutDown with SHUTDOWN_READ blocks Write"
+	)
+{
+	Fid_t lsock;
+	lsock = Socket(100);   ASSERT(lsock!=NOFILE);
+	if(lsock!=0) { Dup2(lsock,0); Close(lsock); }
+	ASSERT(Listen(lsock)==0);
+
+	Fid_t cli = Socket(NOPORT); ASSERT(cli!=NOFILE);
+	Fid_t srv;
+
+	connect_sockets(cli, lsock, &srv, 100);
+
+	for(uint i=0; i< 2000; i++) {
+		check_transfer(cli, srv);
+		check_transfer(srv, cli);
+	}
+
+	ASSERT(Write(srv, "Hello world",12)==12);
+
+	ShutDown(cli, SHUTDOWN_READ);
+	char buffer[12];
+	ASSERT(Read(cli, buffer, 12)==-1);
+	ASSERT(Write(srv, "Hello world",12)==-1);
+
+	for(uint i=0; i< 2000; i++) {
+		ASSERT(Write(srv, "Hello world",12)==-1);
+		check_transfer(cli, srv);
+	}
+
+	return 0;
+}
+
+
+static int socket_reader(int fid, void* args)
+{
+	char buffer[12];
+	return Read(fid, buffer, 12);
+}
+
+BOOT_TEST(test_shutdown_during_read,
+	"Test that a Read blocked on a socket returns, when the socket is shut\n"
+	"down and its peer is closed while it waits."
+	)
+{
+	Fid_t lsock = Socket(100);   ASSERT(lsock!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+
+	Fid_t cli = Socket(NOPORT); ASSERT(cli!=NOFILE);
+	Fid_t srv;
+	connect_sockets(cli, lsock, &srv, 100);
+
+	Tid_t t = CreateThread(socket_reader, cli, NULL);
+
+	/* Let the reader block */
+	int word = 0;
+	FutexWait(&word, 0, 50);
+
+	ASSERT(ShutDown(cli, SHUTDOWN_BOTH)==0);
+	ASSERT(Close(srv)==0);
+
+	int ret;
+	ASSERT(ThreadJoin(t, &ret)==0);
+	ASSERT(ret == -1 || ret == 0);
+	return 0;
+}
+
+
+BOOT_TEST(test_shudown_write,
+	"Test that ShutDown with SHUTDOWN_WRITE first exhausts buffers and then causes Read to return 0"
+	)
+{
+	Fid_t lsock;
+	lsock = Socket(100);   ASSERT(lsock!=NOFILE);
+	if(lsock!=0) { Dup2(lsock,0); Close(lsock); }
+	ASSERT(Listen(lsock)==0);
+
+	Fid_t cli = Socket(NOPORT); ASSERT(cli!=NOFILE);
+	Fid_t srv;
+
+	connect_sockets(cli, lsock, &srv, 100);
+
+	for(uint i=0; i< 2000; i++) {
+		check_transfer(cli, srv);
+		check_transfer(srv, cli);
+	}
+
+	ASSERT(Write(srv, "Hello world",12)==12);
+	ASSERT(Write(srv, "Hello world",12)==12);
+	ASSERT(Write(srv, "Hello world",12)==12);
+
+	ShutDown(srv, SHUTDOWN_WRITE);
+	ASSERT(Write(srv, "Hello world",12)==-1);
+
+	/* We should still read the three writes before the close. */
+	char buffer[12];
+	for(uint i=0;i<3;i++) {
+		ASSERT(Read(cli, buffer, 12)==12);
+		ASSERT(strcmp(buffer,"Hello world")==0);
+	}
+
+	for(uint i=0; i< 2000; i++) {
+		ASSERT(Read(cli, buffer, 12)==0);
+		check_transfer(cli, srv);
+	}
+
+	return 0;
+}
+
+
+
+
+TEST_SUITE(socket_tests,
+	"A suite of tests for sockets."
+	)
+{
+	&test_socket_constructor_many_per_port,
+	&test_socket_constructor_out_of_fids,
+	&test_socket_constructor_illegal_port,
+	
+	&test_listen_success,
+	&test_listen_fails_on_bad_fid,
+	&test_listen_fails_on_NOPORT,
+	&test_listen_fails_on_occupied_port,
+	&test_listen_fails_on_initialized_socket,
+
+	&test_accept_succeds,
+	&test_accept_fails_on_bad_fid,
+	&test_accept_fails_on_unbound_socket,
+	&test_accept_fails_on_connected_socket,
+	&test_accept_reusable,
+	&test_accept_fails_on_exhausted_fid,
+	&test_accept_unblocks_on_close,
+
+	&test_connect_fails_on_bad_fid,
+	&test_connect_fails_on_bad_socket,
+	&test_connect_fails_on_illegal_port,
+	&test_connect_fails_on_non_listened_port,
+	&test_connect_fails_on_timeout,
+
+	&test_socket_small_transfer,
+	&test_socket_single_producer,
+	&test_socket_multi_producer,
+
+	&test_shudown_read,
+	&test_shudown_write,
+	&test_shutdown_during_read,
+
+	NULL
+};
+
+
+
+
+/*********************************************
+ *
+ *
+ *
+ *  Concurrency tests
+ *
+ *
+ *
+ *********************************************/
+
+
+
+
+
+unsigned int timestamp=0;
+
+unsigned int get_timestamp()
+{
+	return __atomic_fetch_add(&timestamp, 1, __ATOMIC_SEQ_CST);	
+}
+
+
+static unsigned int tschild;
+
+static int multitask_child(int argl, void* args)
+{
+	unsigned int f = fibo(38);
+	tschild = get_timestamp();
+	return f>10;
+}
+
+BOOT_TEST(test_multitask,
+	"Test that Exec returns before execution of the child is finished."
+	)
+{
+	Exec(multitask_child, 0, NULL);
+	unsigned int ts = get_timestamp();
+	WaitChild(NOPROC, NULL);
+
+	ASSERT(ts < tschild);
+	return 0;
+}
+
+
+
+static int preemption_child(int argl, void* args)
+{
+	unsigned int* ts[2];
+	assert(sizeof(ts)==argl);
+	memcpy(ts, args, sizeof(ts));
+
+	*(ts[0]) = get_timestamp();
+	fibo(40);
+	*(ts[1]) = get_timestamp();
+	return 0;
+}
+
+BOOT_TEST(test_preemption,
+	"Test that children are executed preemptively."
+	)
+{
+#define NCHILDREN 2
+	unsigned int start[NCHILDREN], end[NCHILDREN];
+
+	for(int i=0;i<NCHILDREN;i++) {
+		unsigned int* args[2];
+		args[0] = &start[i];
+		args[1] = &end[i];
+
+		Exec(preemption_child, sizeof(args), args);
+	}
+
+
+	for(int i=0; i<NCHILDREN; i++)
+		WaitChild(NOPROC, NULL);
+
+	for(int i=0;i<NCHILDREN;i++)
+		for(int j=0; j<NCHILDREN; j++)
+			if(i!=j)
+				ASSERT(start[i] < end[j]);
+
+	return 0;
+
+#undef NCHILDREN
+}
+
+
+
+
+
+
+
+int compute_child(int argl, void* args)
+{
+	unsigned int fib = fibo(35);
+	return fib %3 ==1;
+}
+
+
+static double Trun;
+
+static int run_twice(int argl, void* args)
+{
+	struct timeval tstart;
+	mark_time(&tstart);
+	Exec(compute_child, 0, NULL);
+	Exec(compute_child, 0, NULL);
+	WaitChild(NOPROC, NULL);
+	WaitChild(NOPROC, NULL);
+	Trun = time_since(&tstart);
+	return 0;
+}
+
+BARE_TEST(test_parallelism,
+	"This test tests whether multiple cores are used in parallel.",
+	.timeout = 30, .minimum_cores=2,
+	)
+{
+
+	double run_times(uint ntimes, uint ncores)
+	{
+		double minTrun=0.0;
+		for(int I=0;I<ntimes; I++) {
+			boot(ncores, 0, run_twice, 0, NULL);
+			if(I==0)
+				minTrun = Trun;
+			else 
+				if(Trun < minTrun) minTrun = Trun;
+		}
+		return minTrun;
+	}
+
+	if(sysconf(_SC_NPROCESSORS_ONLN)<2) {
+		MSG("Cannot run this test on this machine, there is only 1 core.\n");
+		return;
+	}
+
+	double T1 = run_times(10, 1);
+	double T2 = run_times(10, 2);
+
+	MSG("1-core: %f   2-core: %f\n", T1, T2);
+	ASSERT_MSG( fabs(T1/T2  - 2.0) < 0.4, 
+		"Runtimes did not decrease enough. one core: %f sec    two cores: %f sec\n", 
+		T1, T2);
+}
+
+
+
+TEST_SUITE(concurrency_tests,
+	"A suite of tests which test the operational concurrency of the kernel."
+	)
+{
+	&test_multitask,
+	&test_preemption,
+	&test_parallelism,
+	NULL
+};
+
+
+
+
+
+/*********************************************
+ *
+ *
+ *
+ *  Terminal I/O tests
+ *
+ *
+ *
+ *********************************************/
+
+
+
+
+
+static int input_line(int argl, void* args)
+{
+	FILE* fin = fidopen(0, "r");
+	char* line=NULL;
+	size_t llen;
+
+	ASSERT(getline(&line, &llen, fin));
+	fclose(fin);
+	free(line);
+	return 0;
+}
+
+BOOT_TEST(test_input_concurrency,
+	"Test that input from one terminal does not obstruct input from other terminals.",
+	.minimum_terminals = 2
+	)
+{
+	void open_at_0(uint term)
+	{
+		Fid_t f = OpenTerminal(term);
+		ASSERT(f!=NOFILE);
+		if(f!=0) {
+			ASSERT(Dup2(f,0)==0);
+			ASSERT(Close(f)==0);
+		}
+	}
+
+	open_at_0(0);
+	Pid_t p0 = Exec(input_line, 0, NULL);
+	open_at_0(1);
+	Pid_t p1 = Exec(input_line, 0, NULL);
+
+	sendme(0, "Hello ");
+	sendme(1, "Hellow world\n");
+	ASSERT(WaitChild(p1, NULL)==p1);
+	sendme(0, " world\n");
+	ASSERT(WaitChild(p0, NULL)==p0);
+	return 0;
+}
+
+
+
+static int input_char(int argl, void* args)
+{
+	char c;
+	ASSERT(Read(0, &c, 1)==1);
+	return 0;
+}
+
+BOOT_TEST(test_term_input_driver_interrupt,
+	"Test that terminal input is interrupt driven. This is done by\n"
+	"opening a huge number of processes reading from the terminal and\n"
+	"measuring the effect on a compute process.",
+	.minimum_terminals = 1, .timeout = 100
+	)
+{
+	struct timeval t0;
+	double minTrun, maxTrun;
+
+	void run_times(uint ntimes)
+	{
+		for(int I=0;I<ntimes; I++) {
+			mark_time(&t0);
+			Pid_t pid = Exec(compute_child,0,NULL);
+			ASSERT(pid!=NOPROC);
+			ASSERT(WaitChild(pid, NULL)==pid);
+			double Trun = time_since(&t0);
+
+			if(I==0)
+				minTrun = maxTrun = Trun;
+			else {
+				if( Trun < minTrun) minTrun = Trun;
+				if( Trun > maxTrun) maxTrun = Trun;
+			}
+		}
+	}
+
+	void run_with_io(int nioproc)
+	{
+		for(int i=0; i< nioproc; i++)
+			ASSERT(Exec(input_char, 0, NULL)!=NOPROC);
+
+		/* If the readers are polling as the compute task runs, 
+		   this will take a long time! */
+		run_times(10);
+
+		char* dummy_input = malloc((nioproc+1)*sizeof(char));
+		for(int i=0; i< nioproc; i++)
+			dummy_input[i] = 'A';
+		dummy_input[nioproc] = '\0';
+		sendme(0, dummy_input);
+
+		free(dummy_input);
+		for(int i=0; i< nioproc; i++)
+			ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
+	}
+
+	Fid_t fid = OpenTerminal(0);
 	ASSERT(fid!=NOFILE);
 	if(fid!=0) {
 		ASSERT(Dup2(fid,0)==0);
-		ASSERT(Close(fid)==0);
-	}
-
-	Fid_t lsock = Socket(100);
-	ASSERT(lsock!=NOFILE);
-	if(lsock!=2) {
-		ASSERT(Dup2(lsock,2)==0);
-		ASSERT(Close(lsock)==0);
+		ASSERT(Close(fid)==0);		
 	}
 
-	ASSERT(Listen(2)==0);
-
-	Fid_t srv;
-	connect_sockets(0, 2, &srv, 100);
-
-	if(srv!=1) {
-		ASSERT(Dup2(srv,1)==0);
-		ASSERT(Close(srv)==0);
-	}
+	run_with_io(1000);
+	double T1000 = minTrun;
 
-	int N = 1000000;
-	for(int i=0;i<10;i++)
-		ASSERT(Exec(data_producer, sizeof(N), &N)!=NOPROC);
-	N = 10*N;
-	ASSERT(Exec(data_consumer, sizeof(N), &N)!=NOPROC);
+	run_with_io(0);
+	double T0 = minTrun;
 
-	Close(0);
-	Close(1);
+	MSG("Trun(0)= %f   Trun(1000)= %f\n", T0, T1000);
+	ASSERT_MSG( (T1000-T0)/T0 < 0.1, "Failed: Trun(0)= %f   Trun(1000)= %f\n", T0, T1000 );
 
-	for(int i=0;i<10;i++)
-		WaitChild(NOPROC,NULL);
-	WaitChild(NOPROC,NULL);
 	return 0;
 }
 
 
 
-BOOT_TEST(test_shudown_read,
-	"Test that ShutDown with SHUTDOWN_READ blocks Write"
+
+TEST_SUITE(io_tests,
+	"A suite of tests which test the concurrency of terminal I/O."
 	)
 {
-	Fid_t lsock;
-	lsock = Socket(100);   ASSERT(lsock!=NOFILE);
-	if(lsock!=0) { Dup2(lsock,0); Close(lsock); }
-	ASSERT(Listen(lsock)==0);
+	&test_input_concurrency,
+	&test_term_input_driver_interrupt,
+	NULL
+};
 
-	Fid_t cli = Socket(NOPORT); ASSERT(cli!=NOFILE);
-	Fid_t srv;
 
-	connect_sockets(cli, lsock, &srv, 100);
 
-	for(uint i=0; i< 2000; i++) {
-		check_transfer(cli, srv);
-		check_transfer(srv, cli);
-	}
 
-	ASSERT(Write(srv, "Hello world",12)==12);
+/*********************************************
+ *
+ *
+ *
+ *  Benchmarks
+ *
+ *
+ *
+ *********************************************/
 
-	ShutDown(cli, SHUTDOWN_READ);
-	char buffer[12];
-	ASSERT(Read(cli, buffer, 12)==-1);
-	ASSERT(Write(srv, "Hello world",12)==-1);
+/*
+	The benchmarks do not check correctness. Each of them boots the VM
+	once for every number of cores in bench_cores[], and reports rates
+	via MSG(). They are not part of all_tests; run them with
+	  ./validate_api benchmarks
 
-	for(uint i=0; i< 2000; i++) {
-		ASSERT(Write(srv, "Hello world",12)==-1);
-		check_transfer(cli, srv);
-	}
+	The benchmarks of kernel internals are in test_kernel.c.
+ */
 
-	return 0;
-}
+static const uint bench_cores[] = { 1, 2, 4, 8, 16, 32 };
+#define BENCH_CONFIGS (sizeof(bench_cores)/sizeof(uint))
 
 
-BOOT_TEST(test_shudown_write,
-	"Test that ShutDown with SHUTDOWN_WRITE first exhausts buffers and then causes Read to return 0"
-	)
+/* State of bench_timed_waiters */
+#define TW_WAITERS 10000
+#define TW_ROUNDS 5
+static struct {
+	double late_sum[TW_WAITERS], late_max[TW_WAITERS];
+	double wakeup_rate, mean_late, max_late;
+} tw;
+
+static int timed_waiter(int argl, void* args)
 {
-	Fid_t lsock;
-	lsock = Socket(100);   ASSERT(lsock!=NOFILE);
-	if(lsock!=0) { Dup2(lsock,0); Close(lsock); }
-	ASSERT(Listen(lsock)==0);
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	timeout_t t = 1 + (argl*7919) % 100;
+	struct timeval t0;
 
-	Fid_t cli = Socket(NOPORT); ASSERT(cli!=NOFILE);
-	Fid_t srv;
+	tw.late_sum[argl] = tw.late_max[argl] = 0.0;
+	Mutex_Lock(&mx);
+	for(int i=0; i<TW_ROUNDS; i++) {
+		mark_time(&t0);
+		Cond_TimedWait(&mx, &cv, t);
+		double late = time_since(&t0) - 1E-3*t;
+		tw.late_sum[argl] += late;
+		if(late > tw.late_max[argl]) tw.late_max[argl] = late;
+	}
+	Mutex_Unlock(&mx);
+	return 0;
+}
 
-	connect_sockets(cli, lsock, &srv, 100);
+static int timed_waiters_boot(int argl, void* args)
+{
+	Tid_t* tid = malloc(TW_WAITERS*sizeof(Tid_t));
+	struct timeval t0;
 
-	for(uint i=0; i< 2000; i++) {
-		check_transfer(cli, srv);
-		check_transfer(srv, cli);
+	mark_time(&t0);
+	for(int i=0; i<TW_WAITERS; i++)
+		tid[i] = CreateThread(timed_waiter, i, NULL);
+	for(int i=0; i<TW_WAITERS; i++)
+		ThreadJoin(tid[i], NULL);
+	tw.wakeup_rate = (double)TW_WAITERS*TW_ROUNDS / time_since(&t0);
+
+	tw.mean_late = tw.max_late = 0.0;
+	for(int i=0; i<TW_WAITERS; i++) {
+		tw.mean_late += tw.late_sum[i];
+		if(tw.late_max[i] > tw.max_late) tw.max_late = tw.late_max[i];
 	}
+	tw.mean_late /= TW_WAITERS*TW_ROUNDS;
+	free(tid);
+	return 0;
+}
 
-	ASSERT(Write(srv, "Hello world",12)==12);
-	ASSERT(Write(srv, "Hello world",12)==12);
-	ASSERT(Write(srv, "Hello world",12)==12);
+BARE_TEST(bench_timed_waiters,
+	"Measure the cost of timeouts with many sleeping threads. 10000 threads\n"
+	"repeatedly sleep on Cond_TimedWait, with timeouts spread between 1 and\n"
+	"100 msec. Report the wakeup rate and how late the wakeups were.",
+	.timeout = 600
+	)
+{
+	for(uint c=0; c<BENCH_CONFIGS; c++) {
+		boot(bench_cores[c], 0, timed_waiters_boot, 0, NULL);
+		MSG("cores=%2u   timeouts/sec=%10.0f   mean late=%7.2f ms   max late=%7.2f ms\n",
+			bench_cores[c], tw.wakeup_rate, 1E3*tw.mean_late, 1E3*tw.max_late);
+	}
+}
 
-	ShutDown(srv, SHUTDOWN_WRITE);
-	ASSERT(Write(srv, "Hello world",12)==-1);
 
-	/* We should still read the three writes before the close. */
-	char buffer[12];
-	for(uint i=0;i<3;i++) {
-		ASSERT(Read(cli, buffer, 12)==12);
-		ASSERT(strcmp(buffer,"Hello world")==0);
-	}
+/* State of bench_idle_timeouts */
+static struct {
+	double mean_late, max_late, cpu_usage;
+} it;
 
-	for(uint i=0; i< 2000; i++) {
-		ASSERT(Read(cli, buffer, 12)==0);
-		check_transfer(cli, srv);
-	}
+static int idle_timeouts_boot(int argl, void* args)
+{
+	const int ROUNDS = 20;
+	const timeout_t T = 50;
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	struct timeval t0, t1;
+	struct timespec c0, c1;
 
+	it.mean_late = it.max_late = 0.0;
+	mark_time(&t0);
+	CHECK(clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &c0));
+	Mutex_Lock(&mx);
+	for(int i=0; i<ROUNDS; i++) {
+		mark_time(&t1);
+		Cond_TimedWait(&mx, &cv, T);
+		double late = time_since(&t1) - 1E-3*T;
+		it.mean_late += late;
+		if(late > it.max_late) it.max_late = late;
+	}
+	Mutex_Unlock(&mx);
+	CHECK(clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &c1));
+	it.mean_late /= ROUNDS;
+	it.cpu_usage = ((c1.tv_sec-c0.tv_sec) + 1E-9*(c1.tv_nsec-c0.tv_nsec)) / time_since(&t0);
 	return 0;
 }
 
+BARE_TEST(bench_idle_timeouts,
+	"Measure timeout accuracy and host CPU usage when all cores are idle.\n"
+	"A single thread sleeps repeatedly on Cond_TimedWait for 50 msec.",
+	.timeout = 600
+	)
+{
+	for(uint c=0; c<BENCH_CONFIGS; c++) {
+		boot(bench_cores[c], 0, idle_timeouts_boot, 0, NULL);
+		MSG("cores=%2u   mean late=%7.2f ms   max late=%7.2f ms   host cpu=%6.2f%%\n",
+			bench_cores[c], 1E3*it.mean_late, 1E3*it.max_late, 100.0*it.cpu_usage);
+	}
+}
 
 
+/* State of bench_symposium_policies */
+#define SP_N 10
+#define SP_BITES 10
+static struct {
+	symposium_t symp;
+	struct timeval t0;
+	double elapsed, finish[SP_N];
+} sp;
 
-TEST_SUITE(socket_tests,
-	"A suite of tests for sockets."
+static int bench_philosopher(int i, void* args)
+{
+	SymposiumTable_philosopher(args, i);
+	sp.finish[i] = time_since(&sp.t0);
+	return 0;
+}
+
+static int symposium_boot(int argl, void* args)
+{
+	SymposiumTable S;
+	Tid_t tid[SP_N];
+
+	SymposiumTable_init(&S, &sp.symp);
+	mark_time(&sp.t0);
+	for(int i=0; i<SP_N; i++)
+		tid[i] = CreateThread(bench_philosopher, i, &S);
+	for(int i=0; i<SP_N; i++)
+		ThreadJoin(tid[i], NULL);
+	sp.elapsed = time_since(&sp.t0);
+	SymposiumTable_destroy(&S);
+	return 0;
+}
+
+BARE_TEST(bench_symposium_policies,
+	"Compare the scheduling policies on the symposium workload. Report the\n"
+	"throughput in bites/sec, and Jain's fairness index of the rates at which\n"
+	"the philosophers finish their bites (1.0 is perfectly fair).",
+	.timeout = 600
 	)
 {
-	&test_socket_constructor_many_per_port,
-	&test_socket_constructor_out_of_fids,
-	&test_socket_constructor_illegal_port,
-	
-	&test_listen_success,
-	&test_listen_fails_on_bad_fid,
-	&test_listen_fails_on_NOPORT,
-	&test_listen_fails_on_occupied_port,
-	&test_listen_fails_on_initialized_socket,
+	const int N = SP_N, BITES = SP_BITES;
+	const sched_policy policies[] = { POLICY_MLFQ, POLICY_FAIR, POLICY_RR };
+	const char* policy_names[] = { "mlfq", "fair", "rr" };
+	const uint cores[] = { 1, 4 };
+
+	sp.symp = (symposium_t) { .N = N, .bites = BITES };
+	adjust_symposium(&sp.symp, 0, 0);
+
+	for(uint c=0; c<sizeof(cores)/sizeof(uint); c++)
+	for(uint p=0; p<sizeof(policies)/sizeof(sched_policy); p++) {
+		/* The philosophers print their state on stdout */
+		fflush(stdout);
+		int saved_stdout = dup(1);
+		int devnull = open("/dev/null", O_WRONLY);
+		dup2(devnull, 1);
+
+		srand48(1);
+		boot_policy(policies[p], cores[c], 0, symposium_boot, 0, NULL);
+
+		fflush(stdout);
+		dup2(saved_stdout, 1);
+		close(saved_stdout);
+		close(devnull);
+
+		double sum = 0.0, sumsq = 0.0;
+		for(int i=0; i<N; i++) {
+			double rate = BITES / sp.finish[i];
+			sum += rate;
+			sumsq += rate*rate;
+		}
+		MSG("cores=%2u   policy=%s   bites/sec=%8.1f   fairness=%.3f\n",
+			cores[c], policy_names[p], N*BITES/sp.elapsed, sum*sum/(N*sumsq));
+	}
+}
 
-	&test_accept_succeds,
-	&test_accept_fails_on_bad_fid,
-	&test_accept_fails_on_unbound_socket,
-	&test_accept_fails_on_connected_socket,
-	&test_accept_reusable,
-	&test_accept_fails_on_exhausted_fid,
-	&test_accept_unblocks_on_close,
 
-	&test_connect_fails_on_bad_fid,
-	&test_connect_fails_on_bad_socket,
-	&test_connect_fails_on_illegal_port,
-	&test_connect_fails_on_non_listened_port,
-	&test_connect_fails_on_timeout,
+/* State of bench_edf_deadline_misses */
+#define EDF_PERIODS 50
+#define EDF_PERIOD 20
+#define EDF_BUDGET 5
+static struct {
+	volatile int stop;
+	unsigned long work;
+	int realtime, misses;
+} edf;
 
-	&test_socket_small_transfer,
-	&test_socket_single_producer,
-	&test_socket_multi_producer,
+/* Spin for a number of iterations */
+static void spin(unsigned long n) { for(volatile unsigned long i=0; i<n; i++); }
 
-	&test_shudown_read,
-	&test_shudown_write,
+static int edf_background(int argl, void* args)
+{
+	while(! edf.stop) spin(1000);
+	return 0;
+}
 
-	NULL
-};
+static int edf_periodic(int argl, void* args)
+{
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	struct timeval t0;
 
+	if(edf.realtime) assert(SetDeadline(EDF_PERIOD, EDF_BUDGET)==0);
+	mark_time(&t0);
+	Mutex_Lock(&mx);
+	for(int k=1; k<=EDF_PERIODS; k++) {
+		spin(edf.work);
+		double end = 1E3*time_since(&t0);
+		if(end > k*EDF_PERIOD)
+			__atomic_fetch_add(&edf.misses, 1, __ATOMIC_RELAXED);
+		else if(k*EDF_PERIOD - end >= 1.0)
+			Cond_TimedWait(&mx, &cv, (timeout_t)(k*EDF_PERIOD - end));
+	}
+	Mutex_Unlock(&mx);
+	return 0;
+}
 
+static int edf_boot(int argl, void* args)
+{
+	uint n = cpu_cores();
+	Tid_t bg[2*n], rt[n];
+	struct timeval t0;
 
+	/* Calibrate 2 msec of work */
+	mark_time(&t0);
+	spin(1000000);
+	edf.work = (unsigned long)(1000000 * 2E-3 / time_since(&t0));
+
+	edf.stop = 0;
+	edf.misses = 0;
+	for(uint i=0; i<2*n; i++) bg[i] = CreateThread(edf_background, 0, NULL);
+	for(uint i=0; i<n; i++) rt[i] = CreateThread(edf_periodic, 0, NULL);
+	for(uint i=0; i<n; i++) ThreadJoin(rt[i], NULL);
+	edf.stop = 1;
+	for(uint i=0; i<2*n; i++) ThreadJoin(bg[i], NULL);
+	return 0;
+}
 
-/*********************************************
- *
- *
- *
- *  Concurrency tests
- *
- *
- *
- *********************************************/
+BARE_TEST(bench_edf_deadline_misses,
+	"Measure the deadline-miss rate of periodic threads under CPU-bound\n"
+	"background load, as normal threads and as real-time threads.\n"
+	"Each periodic thread works for 2 msec in every 20 msec period.",
+	.timeout = 600
+	)
+{
+	const uint cores[] = { 1, 2, 4 };
+	const char* class_names[] = { "normal", "edf" };
+
+	for(uint c=0; c<sizeof(cores)/sizeof(uint); c++)
+	for(edf.realtime=0; edf.realtime<2; edf.realtime++) {
+		boot(cores[c], 0, edf_boot, 0, NULL);
+		MSG("cores=%2u   class=%-6s   deadline misses=%6.2f%%\n",
+			cores[c], class_names[edf.realtime], 100.0*edf.misses/(cores[c]*EDF_PERIODS));
+	}
+}
 
 
+/* State of bench_cond_broadcast */
+#define CB_WAITERS 64
+#define CB_ROUNDS 200
+static struct {
+	Mutex mx;
+	CondVar all_waiting, go;
+	int waiting, generation;
+	double round_rate, broadcast_time;
+} cb;
 
+static int broadcast_waiter(int argl, void* args)
+{
+	Mutex_Lock(&cb.mx);
+	for(int i=0; i<CB_ROUNDS; i++) {
+		int gen = cb.generation;
+		if(++cb.waiting == CB_WAITERS)
+			Cond_Signal(&cb.all_waiting);
+		while(gen == cb.generation)
+			Cond_Wait(&cb.mx, &cb.go);
+	}
+	Mutex_Unlock(&cb.mx);
+	return 0;
+}
 
+static int cond_broadcast_boot(int argl, void* args)
+{
+	Tid_t tid[CB_WAITERS];
+	struct timeval t0, t1;
+
+	cb.mx = MUTEX_INIT;
+	cb.all_waiting = cb.go = (CondVar) COND_INIT;
+	cb.waiting = cb.generation = 0;
+	cb.broadcast_time = 0.0;
+
+	mark_time(&t0);
+	for(int i=0; i<CB_WAITERS; i++)
+		tid[i] = CreateThread(broadcast_waiter, i, NULL);
+
+	Mutex_Lock(&cb.mx);
+	for(int i=0; i<CB_ROUNDS; i++) {
+		while(cb.waiting < CB_WAITERS)
+			Cond_Wait(&cb.mx, &cb.all_waiting);
+		cb.waiting = 0;
+		cb.generation++;
+		mark_time(&t1);
+		Cond_Broadcast(&cb.go);
+		cb.broadcast_time += time_since(&t1);
+	}
+	Mutex_Unlock(&cb.mx);
 
-unsigned int timestamp=0;
+	for(int i=0; i<CB_WAITERS; i++)
+		ThreadJoin(tid[i], NULL);
+	cb.round_rate = CB_ROUNDS / time_since(&t0);
+	return 0;
+}
 
-unsigned int get_timestamp()
+BARE_TEST(bench_cond_broadcast,
+	"Measure Cond_Broadcast with many waiters. 64 threads wait on a condition\n"
+	"variable, and a thread wakes them up with Cond_Broadcast once all of them\n"
+	"are waiting. Report the broadcast rate and the time spent in Cond_Broadcast.",
+	.timeout = 600
+	)
 {
-	return __atomic_fetch_add(&timestamp, 1, __ATOMIC_SEQ_CST);	
+	for(uint c=0; c<BENCH_CONFIGS; c++) {
+		boot(bench_cores[c], 0, cond_broadcast_boot, 0, NULL);
+		MSG("cores=%2u   broadcasts/sec=%8.0f   broadcast time=%7.1f usec\n",
+			bench_cores[c], cb.round_rate, 1E6*cb.broadcast_time/CB_ROUNDS);
+	}
 }
 
 
-BOOT_TEST(test_multitask,
-	"Test that Exec returns before execution of the child is finished."
-	)
+/* State of bench_wakeup_latency */
+#define WL_ROUNDS 500
+#define WL_BUCKETS 5
+static const double wl_limit[WL_BUCKETS] = { 1E-4, 1E-3, 1E-2, 1E-1, INFINITY };
+static struct {
+	int hist[WL_BUCKETS];
+	double max_lat;
+	volatile int stop;
+	int pending;
+	Mutex mx;
+	CondVar signalled, consumed;
+	struct timeval t_signal;
+} wl;
+
+static int wakeup_spinner(int argl, void* args)
 {
-	unsigned int tschild;
-	int child(int argl, void* args)
-	{
-		unsigned int f = fibo(38);
-		tschild = get_timestamp();
-		return f>10;
-	}	
+	while(! wl.stop);
+	return 0;
+}
 
-	Exec(child, 0, NULL);
-	unsigned int ts = get_timestamp();
-	WaitChild(NOPROC, NULL);
+static int wakeup_wakee(int argl, void* args)
+{
+	Mutex_Lock(&wl.mx);
+	for(int i=0; i<WL_ROUNDS; i++) {
+		while(! wl.pending)
+			Cond_Wait(&wl.mx, &wl.signalled);
+		double lat = time_since(&wl.t_signal);
+		int b = 0;
+		while(lat >= wl_limit[b]) b++;
+		wl.hist[b]++;
+		if(lat > wl.max_lat) wl.max_lat = lat;
+		wl.pending = 0;
+		Cond_Signal(&wl.consumed);
+	}
+	Mutex_Unlock(&wl.mx);
+	return 0;
+}
 
-	ASSERT(ts < tschild);
+static int wakeup_waker(int argl, void* args)
+{
+	Mutex tmx = MUTEX_INIT;
+	CondVar tcv = COND_INIT;
+	for(int i=0; i<WL_ROUNDS; i++) {
+		Mutex_Lock(&tmx);
+		Cond_TimedWait(&tmx, &tcv, 2);
+		Mutex_Unlock(&tmx);
+
+		Mutex_Lock(&wl.mx);
+		wl.pending = 1;
+		mark_time(&wl.t_signal);
+		Cond_Signal(&wl.signalled);
+		Mutex_Unlock(&wl.mx);
+
+		/* Keep working on this core for 1 msec */
+		while(time_since(&wl.t_signal) < 1E-3);
+
+		Mutex_Lock(&wl.mx);
+		while(wl.pending)
+			Cond_Wait(&wl.mx, &wl.consumed);
+		Mutex_Unlock(&wl.mx);
+	}
 	return 0;
 }
 
+static int wakeup_latency_boot(int argl, void* args)
+{
+	uint n = 2*(cpu_cores()-1);
+	Tid_t spin[n];
+
+	wl.stop = 0;
+	wl.pending = 0;
+	wl.mx = MUTEX_INIT;
+	wl.signalled = wl.consumed = (CondVar) COND_INIT;
+	wl.max_lat = 0.0;
+	for(int b=0; b<WL_BUCKETS; b++) wl.hist[b] = 0;
+
+	/* New threads inherit our affinity */
+	SetAffinity(ThreadSelf(), ALL_CORES & ~1u);
+	for(uint i=0; i<n; i++)
+		spin[i] = CreateThread(wakeup_spinner, 0, NULL);
+	/* Let the spinners sink to the lowest level */
+	sleep_thread(1);
 
+	Tid_t t1 = CreateThread(wakeup_wakee, 0, NULL);
+	Tid_t t2 = CreateThread(wakeup_waker, 0, NULL);
+	SetAffinity(t2, 1);
+	ThreadJoin(t1, NULL);
+	ThreadJoin(t2, NULL);
 
-BOOT_TEST(test_preemption,
-	"Test that children are executed preemptively."
+	wl.stop = 1;
+	for(uint i=0; i<n; i++)
+		ThreadJoin(spin[i], NULL);
+	return 0;
+}
+
+BARE_TEST(bench_wakeup_latency,
+	"Measure wakeup-to-run latency when cores run CPU-bound threads. Every\n"
+	"2 msec, an interactive thread on core 0 signals another one, which runs\n"
+	"on the other cores along with two CPU-bound threads per core. Report the\n"
+	"histogram of the delay from Cond_Signal until the other thread runs.",
+	.timeout = 600
 	)
 {
-	int child(int argl, void* args)
-	{
-		unsigned int* ts[2];
-		assert(sizeof(ts)==argl);
-		memcpy(ts, args, sizeof(ts));
+	const uint cores[] = { 2, 4 };
 
-		*(ts[0]) = get_timestamp();
-		fibo(40);
-		*(ts[1]) = get_timestamp();
-		return 0;
+	for(uint c=0; c<sizeof(cores)/sizeof(uint); c++) {
+		boot(cores[c], 0, wakeup_latency_boot, 0, NULL);
+		MSG("cores=%2u   <0.1ms:%4d  <1ms:%4d  <10ms:%4d  <100ms:%4d  >=100ms:%4d   max=%7.1f ms\n",
+			cores[c], wl.hist[0], wl.hist[1], wl.hist[2], wl.hist[3], wl.hist[4], 1E3*wl.max_lat);
 	}
+}
 
-#define NCHILDREN 2
-	unsigned int start[NCHILDREN], end[NCHILDREN];
 
-	for(int i=0;i<NCHILDREN;i++) {
-		unsigned int* args[2];
-		args[0] = &start[i];
-		args[1] = &end[i];
+static int do_nothing(int argl, void* args) { return 0; }
+
+/* State of bench_thread_churn */
+static const int tc_rounds[] = { 1, 64 };
+static double tc_rate[2];
+
+static int thread_churn_boot(int argl, void* args)
+{
+	const int THREADS = 2000;
+	Tid_t tid[64];
+	struct timeval t0;
+	for(int r=0; r<2; r++) {
+		mark_time(&t0);
+		for(int i=0; i<THREADS; i+=tc_rounds[r]) {
+			for(int j=0; j<tc_rounds[r]; j++)
+				tid[j] = CreateThread(do_nothing, 0, NULL);
+			for(int j=0; j<tc_rounds[r]; j++)
+				ThreadJoin(tid[j], NULL);
+		}
+		tc_rate[r] = THREADS / time_since(&t0);
+	}
+	return 0;
+}
 
-		Exec(child, sizeof(args), args);
+BARE_TEST(bench_thread_churn,
+	"Measure the rate of thread creation and exit. Threads are created\n"
+	"in rounds of 1 and of 64, and joined after each round.",
+	.timeout = 600
+	)
+{
+	for(uint c=0; c<BENCH_CONFIGS; c++) {
+		boot(bench_cores[c], 0, thread_churn_boot, 0, NULL);
+		MSG("cores=%2u   threads/sec: one at a time=%8.0f   64 at a time=%8.0f\n",
+			bench_cores[c], tc_rate[0], tc_rate[1]);
 	}
+}
 
 
-	for(int i=0; i<NCHILDREN; i++)
-		WaitChild(NOPROC, NULL);
+/* State of bench_spawn_join */
+#define SJ_CHILDREN 5000
+static double sj_rate;
 
-	for(int i=0;i<NCHILDREN;i++)
-		for(int j=0; j<NCHILDREN; j++)
-			if(i!=j)
-				ASSERT(start[i] < end[j]);
+static int sj_child(int argl, void* args)
+{
+	Tid_t tid[4];
+	for(int j=0; j<4; j++)
+		tid[j] = CreateThread(do_nothing, 0, NULL);
+	for(int j=0; j<4; j++)
+		ThreadJoin(tid[j], NULL);
+	return 0;
+}
 
+static int sj_spawner(int argl, void* args)
+{
+	for(int i=0; i<SJ_CHILDREN; i++) {
+		Exec(sj_child, 0, NULL);
+		WaitChild(NOPROC, NULL);
+	}
 	return 0;
+}
 
-#undef NCHILDREN
+static int spawn_join_boot(int P, void* args)
+{
+	struct timeval t0;
+	mark_time(&t0);
+	for(int i=0; i<P; i++)
+		Exec(sj_spawner, 0, NULL);
+	for(int i=0; i<P; i++)
+		WaitChild(NOPROC, NULL);
+	sj_rate = P * SJ_CHILDREN / time_since(&t0);
+	return 0;
 }
 
+BARE_TEST(bench_spawn_join,
+	"Measure the total rate of process lifecycles, with 1, 2 and 4 processes\n"
+	"each spawning children one at a time. Each child creates and joins\n"
+	"4 threads.",
+	.timeout = 600
+	)
+{
+	const int spawners[] = { 1, 2, 4 };
+
+	for(uint c=0; c<3; c++)
+	for(uint k=0; k<3; k++) {
+		boot(bench_cores[c], 0, spawn_join_boot, spawners[k], NULL);
+		MSG("cores=%2u   spawners=%d   processes/sec=%8.0f\n",
+			bench_cores[c], spawners[k], sj_rate);
+	}
+}
 
 
+/* The resident memory of this process, in kbytes */
+static long resident_kbytes()
+{
+	long size, resident = 0;
+	FILE* f = fopen("/proc/self/statm", "r");
+	if(f) {
+		if(fscanf(f, "%ld %ld", &size, &resident) != 2) resident = 0;
+		fclose(f);
+	}
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
 
+/* State of bench_thread_memory */
+#define TM_THREADS 5000
+static struct {
+	Mutex mx;
+	CondVar cv;
+	int go;
+	Tid_t tid[TM_THREADS];
+	double kb[2];
+} tm;
 
-void mark_time(struct timeval* t)
+static int tm_blocked(int argl, void* args)
 {
-	CHECK(gettimeofday(t, NULL));
+	Mutex_Lock(&tm.mx);
+	while(!tm.go) Cond_Wait(&tm.mx, &tm.cv);
+	Mutex_Unlock(&tm.mx);
+	return 0;
 }
-double time_since(struct timeval* t0)
+
+static int thread_memory_boot(int argl, void* args)
 {
-	struct timeval t1;
-	mark_time(&t1);
+	const size_t sizes[] = { 0, 16*1024 };
+
+	tm.mx = MUTEX_INIT;
+	tm.cv = COND_INIT;
+	for(int r=0; r<2; r++) {
+		long rss0 = resident_kbytes();
+		tm.go = 0;
+		for(int i=0; i<TM_THREADS; i++)
+			tm.tid[i] = CreateThreadEx(tm_blocked, 0, NULL, sizes[r]);
+		/* Let them all block */
+		for(int i=0; i<TM_THREADS; i++) {
+			size_t used = 0;
+			while(GetStackUsage(tm.tid[i], NULL, &used)==0 && used == 0)
+				sleep_msec(1);
+		}
+		Mutex_Lock(&tm.mx);
+		tm.kb[r] = (double)(resident_kbytes() - rss0) / TM_THREADS;
+		tm.go = 1;
+		Cond_Broadcast(&tm.cv);
+		Mutex_Unlock(&tm.mx);
+		for(int i=0; i<TM_THREADS; i++)
+			ThreadJoin(tm.tid[i], NULL);
+	}
+	return 0;
+}
 
-	return ((double)(t1.tv_sec-t0->tv_sec)) + 1E-6* (t1.tv_usec - t0->tv_usec);
+BARE_TEST(bench_thread_memory,
+	"Measure the resident memory per blocked thread, for the default\n"
+	"stack size and for 16 kbyte stacks.",
+	.timeout = 300
+	)
+{
+	boot(1, 0, thread_memory_boot, 0, NULL);
+	MSG("kbytes per thread: default stack=%6.1f   16K stack=%6.1f\n", tm.kb[0], tm.kb[1]);
 }
 
 
-int compute_child(int argl, void* args)
+/* State of bench_pipe_rpc */
+static struct {
+	pipe_t req, rsp, stream;
+	double rtt, mbps;
+} pr;
+
+static int rpc_server(int argl, void* args)
 {
-	unsigned int fib = fibo(35);
-	return fib %3 ==1;
+	char msg[64];
+	while(Read(pr.req.read, msg, sizeof(msg)) == sizeof(msg))
+		Write(pr.rsp.write, msg, sizeof(msg));
+	return 0;
 }
 
+static int stream_reader(int argl, void* args)
+{
+	char buf[4096];
+	while(Read(pr.stream.read, buf, sizeof(buf)) > 0);
+	return 0;
+}
 
-BARE_TEST(test_parallelism,
-	"This test tests whether multiple cores are used in parallel.",
-	.timeout = 30, .minimum_cores=2,
-	)
+static int pipe_rpc_boot(int argl, void* args)
 {
+	const int ROUNDS = 20000;
+	const int STREAM = 16*1024*1024;
 
-	struct timeval tstart;
-	double Trun;
+	ASSERT(Pipe(&pr.req)==0);
+	ASSERT(Pipe(&pr.rsp)==0);
 
-	int run_twice(int argl, void* args)
-	{
-		mark_time(&tstart);
-		Exec(compute_child, 0, NULL);
-		Exec(compute_child, 0, NULL);
-		WaitChild(NOPROC, NULL);
-		WaitChild(NOPROC, NULL);
-		Trun = time_since(&tstart);
-		return 0;
+	struct timeval t0;
+	char msg[64] = { 0 };
+	Tid_t t = CreateThread(rpc_server, 0, NULL);
+	mark_time(&t0);
+	for(int i=0; i<ROUNDS; i++) {
+		Write(pr.req.write, msg, sizeof(msg));
+		for(int n=0; n<sizeof(msg); )
+			n += Read(pr.rsp.read, msg+n, sizeof(msg)-n);
 	}
+	pr.rtt = 1E6 * time_since(&t0) / ROUNDS;
+	Close(pr.req.write);
+	ThreadJoin(t, NULL);
+	Close(pr.req.read); Close(pr.rsp.read); Close(pr.rsp.write);
+
+	/* Streaming */
+	ASSERT(Pipe(&pr.stream)==0);
+	t = CreateThread(stream_reader, 0, NULL);
+	mark_time(&t0);
+	for(int n=0; n<STREAM; n+=sizeof(msg))
+		Write(pr.stream.write, msg, sizeof(msg));
+	Close(pr.stream.write);
+	ThreadJoin(t, NULL);
+	pr.mbps = STREAM / time_since(&t0) / (1024*1024);
+	Close(pr.stream.read);
+	return 0;
+}
 
-
-	double run_times(uint ntimes, uint ncores)
-	{
-		double minTrun=0.0;
-		for(int I=0;I<ntimes; I++) {
-			boot(ncores, 0, run_twice, 0, NULL);
-			if(I==0)
-				minTrun = Trun;
-			else 
-				if(Trun < minTrun) minTrun = Trun;
-		}
-		return minTrun;
+BARE_TEST(bench_pipe_rpc,
+	"Measure the round-trip time of a request/response exchange between\n"
+	"two threads over a pair of pipes, and the throughput of streaming\n"
+	"small writes over one pipe.",
+	.timeout = 600
+	)
+{
+	for(uint c=0; c<3; c++) {
+		boot(bench_cores[c], 0, pipe_rpc_boot, 0, NULL);
+		MSG("cores=%2u   round trip=%7.2f usec   64-byte stream=%7.1f Mbytes/sec\n",
+			bench_cores[c], pr.rtt, pr.mbps);
 	}
+}
 
-	if(sysconf(_SC_NPROCESSORS_ONLN)<2) {
-		MSG("Cannot run this test on this machine, there is only 1 core.\n");
-		return;
-	}
 
-	double T1 = run_times(10, 1);
-	double T2 = run_times(10, 2);
+/* State of bench_pipe_pairs */
+#define PP_STREAM (8*1024*1024)
+static double pp_mbps;
 
-	MSG("1-core: %f   2-core: %f\n", T1, T2);
-	ASSERT_MSG( fabs(T1/T2  - 2.0) < 0.4, 
-		"Runtimes did not decrease enough. one core: %f sec    two cores: %f sec\n", 
-		T1, T2);
+static int pair_reader(int argl, void* args)
+{
+	char buf[4096];
+	Close(argl >> 8);
+	while(Read(argl & 0xff, buf, sizeof(buf)) > 0);
+	return 0;
 }
 
+static int pair_writer(int argl, void* args)
+{
+	char msg[512] = { 0 };
+	Close(argl >> 8);
+	for(int n=0; n<PP_STREAM; n+=sizeof(msg))
+		Write(argl & 0xff, msg, sizeof(msg));
+	return 0;
+}
 
+static int pipe_pairs_boot(int P, void* args)
+{
+	struct timeval t0;
+	pipe_t p[P];
+	for(int i=0; i<P; i++)
+		ASSERT(Pipe(&p[i])==0);
+
+	mark_time(&t0);
+	for(int i=0; i<P; i++) {
+		Exec(pair_reader, p[i].read | (p[i].write << 8), NULL);
+		Exec(pair_writer, p[i].write | (p[i].read << 8), NULL);
+		Close(p[i].read); Close(p[i].write);
+	}
+	for(int i=0; i<2*P; i++)
+		WaitChild(NOPROC, NULL);
+	pp_mbps = P * (double)PP_STREAM / time_since(&t0) / (1024*1024);
+	return 0;
+}
 
-TEST_SUITE(concurrency_tests,
-	"A suite of tests which test the operational concurrency of the kernel."
+BARE_TEST(bench_pipe_pairs,
+	"Measure the total throughput of 1, 2 and 4 independent pipes, each\n"
+	"streamed from a writer to a reader process with 512-byte writes.",
+	.timeout = 600
 	)
 {
-	&test_multitask,
-	&test_preemption,
-	&test_parallelism,
-	NULL
-};
+	const int pairs[] = { 1, 2, 4 };
 
+	for(uint c=0; c<3; c++)
+	for(uint k=0; k<3; k++) {
+		boot(bench_cores[c], 0, pipe_pairs_boot, pairs[k], NULL);
+		MSG("cores=%2u   pipes=%d   total=%7.1f Mbytes/sec\n",
+			bench_cores[c], pairs[k], pp_mbps);
+	}
+}
 
 
+/* State of bench_mutex_contention */
+#define MC_THREADS 8
+#define MC_ROUNDS 20000
+static struct {
+	Mutex mx;
+	volatile long counter;
+	double hold;
+	double rate[2];
+} mc;
 
+static int mutex_locker(int argl, void* args)
+{
+	struct timeval t;
+	for(int i=0; i<MC_ROUNDS; i++) {
+		Mutex_Lock(&mc.mx);
+		mc.counter++;
+		if(mc.hold > 0.0) {
+			mark_time(&t);
+			while(time_since(&t) < mc.hold);
+		}
+		Mutex_Unlock(&mc.mx);
+	}
+	return 0;
+}
 
-/*********************************************
- *
- *
- *
- *  Terminal I/O tests
- *
- *
- *
- *********************************************/
+static int mutex_contention_boot(int argl, void* args)
+{
+	const double holds[] = { 0.0, 2E-6 };
+	Tid_t tid[MC_THREADS];
+	struct timeval t0;
 
+	mc.mx = MUTEX_INIT;
+	for(int r=0; r<2; r++) {
+		mc.hold = holds[r];
+		mc.counter = 0;
+		mark_time(&t0);
+		for(int i=0; i<MC_THREADS; i++)
+			tid[i] = CreateThread(mutex_locker, 0, NULL);
+		for(int i=0; i<MC_THREADS; i++)
+			ThreadJoin(tid[i], NULL);
+		mc.rate[r] = mc.counter / time_since(&t0);
+		ASSERT(mc.counter == MC_THREADS*MC_ROUNDS);
+	}
+	return 0;
+}
 
+BARE_TEST(bench_mutex_contention,
+	"Measure the rate of Mutex_Lock/Mutex_Unlock pairs of 8 threads on one\n"
+	"mutex, for an empty critical section and for one of about 2 usec.",
+	.timeout = 600
+	)
+{
+	for(uint c=0; c<3; c++) {
+		boot(bench_cores[c], 0, mutex_contention_boot, 0, NULL);
+		MSG("cores=%2u   locks/sec: empty=%10.0f   2 usec hold=%9.0f\n",
+			bench_cores[c], mc.rate[0], mc.rate[1]);
+	}
+}
 
 
+/* State of bench_syscall_batch */
+#define SB_BURSTS 200000
+static struct {
+	Fid_t null;
+	char msg[64];
+	int batched;
+	double rate[2][2];
+} sb;
 
-BOOT_TEST(test_input_concurrency,
-	"Test that input from one terminal does not obstruct input from other terminals.",
-	.minimum_terminals = 2
-	)
+static int syscall_burster(int fd, void* args)
 {
-	void open_at_0(uint term)
-	{
-		Fid_t f = OpenTerminal(term);
-		ASSERT(f!=NOFILE);
-		if(f!=0) {
-			ASSERT(Dup2(f,0)==0);
-			ASSERT(Close(f)==0);
+	syscall_entry burst[] = {
+		Batch_Dup2(sb.null, fd),
+		Batch_Write(fd, sb.msg, sizeof(sb.msg)),
+		Batch_Write(fd, sb.msg, sizeof(sb.msg)),
+		Batch_Close(fd),
+		Batch_GetPid()
+	};
+	for(int i=0; i<SB_BURSTS; i++) {
+		if(sb.batched)
+			SyscallBatch(burst, 5, BATCH_STOP_ON_ERROR);
+		else {
+			Dup2(sb.null, fd);
+			Write(fd, sb.msg, sizeof(sb.msg));
+			Write(fd, sb.msg, sizeof(sb.msg));
+			Close(fd);
+			GetPid();
 		}
 	}
+	return 0;
+}
 
-	int input_line(int argl, void* args)
-	{
-		FILE* fin = fidopen(0, "r");
-		char* line=NULL;
-		size_t llen;
+static const int sb_threads[] = { 1, 8 };
+
+static int syscall_batch_boot(int argl, void* args)
+{
+	sb.null = OpenNull();
 
-		ASSERT(getline(&line, &llen, fin));
-		fclose(fin);
-		free(line);
-		return 0;
+	struct timeval t0;
+	for(int k=0; k<2; k++)
+	for(sb.batched=0; sb.batched<2; sb.batched++) {
+		Tid_t tid[sb_threads[k]];
+		mark_time(&t0);
+		for(int i=0; i<sb_threads[k]; i++)
+			tid[i] = CreateThread(syscall_burster, 1+i, NULL);
+		for(int i=0; i<sb_threads[k]; i++)
+			ThreadJoin(tid[i], NULL);
+		sb.rate[k][sb.batched] = sb_threads[k] * SB_BURSTS / time_since(&t0);
 	}
+	return 0;
+}
 
+BARE_TEST(bench_syscall_batch,
+	"Measure the rate of a burst of Dup2, Write, Write, Close and GetPid on the\n"
+	"null device, made one call at a time and as one SyscallBatch, with 1\n"
+	"and 8 threads.",
+	.timeout = 600
+	)
+{
+	for(uint c=0; c<3; c++) {
+		boot(bench_cores[c], 0, syscall_batch_boot, 0, NULL);
+		for(int k=0; k<2; k++)
+			MSG("cores=%2u   threads=%d   bursts/sec: one by one=%9.0f   batched=%9.0f\n",
+				bench_cores[c], sb_threads[k], sb.rate[k][0], sb.rate[k][1]);
+	}
+}
 
-	open_at_0(0);
-	Pid_t p0 = Exec(input_line, 0, NULL);
-	open_at_0(1);
-	Pid_t p1 = Exec(input_line, 0, NULL);
 
-	sendme(0, "Hello ");
-	sendme(1, "Hellow world\n");
-	ASSERT(WaitChild(p1, NULL)==p1);
-	sendme(0, " world\n");
-	ASSERT(WaitChild(p0, NULL)==p0);
+/* State of bench_getters */
+#define GT_CALLS 1000000
+static const int gt_threads[] = { 1, 8 };
+static double gt_rate[2];
+
+static int getter_caller(int argl, void* args)
+{
+	volatile uintptr_t sink = 0;
+	for(int i=0; i<GT_CALLS; i+=4) {
+		sink += GetPid();
+		sink += GetPPid();
+		sink += ThreadSelf();
+		sink += GetTerminalDevices();
+	}
 	return 0;
 }
 
+static int getters_boot(int argl, void* args)
+{
+	struct timeval t0;
+	for(int k=0; k<2; k++) {
+		Tid_t tid[gt_threads[k]];
+		mark_time(&t0);
+		for(int i=0; i<gt_threads[k]; i++)
+			tid[i] = CreateThread(getter_caller, 0, NULL);
+		for(int i=0; i<gt_threads[k]; i++)
+			ThreadJoin(tid[i], NULL);
+		gt_rate[k] = gt_threads[k] * (double)GT_CALLS / time_since(&t0);
+	}
+	return 0;
+}
 
-
-BOOT_TEST(test_term_input_driver_interrupt,
-	"Test that terminal input is interrupt driven. This is done by\n"
-	"opening a huge number of processes reading from the terminal and\n"
-	"measuring the effect on a compute process.",
-	.minimum_terminals = 1, .timeout = 100
+BARE_TEST(bench_getters,
+	"Measure the rate of calls to GetPid, GetPPid, ThreadSelf and\n"
+	"GetTerminalDevices, with 1 and 8 threads.",
+	.timeout = 600
 	)
 {
-	int input_char(int argl, void* args)
-	{
-		char c;
-		ASSERT(Read(0, &c, 1)==1);
-		return 0;
+	for(uint c=0; c<3; c++) {
+		boot(bench_cores[c], 0, getters_boot, 0, NULL);
+		MSG("cores=%2u   calls/sec: 1 thread=%10.0f   8 threads=%10.0f\n",
+			bench_cores[c], gt_rate[0], gt_rate[1]);
 	}
+}
 
-	struct timeval t0;
-	double minTrun, maxTrun;
 
-	void run_times(uint ntimes)
-	{
-		for(int I=0;I<ntimes; I++) {
-			mark_time(&t0);
-			Pid_t pid = Exec(compute_child,0,NULL);
-			ASSERT(pid!=NOPROC);
-			ASSERT(WaitChild(pid, NULL)==pid);
-			double Trun = time_since(&t0);
+/* State of bench_futex_sync */
+#define FS_LOCKS 2000000
+#define FS_ROUNDS 20000
+static struct {
+	Mutex mx;
+	CondVar cv;
+	int turn;
+	semaphore ping, pong;
+	double mx_rate, fmx_rate, cv_rtt, sem_rtt;
+} fs;
 
-			if(I==0)
-				minTrun = maxTrun = Trun;
-			else {
-				if( Trun < minTrun) minTrun = Trun;
-				if( Trun > maxTrun) maxTrun = Trun;
-			}
-		}
+static int cv_pong(int argl, void* args)
+{
+	Mutex_Lock(&fs.mx);
+	for(int i=0; i<FS_ROUNDS; i++) {
+		while(fs.turn != 1) Cond_Wait(&fs.mx, &fs.cv);
+		fs.turn = 0;
+		Cond_Broadcast(&fs.cv);
 	}
+	Mutex_Unlock(&fs.mx);
+	return 0;
+}
 
-	void run_with_io(int nioproc)
-	{
-		for(int i=0; i< nioproc; i++)
-			ASSERT(Exec(input_char, 0, NULL)!=NOPROC);
-
-		/* If the readers are polling as the compute task runs, 
-		   this will take a long time! */
-		run_times(10);
+static int sem_pong(int argl, void* args)
+{
+	for(int i=0; i<FS_ROUNDS; i++) { SemWait(&fs.ping); SemPost(&fs.pong); }
+	return 0;
+}
 
-		char* dummy_input = malloc((nioproc+1)*sizeof(char));
-		for(int i=0; i< nioproc; i++)
-			dummy_input[i] = 'A';
-		dummy_input[nioproc] = '\0';
-		sendme(0, dummy_input);
+static int futex_sync_boot(int argl, void* args)
+{
+	struct timeval t0;
 
-		free(dummy_input);
-		for(int i=0; i< nioproc; i++)
-			ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
+	fs.mx = MUTEX_INIT;
+	mark_time(&t0);
+	for(int i=0; i<FS_LOCKS; i++) { Mutex_Lock(&fs.mx); Mutex_Unlock(&fs.mx); }
+	fs.mx_rate = FS_LOCKS / time_since(&t0);
+
+	fmutex fmx = FMUTEX_INIT;
+	mark_time(&t0);
+	for(int i=0; i<FS_LOCKS; i++) { FMutexLock(&fmx); FMutexUnlock(&fmx); }
+	fs.fmx_rate = FS_LOCKS / time_since(&t0);
+
+	/* Ping-pong with a condition variable */
+	fs.cv = COND_INIT;
+	fs.turn = 0;
+	Tid_t t = CreateThread(cv_pong, 0, NULL);
+	mark_time(&t0);
+	Mutex_Lock(&fs.mx);
+	for(int i=0; i<FS_ROUNDS; i++) {
+		fs.turn = 1;
+		Cond_Broadcast(&fs.cv);
+		while(fs.turn != 0) Cond_Wait(&fs.mx, &fs.cv);
 	}
+	Mutex_Unlock(&fs.mx);
+	fs.cv_rtt = 1E6 * time_since(&t0) / FS_ROUNDS;
+	ThreadJoin(t, NULL);
+
+	/* Ping-pong with semaphores */
+	fs.ping = fs.pong = (semaphore) SEMAPHORE_INIT(0);
+	t = CreateThread(sem_pong, 0, NULL);
+	mark_time(&t0);
+	for(int i=0; i<FS_ROUNDS; i++) { SemPost(&fs.ping); SemWait(&fs.pong); }
+	fs.sem_rtt = 1E6 * time_since(&t0) / FS_ROUNDS;
+	ThreadJoin(t, NULL);
+	return 0;
+}
 
-	Fid_t fid = OpenTerminal(0);
-	ASSERT(fid!=NOFILE);
-	if(fid!=0) {
-		ASSERT(Dup2(fid,0)==0);
-		ASSERT(Close(fid)==0);		
+BARE_TEST(bench_futex_sync,
+	"Measure the futex primitives of tinyoslib against Mutex and CondVar:\n"
+	"uncontended lock/unlock pairs, and a ping-pong between two threads,\n"
+	"with semaphores and with a condition variable.",
+	.timeout = 600
+	)
+{
+	for(uint c=0; c<3; c++) {
+		boot(bench_cores[c], 0, futex_sync_boot, 0, NULL);
+		MSG("cores=%2u   locks/sec: Mutex=%10.0f fmutex=%10.0f   ping-pong: CondVar=%6.2f usec semaphore=%6.2f usec\n",
+			bench_cores[c], fs.mx_rate, fs.fmx_rate, fs.cv_rtt, fs.sem_rtt);
 	}
+}
 
-	run_with_io(1000);
-	double T1000 = minTrun;
 
-	run_with_io(0);
-	double T0 = minTrun;
+/* State of bench_batch_class */
+#define BC_THREADS 8
+#define BC_WORK 50000000
+static struct {
+	double elapsed, late;
+	volatile int done;
+} bc;
 
-	MSG("Trun(0)= %f   Trun(1000)= %f\n", T0, T1000);
-	ASSERT_MSG( (T1000-T0)/T0 < 0.1, "Failed: Trun(0)= %f   Trun(1000)= %f\n", T0, T1000 );
+static int bc_burner(int argl, void* args)
+{
+	SetSchedClass(argl);
+	for(volatile int i=0; i<BC_WORK; i++);
+	return 0;
+}
 
+static int bc_sleeper(int argl, void* args)
+{
+	struct timeval t0;
+	int word = 0;
+	int naps = 0;
+	bc.late = 0.0;
+	while(! bc.done) {
+		mark_time(&t0);
+		FutexWait(&word, 0, 5);
+		bc.late += time_since(&t0) - 0.005;
+		naps++;
+	}
+	bc.late /= naps;
+	return 0;
+}
+
+static int batch_class_boot(int argl, void* args)
+{
+	struct timeval t0;
+	Tid_t tid[BC_THREADS];
+
+	bc.done = 0;
+	Tid_t s = CreateThread(bc_sleeper, 0, NULL);
+	mark_time(&t0);
+	for(int i=0; i<BC_THREADS; i++)
+		tid[i] = CreateThread(bc_burner, argl, NULL);
+	for(int i=0; i<BC_THREADS; i++)
+		ThreadJoin(tid[i], NULL);
+	bc.elapsed = time_since(&t0);
+	bc.done = 1;
+	ThreadJoin(s, NULL);
 	return 0;
 }
 
+BARE_TEST(bench_batch_class,
+	"Run CPU-bound threads in the normal and in the batch class, next to\n"
+	"a thread that sleeps for 5 msec at a time. Report the time to finish\n"
+	"the CPU-bound work, and how late the sleeper wakes up on average\n"
+	"meanwhile.",
+	.timeout = 600
+	)
+{
+	const char* class_names[] = { "normal", "batch" };
 
+	for(uint c=0; c<3; c++)
+	for(int cls = CLASS_NORMAL; cls <= CLASS_BATCH; cls++) {
+		boot(bench_cores[c], 0, batch_class_boot, cls, NULL);
+		MSG("cores=%2u   class=%-6s   work time=%6.3f sec   sleeper late by=%7.2f msec\n",
+			bench_cores[c], class_names[cls], bc.elapsed, 1E3*bc.late);
+	}
+}
 
 
-TEST_SUITE(io_tests,
-	"A suite of tests which test the concurrency of terminal I/O."
+TEST_SUITE(benchmarks,
+	"A suite of kernel performance benchmarks. These always succeed."
 	)
 {
-	&test_input_concurrency,
-	&test_term_input_driver_interrupt,
+	&bench_timed_waiters,
+	&bench_idle_timeouts,
+	&bench_symposium_policies,
+	&bench_edf_deadline_misses,
+	&bench_cond_broadcast,
+	&bench_wakeup_latency,
+	&bench_thread_churn,
+	&bench_spawn_join,
+	&bench_thread_memory,
+	&bench_pipe_rpc,
+	&bench_pipe_pairs,
+	&bench_mutex_contention,
+	&bench_syscall_batch,
+	&bench_getters,
+	&bench_futex_sync,
+	&bench_batch_class,
 	NULL
 };
 
@@ -2613,6 +4608,7 @@ int main(int argc, char** argv)
 {
 	register_test(&all_tests);
 	register_test(&user_tests);
+	register_test(&benchmarks);
 	return run_program(argc, argv, &all_tests);
 }
 